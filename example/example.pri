@@ -14,6 +14,6 @@ CONFIG(debug, debug|release) {
     QXMPP_DIR = ../../source/release
 }
 
-LIBS += -L$$QXMPP_DIR -l$$QXMPP_LIB
+LIBS += -L$$QXMPP_DIR -l$$QXMPP_LIB -lz
 PRE_TARGETDEPS += $${QXMPP_DIR}/lib$${QXMPP_LIB}.a
 
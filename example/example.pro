@@ -7,5 +7,6 @@ SUBDIRS = example_0_connected\
           example_4_ibbTransferTarget\
           example_5_rpcInterface\
           example_6_rpcClient\
-          example_7_archiveHandling
+          example_7_archiveHandling\
+          example_8_transferBenchmark
 
@@ -0,0 +1,12 @@
+include(../example.pri)
+
+TARGET = example_8_transferBenchmark
+
+SOURCES +=  main.cpp \
+            loopbackServer.cpp \
+            transferBenchmark.cpp
+
+HEADERS +=  loopbackServer.h \
+            transferBenchmark.h
+
+OTHER_FILES += README
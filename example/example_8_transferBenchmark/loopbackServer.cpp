@@ -0,0 +1,293 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <QDomDocument>
+#include <QTcpSocket>
+#include <QTextStream>
+#include <QXmlStreamWriter>
+
+#include "QXmppUtils.h"
+
+#include "loopbackServer.h"
+
+static const char *ns_bind = "urn:ietf:params:xml:ns:xmpp-bind";
+static const char *ns_roster = "jabber:iq:roster";
+static const char *ns_sasl = "urn:ietf:params:xml:ns:xmpp-sasl";
+static const char *ns_session = "urn:ietf:params:xml:ns:xmpp-session";
+static const char *ns_stanza = "urn:ietf:params:xml:ns:xmpp-stanzas";
+
+LoopbackServer::Session::Session()
+    : authenticated(false)
+{
+}
+
+LoopbackServer::LoopbackServer(const QString &domain, QObject *parent)
+    : QTcpServer(parent),
+    m_domain(domain),
+    m_streamCount(0)
+{
+    bool check = connect(this, SIGNAL(newConnection()),
+                         this, SLOT(slotNewConnection()));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
+}
+
+/// Returns the domain served by this server.
+///
+
+QString LoopbackServer::domain() const
+{
+    return m_domain;
+}
+
+void LoopbackServer::handleElement(QTcpSocket *socket, const QDomElement &element)
+{
+    const QString tagName = element.tagName();
+    if (tagName == "auth")
+    {
+        // accept any credentials, we only need the user name
+        const QList<QByteArray> credentials = QByteArray::fromBase64(element.text().toAscii()).split('\0');
+        if (element.attribute("mechanism") != "PLAIN" ||
+            credentials.size() != 3 || credentials[1].isEmpty())
+        {
+            socket->write(QByteArray("<failure xmlns='") + ns_sasl + "'><not-authorized/></failure>");
+            return;
+        }
+
+        Session &session = m_sessions[socket];
+        session.authenticated = true;
+        session.jid = QString::fromUtf8(credentials[1]) + "@" + m_domain;
+        socket->write(QByteArray("<success xmlns='") + ns_sasl + "'/>");
+    }
+    else if (!m_sessions.value(socket).authenticated)
+    {
+        qWarning("LoopbackServer received a stanza before authentication");
+        socket->disconnectFromHost();
+    }
+    else if (tagName == "iq")
+    {
+        handleIq(socket, element);
+    }
+    else if (tagName == "message" || tagName == "presence")
+    {
+        // presence broadcasts are not needed, drop them
+        if (!element.attribute("to").isEmpty())
+            route(socket, element);
+    }
+}
+
+void LoopbackServer::handleIq(QTcpSocket *socket, const QDomElement &element)
+{
+    const QString to = element.attribute("to");
+    if (!to.isEmpty() && to != m_domain)
+    {
+        route(socket, element);
+        return;
+    }
+
+    // answer requests addressed to the server
+    const QString type = element.attribute("type");
+    if (type != "get" && type != "set")
+        return;
+
+    Session &session = m_sessions[socket];
+    const QDomElement bindElement = element.firstChildElement("bind");
+    if (type == "set" && !bindElement.isNull())
+    {
+        QString resource = bindElement.firstChildElement("resource").text();
+        if (resource.isEmpty())
+            resource = "loopback";
+        session.jid = jidToBareJid(session.jid) + "/" + resource;
+    }
+
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    writer.writeStartElement("iq");
+    writer.writeAttribute("id", element.attribute("id"));
+    writer.writeAttribute("to", session.jid);
+    writer.writeAttribute("type", "result");
+    if (!bindElement.isNull())
+    {
+        writer.writeStartElement("bind");
+        writer.writeAttribute("xmlns", ns_bind);
+        writer.writeTextElement("jid", session.jid);
+        writer.writeEndElement();
+    }
+    else if (element.firstChildElement("query").attribute("xmlns") == ns_roster)
+    {
+        writer.writeStartElement("query");
+        writer.writeAttribute("xmlns", ns_roster);
+        writer.writeEndElement();
+    }
+    writer.writeEndElement();
+    socket->write(data);
+}
+
+void LoopbackServer::route(QTcpSocket *socket, QDomElement element)
+{
+    const QString from = m_sessions.value(socket).jid;
+    const QString to = element.attribute("to");
+
+    // look for an exact match, then for a match on the bare JID
+    QTcpSocket *target = 0;
+    QMap<QTcpSocket*, Session>::const_iterator it;
+    for (it = m_sessions.constBegin(); it != m_sessions.constEnd(); ++it)
+    {
+        if (it.value().jid == to)
+        {
+            target = it.key();
+            break;
+        }
+        else if (!target && jidToBareJid(it.value().jid) == to)
+            target = it.key();
+    }
+
+    if (!target)
+    {
+        const QString type = element.attribute("type");
+        if (element.tagName() == "iq" && (type == "get" || type == "set"))
+        {
+            QByteArray data;
+            QXmlStreamWriter writer(&data);
+            writer.writeStartElement("iq");
+            writer.writeAttribute("id", element.attribute("id"));
+            writer.writeAttribute("from", to);
+            writer.writeAttribute("to", from);
+            writer.writeAttribute("type", "error");
+            writer.writeStartElement("error");
+            writer.writeAttribute("code", "503");
+            writer.writeAttribute("type", "cancel");
+            writer.writeStartElement("service-unavailable");
+            writer.writeAttribute("xmlns", ns_stanza);
+            writer.writeEndElement();
+            writer.writeEndElement();
+            writer.writeEndElement();
+            socket->write(data);
+        }
+        return;
+    }
+
+    element.setAttribute("from", from);
+
+    QString xml;
+    QTextStream stream(&xml);
+    element.save(stream, 0);
+    stream.flush();
+    target->write(xml.toUtf8());
+}
+
+void LoopbackServer::sendStreamStart(QTcpSocket *socket)
+{
+    QByteArray data = "<?xml version='1.0'?><stream:stream xmlns='jabber:client' "
+        "xmlns:stream='http://etherx.jabber.org/streams' id='";
+    data += QByteArray::number(++m_streamCount);
+    data += "' from='";
+    data += m_domain.toUtf8();
+    data += "' version='1.0'><stream:features>";
+    if (!m_sessions.value(socket).authenticated)
+    {
+        data += "<mechanisms xmlns='";
+        data += ns_sasl;
+        data += "'><mechanism>PLAIN</mechanism></mechanisms>";
+    } else {
+        data += "<bind xmlns='";
+        data += ns_bind;
+        data += "'/><session xmlns='";
+        data += ns_session;
+        data += "'/>";
+    }
+    data += "</stream:features>";
+    socket->write(data);
+}
+
+void LoopbackServer::slotDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket)
+        return;
+
+    m_sessions.remove(socket);
+    socket->deleteLater();
+}
+
+void LoopbackServer::slotNewConnection()
+{
+    while (hasPendingConnections())
+    {
+        QTcpSocket *socket = nextPendingConnection();
+        m_sessions.insert(socket, Session());
+
+        bool check = connect(socket, SIGNAL(readyRead()),
+                             this, SLOT(slotReadyRead()));
+        Q_ASSERT(check);
+
+        check = connect(socket, SIGNAL(disconnected()),
+                        this, SLOT(slotDisconnected()));
+        Q_ASSERT(check);
+        Q_UNUSED(check);
+    }
+}
+
+void LoopbackServer::slotReadyRead()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !m_sessions.contains(socket))
+        return;
+
+    QByteArray buffer = m_sessions[socket].buffer + socket->readAll();
+
+    // (re)start of stream
+    const int streamStart = buffer.indexOf("<stream:stream");
+    if (streamStart >= 0)
+    {
+        const int streamEnd = buffer.indexOf('>', streamStart);
+        if (streamEnd < 0)
+        {
+            m_sessions[socket].buffer = buffer;
+            return;
+        }
+        buffer.remove(0, streamEnd + 1);
+        sendStreamStart(socket);
+    }
+
+    // end of stream
+    if (buffer.contains("</stream:stream>"))
+    {
+        socket->write("</stream:stream>");
+        socket->disconnectFromHost();
+        return;
+    }
+
+    // wait until we have complete stanzas, like QXmppStream does
+    QDomDocument doc;
+    if (!doc.setContent("<stream>" + buffer + "</stream>", false))
+    {
+        m_sessions[socket].buffer = buffer;
+        return;
+    }
+    m_sessions[socket].buffer.clear();
+
+    QDomElement element = doc.documentElement().firstChildElement();
+    while (!element.isNull())
+    {
+        handleElement(socket, element);
+        element = element.nextSiblingElement();
+    }
+}
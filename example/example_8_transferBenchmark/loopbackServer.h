@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef LOOPBACKSERVER_H
+#define LOOPBACKSERVER_H
+
+#include <QMap>
+#include <QTcpServer>
+
+class QDomElement;
+class QTcpSocket;
+
+/// \brief The LoopbackServer class is a minimal XMPP server which relays
+/// stanzas between the clients connected to it.
+///
+/// It accepts any SASL PLAIN credentials, does not offer TLS and answers
+/// all requests addressed to itself with an empty result. It is only meant
+/// to let several QXmppClient instances talk to each other in-process.
+///
+
+class LoopbackServer : public QTcpServer
+{
+    Q_OBJECT
+
+public:
+    LoopbackServer(const QString &domain, QObject *parent = 0);
+    QString domain() const;
+
+private slots:
+    void slotDisconnected();
+    void slotNewConnection();
+    void slotReadyRead();
+
+private:
+    class Session
+    {
+    public:
+        Session();
+
+        bool authenticated;
+        QByteArray buffer;
+        QString jid;
+    };
+
+    void handleElement(QTcpSocket *socket, const QDomElement &element);
+    void handleIq(QTcpSocket *socket, const QDomElement &element);
+    void route(QTcpSocket *socket, QDomElement element);
+    void sendStreamStart(QTcpSocket *socket);
+
+    QString m_domain;
+    QMap<QTcpSocket*, Session> m_sessions;
+    int m_streamCount;
+};
+
+#endif
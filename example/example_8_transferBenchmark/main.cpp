@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <QtCore/QCoreApplication>
+#include <QStringList>
+
+#include "QXmppLogger.h"
+
+#include "transferBenchmark.h"
+
+static void usage()
+{
+    qWarning("Usage: example_8_transferBenchmark [options]\n"
+             "\n"
+             "  -m, --method <socks|ibb|both>   transfer method (default: both)\n"
+             "  -s, --size <MiB>                size of each file (default: 16)\n"
+             "  -b, --block-size <bytes>        in-band bytestream block size (default: 4096)\n"
+             "  -z, --compress <level>          zlib compression level, 0 to disable (default: 0)\n"
+             "  -j, --jobs <count>              number of concurrent transfers (default: 1)");
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    // logging every stanza would dominate the measurements
+    QXmppLogger::getLogger()->setLoggingType(QXmppLogger::NoLogging);
+
+    TransferBenchmark benchmark;
+    const QStringList args = a.arguments();
+    for (int i = 1; i < args.size(); ++i)
+    {
+        const QString option = args.at(i);
+        if (i + 1 >= args.size())
+        {
+            usage();
+            return 1;
+        }
+        const QString value = args.at(++i);
+
+        bool ok = true;
+        if (option == "-m" || option == "--method")
+        {
+            QList<QXmppTransferJob::Method> methods;
+            if (value == "socks" || value == "both")
+                methods << QXmppTransferJob::SocksMethod;
+            if (value == "ibb" || value == "both")
+                methods << QXmppTransferJob::InBandMethod;
+            ok = !methods.isEmpty();
+            benchmark.setMethods(methods);
+        }
+        else if (option == "-s" || option == "--size")
+        {
+            const double size = value.toDouble(&ok);
+            ok = ok && size > 0;
+            benchmark.setFileSize(qint64(size * 1024 * 1024));
+        }
+        else if (option == "-b" || option == "--block-size")
+        {
+            const int blockSize = value.toInt(&ok);
+            ok = ok && blockSize > 0 && blockSize <= 65535;
+            benchmark.setBlockSize(blockSize);
+        }
+        else if (option == "-z" || option == "--compress")
+        {
+            const int level = value.toInt(&ok);
+            ok = ok && level >= 0 && level <= 9;
+            benchmark.setCompressionLevel(level);
+        }
+        else if (option == "-j" || option == "--jobs")
+        {
+            const int jobs = value.toInt(&ok);
+            ok = ok && jobs > 0;
+            benchmark.setJobCount(jobs);
+        }
+        else
+            ok = false;
+
+        if (!ok)
+        {
+            usage();
+            return 1;
+        }
+    }
+
+    if (!benchmark.start())
+        return 1;
+    return a.exec();
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <cstring>
+
+#include <QCoreApplication>
+#include <QCryptographicHash>
+#include <QDateTime>
+#include <QTimer>
+
+#ifdef Q_OS_UNIX
+#include <sys/resource.h>
+#endif
+
+#include "QXmppClient.h"
+#include "QXmppConfiguration.h"
+
+#include "loopbackServer.h"
+#include "transferBenchmark.h"
+
+// the pattern period is prime so that misplaced blocks show up in the hash
+static const int patternPeriod = 251;
+static const int patternChunk = 65536;
+static const int connectTimeout = 10000;
+
+/// Returns the CPU time consumed by the process in seconds,
+/// or -1 if it cannot be determined.
+///
+
+static double cpuTime()
+{
+#ifdef Q_OS_UNIX
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+            (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+#endif
+    return -1;
+}
+
+/// Returns the peak resident set size of the process in bytes,
+/// or -1 if it cannot be determined.
+///
+
+static qint64 peakMemory()
+{
+#if defined(Q_OS_MAC)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return usage.ru_maxrss;
+#elif defined(Q_OS_UNIX)
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+        return qint64(usage.ru_maxrss) * 1024;
+#endif
+    return -1;
+}
+
+static QString methodName(QXmppTransferJob::Method method)
+{
+    switch (method)
+    {
+    case QXmppTransferJob::InBandMethod:
+        return "IBB";
+    case QXmppTransferJob::SocksMethod:
+        return "SOCKS5";
+    default:
+        return "unknown";
+    }
+}
+
+PatternDevice::PatternDevice(qint64 size, QObject *parent)
+    : QIODevice(parent),
+    m_size(size)
+{
+    m_pattern.resize(patternChunk + patternPeriod);
+    for (int i = 0; i < m_pattern.size(); ++i)
+        m_pattern[i] = char(i % patternPeriod);
+}
+
+bool PatternDevice::isSequential() const
+{
+    return false;
+}
+
+qint64 PatternDevice::size() const
+{
+    return m_size;
+}
+
+qint64 PatternDevice::readData(char *data, qint64 maxSize)
+{
+    const qint64 length = qMin(maxSize, m_size - pos());
+    if (length <= 0)
+        return 0;
+
+    qint64 done = 0;
+    while (done < length)
+    {
+        const int chunk = qMin(length - done, qint64(patternChunk));
+        memcpy(data + done, m_pattern.constData() + (pos() + done) % patternPeriod, chunk);
+        done += chunk;
+    }
+    return length;
+}
+
+qint64 PatternDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+NullDevice::NullDevice(QObject *parent)
+    : QIODevice(parent)
+{
+}
+
+bool NullDevice::isSequential() const
+{
+    return true;
+}
+
+qint64 NullDevice::readData(char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    Q_UNUSED(maxSize);
+    return -1;
+}
+
+qint64 NullDevice::writeData(const char *data, qint64 maxSize)
+{
+    Q_UNUSED(data);
+    return maxSize;
+}
+
+TransferBenchmark::TransferBenchmark(QObject *parent)
+    : QObject(parent),
+    m_connected(0),
+    m_blockSize(4096),
+    m_compressionLevel(0),
+    m_fileSize(16 * 1024 * 1024),
+    m_jobCount(1),
+    m_method(QXmppTransferJob::NoMethod),
+    m_failed(0),
+    m_pending(0),
+    m_wireBytes(0),
+    m_startCpu(0)
+{
+    m_methods << QXmppTransferJob::SocksMethod << QXmppTransferJob::InBandMethod;
+
+    m_server = new LoopbackServer("localhost", this);
+    m_receiver = new QXmppClient(this);
+    m_sender = new QXmppClient(this);
+
+    bool check = connect(m_receiver, SIGNAL(connected()),
+                         this, SLOT(slotConnected()));
+    Q_ASSERT(check);
+
+    check = connect(m_sender, SIGNAL(connected()),
+                    this, SLOT(slotConnected()));
+    Q_ASSERT(check);
+
+    check = connect(&m_receiver->getTransferManager(), SIGNAL(fileReceived(QXmppTransferJob*)),
+                    this, SLOT(slotFileReceived(QXmppTransferJob*)));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
+}
+
+/// Sets the block size used for in-band bytestreams.
+///
+
+void TransferBenchmark::setBlockSize(int bytes)
+{
+    m_blockSize = bytes;
+}
+
+/// Sets the compression level used for the transfers, 0 disables compression.
+///
+
+void TransferBenchmark::setCompressionLevel(int level)
+{
+    m_compressionLevel = level;
+}
+
+/// Sets the size of each file which is sent.
+///
+
+void TransferBenchmark::setFileSize(qint64 bytes)
+{
+    m_fileSize = bytes;
+}
+
+/// Sets the number of files which are sent concurrently.
+///
+
+void TransferBenchmark::setJobCount(int count)
+{
+    m_jobCount = count;
+}
+
+/// Sets the transfer methods to benchmark, one run is performed per method.
+///
+
+void TransferBenchmark::setMethods(const QList<QXmppTransferJob::Method> &methods)
+{
+    m_methods = methods;
+}
+
+/// Starts the loopback server and connects both clients to it.
+///
+/// Returns false if the server could not be started.
+///
+
+bool TransferBenchmark::start()
+{
+    if (!m_server->listen(QHostAddress::LocalHost))
+    {
+        qWarning("Could not start loopback server: %s", qPrintable(m_server->errorString()));
+        return false;
+    }
+
+    // hash the file once, all the transfers send the same content
+    PatternDevice device(m_fileSize);
+    device.open(QIODevice::ReadOnly);
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    while (device.bytesAvailable())
+        hash.addData(device.read(patternChunk));
+    m_fileHash = hash.result();
+
+    QXmppConfiguration config;
+    config.setHost(m_server->serverAddress().toString());
+    config.setPort(m_server->serverPort());
+    config.setDomain(m_server->domain());
+    config.setPasswd("benchmark");
+    config.setResource("benchmark");
+    config.setAutoReconnectionEnabled(false);
+    config.setStreamSecurityMode(QXmppConfiguration::TLSDisabled);
+    config.setSASLAuthMechanism(QXmppConfiguration::SASLPlain);
+
+    config.setUser("receiver");
+    m_receiver->getTransferManager().setIbbBlockSize(m_blockSize);
+    m_receiver->getTransferManager().setCompressionLevel(m_compressionLevel);
+    m_receiver->connectToServer(config);
+
+    config.setUser("sender");
+    m_sender->getTransferManager().setIbbBlockSize(m_blockSize);
+    m_sender->getTransferManager().setCompressionLevel(m_compressionLevel);
+    m_sender->connectToServer(config);
+
+    QTimer::singleShot(connectTimeout, this, SLOT(slotConnectTimeout()));
+    return true;
+}
+
+void TransferBenchmark::report()
+{
+    const double elapsed = m_startTime.elapsed() / 1000.0;
+    const double cpu = cpuTime();
+    const qint64 memory = peakMemory();
+    const double total = double(m_fileSize) * m_jobCount / (1024 * 1024);
+
+    QString line = QString("%1: %2 x %3 MiB in %4 s, %5 MiB/s").arg(
+        methodName(m_method),
+        QString::number(m_jobCount),
+        QString::number(double(m_fileSize) / (1024 * 1024), 'f', 1),
+        QString::number(elapsed, 'f', 3),
+        QString::number(elapsed > 0 ? total / elapsed : 0, 'f', 2));
+    if (m_compressionLevel)
+        line += QString(", %1 MiB on the wire").arg(QString::number(double(m_wireBytes) / (1024 * 1024), 'f', 1));
+    if (cpu >= 0)
+        line += QString(", CPU %1 s").arg(QString::number(cpu - m_startCpu, 'f', 3));
+    if (memory >= 0)
+        line += QString(", peak RSS %1 MiB").arg(QString::number(double(memory) / (1024 * 1024), 'f', 1));
+    if (m_failed)
+        line += QString(", %1 failed job(s)").arg(m_failed);
+    qDebug("%s", qPrintable(line));
+}
+
+void TransferBenchmark::slotConnected()
+{
+    if (++m_connected == 2)
+        startRun();
+}
+
+void TransferBenchmark::slotConnectTimeout()
+{
+    if (m_connected < 2)
+    {
+        qWarning("Clients did not connect to the loopback server");
+        QCoreApplication::exit(1);
+    }
+}
+
+void TransferBenchmark::slotFileReceived(QXmppTransferJob *job)
+{
+    bool check = connect(job, SIGNAL(finished()),
+                         this, SLOT(slotJobFinished()));
+    Q_ASSERT(check);
+    Q_UNUSED(check);
+
+    NullDevice *device = new NullDevice(job);
+    device->open(QIODevice::WriteOnly);
+    m_incomingJobs.insert(job->sid(), job);
+    m_incomingSids.insert(job->sid());
+    job->accept(device);
+}
+
+void TransferBenchmark::slotJobFinished()
+{
+    QXmppTransferJob *job = qobject_cast<QXmppTransferJob*>(sender());
+    if (!job)
+        return;
+
+    if (job->direction() == QXmppTransferJob::IncomingDirection)
+        m_incomingJobs.remove(job->sid());
+    else
+        m_wireBytes += job->wireBytes();
+
+    if (job->error() != QXmppTransferJob::NoError)
+    {
+        qWarning("%s transfer %s failed with error %i",
+            job->direction() == QXmppTransferJob::IncomingDirection ? "Incoming" : "Outgoing",
+            qPrintable(job->sid()), job->error());
+        m_failed++;
+
+        // make sure the other end of the transfer finishes too, or stop
+        // waiting for it if the offer never reached the receiver
+        if (job->direction() == QXmppTransferJob::OutgoingDirection)
+        {
+            QXmppTransferJob *incoming = m_incomingJobs.value(job->sid());
+            if (incoming)
+                incoming->abort();
+            else if (!m_incomingSids.contains(job->sid()))
+                m_pending--;
+        }
+    }
+    job->deleteLater();
+
+    if (--m_pending > 0)
+        return;
+
+    report();
+    if (m_methods.isEmpty())
+    {
+        m_receiver->disconnect();
+        m_sender->disconnect();
+        QCoreApplication::exit(m_failed ? 1 : 0);
+    } else {
+        startRun();
+    }
+}
+
+void TransferBenchmark::startRun()
+{
+    m_method = m_methods.takeFirst();
+    m_receiver->getTransferManager().setSupportedMethods(m_method);
+    m_sender->getTransferManager().setSupportedMethods(m_method);
+
+    // every job finishes once on each side
+    m_failed = 0;
+    m_incomingSids.clear();
+    m_pending = 2 * m_jobCount;
+    m_wireBytes = 0;
+    m_startCpu = cpuTime();
+    m_startTime.start();
+
+    const QString receiverJid = m_receiver->getConfiguration().jid();
+    for (int i = 0; i < m_jobCount; ++i)
+    {
+        QXmppTransferFileInfo fileInfo;
+        fileInfo.setDate(QDateTime::currentDateTime());
+        fileInfo.setHash(m_fileHash);
+        fileInfo.setName(QString("benchmark-%1.dat").arg(i));
+        fileInfo.setSize(m_fileSize);
+
+        PatternDevice *device = new PatternDevice(m_fileSize);
+        device->open(QIODevice::ReadOnly);
+
+        QXmppTransferJob *job = m_sender->getTransferManager().sendFile(receiverJid, device, fileInfo);
+        device->setParent(job);
+        bool check = connect(job, SIGNAL(finished()),
+                             this, SLOT(slotJobFinished()));
+        Q_ASSERT(check);
+        Q_UNUSED(check);
+    }
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef TRANSFERBENCHMARK_H
+#define TRANSFERBENCHMARK_H
+
+#include <QIODevice>
+#include <QList>
+#include <QMap>
+#include <QSet>
+#include <QTime>
+
+#include "QXmppTransferManager.h"
+
+class LoopbackServer;
+class QXmppClient;
+
+/// \brief The PatternDevice class is a random-access read-only device
+/// which generates a repeating byte pattern of the given size.
+///
+
+class PatternDevice : public QIODevice
+{
+public:
+    PatternDevice(qint64 size, QObject *parent = 0);
+    bool isSequential() const;
+    qint64 size() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+
+private:
+    QByteArray m_pattern;
+    qint64 m_size;
+};
+
+/// \brief The NullDevice class is a sequential write-only device
+/// which discards everything written to it.
+///
+
+class NullDevice : public QIODevice
+{
+public:
+    NullDevice(QObject *parent = 0);
+    bool isSequential() const;
+
+protected:
+    qint64 readData(char *data, qint64 maxSize);
+    qint64 writeData(const char *data, qint64 maxSize);
+};
+
+/// \brief The TransferBenchmark class sends files between two clients
+/// connected to a LoopbackServer and reports the throughput, CPU time
+/// and memory usage of each run.
+///
+
+class TransferBenchmark : public QObject
+{
+    Q_OBJECT
+
+public:
+    TransferBenchmark(QObject *parent = 0);
+
+    void setBlockSize(int bytes);
+    void setCompressionLevel(int level);
+    void setFileSize(qint64 bytes);
+    void setJobCount(int count);
+    void setMethods(const QList<QXmppTransferJob::Method> &methods);
+
+    bool start();
+
+private slots:
+    void slotConnected();
+    void slotConnectTimeout();
+    void slotFileReceived(QXmppTransferJob *job);
+    void slotJobFinished();
+
+private:
+    void report();
+    void startRun();
+
+    LoopbackServer *m_server;
+    QXmppClient *m_receiver;
+    QXmppClient *m_sender;
+    int m_connected;
+
+    // settings
+    int m_blockSize;
+    int m_compressionLevel;
+    qint64 m_fileSize;
+    QByteArray m_fileHash;
+    int m_jobCount;
+    QList<QXmppTransferJob::Method> m_methods;
+
+    // current run
+    QMap<QString, QXmppTransferJob*> m_incomingJobs;
+    QSet<QString> m_incomingSids;
+    QXmppTransferJob::Method m_method;
+    int m_failed;
+    int m_pending;
+    qint64 m_wireBytes;
+    double m_startCpu;
+    QTime m_startTime;
+};
+
+#endif
@@ -0,0 +1,348 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#include <QSettings>
+
+#include "QXmppCapabilitiesManager.h"
+#include "QXmppClient.h"
+#include "QXmppInformationRequestResult.h"
+#include "QXmppPresence.h"
+
+// URI identifying our software in the capabilities we advertise
+static const char *capabilitiesNode = "http://code.google.com/p/qxmpp";
+
+// returns the key under which the capabilities advertised in a presence
+// are cached, or an empty string if they cannot be verified
+static QString capabilitiesKey(const QXmppPresence &presence)
+{
+    const QString hash = presence.capabilityHash();
+    if (presence.capabilityVer().isEmpty())
+        return QString();
+
+    // legacy format, the version does not describe the features
+    if (hash.isEmpty())
+        return presence.capabilityNode() + "#" + presence.capabilityVer();
+
+    if (hash == "sha-1" || hash == "md5")
+        return presence.capabilityVer();
+    return QString();
+}
+
+// the settings group of the given cache key, which may contain slashes
+static QString cacheGroup(const QString &key)
+{
+    return QString::fromAscii(key.toUtf8().toHex());
+}
+
+QXmppCapabilitiesManager::QXmppCapabilitiesManager(QXmppClient *client)
+    : QObject(client),
+    m_client(client),
+    m_cache(0)
+{
+    m_ver = QXmppInformationRequestResult().verificationString();
+}
+
+/// Returns the path of the file in which discovered capabilities are cached,
+/// or an empty string if they are only kept in memory.
+///
+
+QString QXmppCapabilitiesManager::cachePath() const
+{
+    return m_cache ? m_cache->fileName() : QString();
+}
+
+/// Sets the path of the file in which discovered capabilities are cached.
+///
+/// The cache is keyed by verification string, not by contact, so it can
+/// be shared between accounts. Set an empty path to stop keeping a cache
+/// on disk.
+///
+/// \param path
+///
+
+void QXmppCapabilitiesManager::setCachePath(const QString &path)
+{
+    delete m_cache;
+    m_cache = 0;
+    if (!path.isEmpty())
+        m_cache = new QSettings(path, QSettings::IniFormat, this);
+}
+
+/// Returns the URI identifying our software, which we advertise along
+/// with our verification string.
+///
+
+QString QXmppCapabilitiesManager::node() const
+{
+    return QString::fromLatin1(capabilitiesNode);
+}
+
+/// Returns the verification string of our own features and identities.
+///
+
+QString QXmppCapabilitiesManager::ver() const
+{
+    return m_ver;
+}
+
+/// Adds our own capabilities to an outgoing presence.
+///
+/// \param presence
+///
+
+void QXmppCapabilitiesManager::addCapabilities(QXmppPresence &presence) const
+{
+    if (presence.getType() == QXmppPresence::Available)
+    {
+        presence.setCapabilityHash("sha-1");
+        presence.setCapabilityNode(node());
+        presence.setCapabilityVer(m_ver);
+    } else {
+        presence.setCapabilityHash(QString());
+        presence.setCapabilityNode(QString());
+        presence.setCapabilityVer(QString());
+    }
+}
+
+/// Returns true if the capabilities of the given full jid are known.
+///
+/// \param jid
+///
+
+bool QXmppCapabilitiesManager::hasCapabilities(const QString &jid) const
+{
+    return m_capabilities.contains(m_jids.value(jid));
+}
+
+/// Returns true if the given full jid advertised support for a feature.
+///
+/// \param jid
+/// \param feature
+///
+
+bool QXmppCapabilitiesManager::hasFeature(const QString &jid, const QString &feature) const
+{
+    return m_capabilities.value(m_jids.value(jid)).features.contains(feature);
+}
+
+/// Returns the features of the given full jid, or an empty list if its
+/// capabilities are not known.
+///
+/// \param jid
+///
+
+QStringList QXmppCapabilitiesManager::features(const QString &jid) const
+{
+    return m_capabilities.value(m_jids.value(jid)).features;
+}
+
+/// Returns the identities of the given full jid, or an empty list if its
+/// capabilities are not known.
+///
+/// \param jid
+///
+
+QList<QXmppDiscoveryIq::Identity> QXmppCapabilitiesManager::identities(const QString &jid) const
+{
+    return m_capabilities.value(m_jids.value(jid)).identities;
+}
+
+/// Looks up the capabilities with the given key, loading them from the
+/// cache on disk if needed.
+
+bool QXmppCapabilitiesManager::lookup(const QString &key)
+{
+    if (m_capabilities.contains(key))
+        return true;
+    if (!m_cache || !m_cache->contains(cacheGroup(key) + "/features"))
+        return false;
+
+    Capabilities caps;
+    m_cache->beginGroup(cacheGroup(key));
+    caps.features = m_cache->value("features").toStringList();
+    const QStringList categories = m_cache->value("identityCategories").toStringList();
+    const QStringList types = m_cache->value("identityTypes").toStringList();
+    const QStringList names = m_cache->value("identityNames").toStringList();
+    m_cache->endGroup();
+    for (int i = 0; i < categories.size() && i < types.size() && i < names.size(); ++i)
+    {
+        QXmppDiscoveryIq::Identity identity;
+        identity.setCategory(categories.at(i));
+        identity.setType(types.at(i));
+        identity.setName(names.at(i));
+        caps.identities.append(identity);
+    }
+    m_capabilities.insert(key, caps);
+    return true;
+}
+
+/// Remembers the capabilities with the given key, and writes them to the
+/// cache on disk.
+
+void QXmppCapabilitiesManager::store(const QString &key, const QXmppDiscoveryIq &iq)
+{
+    Capabilities caps;
+    caps.features = iq.features();
+    caps.identities = iq.identities();
+    m_capabilities.insert(key, caps);
+
+    if (!m_cache)
+        return;
+    QStringList categories, types, names;
+    foreach (const QXmppDiscoveryIq::Identity &identity, caps.identities)
+    {
+        categories << identity.category();
+        types << identity.type();
+        names << identity.name();
+    }
+    m_cache->beginGroup(cacheGroup(key));
+    m_cache->setValue("features", caps.features);
+    m_cache->setValue("identityCategories", categories);
+    m_cache->setValue("identityTypes", types);
+    m_cache->setValue("identityNames", names);
+    m_cache->endGroup();
+    m_cache->sync();
+}
+
+void QXmppCapabilitiesManager::presenceReceived(const QXmppPresence &presence)
+{
+    const QString jid = presence.from();
+    if (presence.getType() == QXmppPresence::Unavailable)
+    {
+        m_jids.remove(jid);
+        return;
+    }
+    else if (presence.getType() != QXmppPresence::Available)
+        return;
+
+    const QString key = capabilitiesKey(presence);
+    if (key.isEmpty())
+    {
+        m_jids.remove(jid);
+        return;
+    }
+    if (m_jids.value(jid) == key)
+        return;
+    m_jids.insert(jid, key);
+
+    if (lookup(key))
+    {
+        emit capabilitiesReceived(jid);
+        return;
+    }
+
+    // query each verification string only once, whichever contact
+    // advertises it first, and keep the others in case that query fails
+    if (m_mismatched.contains(key))
+        return;
+    Candidate candidate;
+    candidate.jid = jid;
+    candidate.node = presence.capabilityNode() + "#" + presence.capabilityVer();
+    candidate.hash = presence.capabilityHash();
+    m_candidates[key].append(candidate);
+    if (!m_pending.contains(key))
+        queryNext(key);
+}
+
+/// Queries the next full jid which still advertises the given verification
+/// string, if any.
+
+void QXmppCapabilitiesManager::queryNext(const QString &key)
+{
+    QHash<QString, QList<Candidate> >::iterator it = m_candidates.find(key);
+    while (it != m_candidates.end() && !it->isEmpty())
+    {
+        const Candidate candidate = it->takeFirst();
+        if (m_jids.value(candidate.jid) != key)
+            continue;
+
+        QXmppDiscoveryIq request;
+        request.setType(QXmppIq::Get);
+        request.setQueryType(QXmppDiscoveryIq::InfoQuery);
+        request.setTo(candidate.jid);
+        request.setQueryNode(candidate.node);
+
+        Request info;
+        info.key = key;
+        info.hash = candidate.hash;
+        m_pending.insert(key);
+        m_requests.insert(request.id(), info);
+        m_client->sendPacket(request);
+        return;
+    }
+    m_candidates.remove(key);
+}
+
+void QXmppCapabilitiesManager::discoveryIqReceived(const QXmppDiscoveryIq &iq)
+{
+    if (iq.type() != QXmppIq::Result || !m_requests.contains(iq.id()))
+        return;
+    const Request info = m_requests.take(iq.id());
+    m_pending.remove(info.key);
+
+    // make sure the answer matches the verification string, otherwise
+    // a single client could poison the cache for everyone
+    if (!info.hash.isEmpty())
+    {
+        const QCryptographicHash::Algorithm algorithm = (info.hash == "md5") ?
+            QCryptographicHash::Md5 : QCryptographicHash::Sha1;
+        if (iq.verificationString(algorithm) != info.key)
+        {
+            // other contacts advertising it would most likely give the
+            // same answer, do not query them until we reconnect
+            qWarning("QXmppCapabilitiesManager: verification string mismatch for %s",
+                     qPrintable(iq.from()));
+            m_mismatched.insert(info.key);
+            m_candidates.remove(info.key);
+            return;
+        }
+    }
+    store(info.key, iq);
+    m_candidates.remove(info.key);
+
+    QHash<QString, QString>::const_iterator it;
+    for (it = m_jids.constBegin(); it != m_jids.constEnd(); ++it)
+        if (it.value() == info.key)
+            emit capabilitiesReceived(it.key());
+}
+
+void QXmppCapabilitiesManager::disconnected()
+{
+    // the answers to our queries are lost along with the stream, and
+    // contacts will send their presences again after reconnecting
+    m_jids.clear();
+    m_pending.clear();
+    m_requests.clear();
+    m_candidates.clear();
+    m_mismatched.clear();
+}
+
+void QXmppCapabilitiesManager::iqReceived(const QXmppIq &iq)
+{
+    // on failure, query the next contact advertising the same
+    // verification string
+    if (iq.type() == QXmppIq::Error && m_requests.contains(iq.id()))
+    {
+        const QString key = m_requests.take(iq.id()).key;
+        m_pending.remove(key);
+        queryNext(key);
+    }
+}
@@ -0,0 +1,118 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#ifndef QXMPPCAPABILITIESMANAGER_H
+#define QXMPPCAPABILITIESMANAGER_H
+
+#include <QHash>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+
+#include "QXmppDiscoveryIq.h"
+
+class QSettings;
+class QXmppClient;
+class QXmppPresence;
+
+/// \brief The QXmppCapabilitiesManager class implements XEP-0115: Entity
+/// Capabilities.
+///
+/// Our own capabilities are advertised in every presence we send. Those
+/// advertised by contacts are looked up with a service discovery query
+/// the first time a given verification string is seen, then served from
+/// a cache. If a cache path is set, the cache is kept on disk, so each
+/// distinct client version only ever needs to be queried once.
+///
+
+class QXmppCapabilitiesManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    QXmppCapabilitiesManager(QXmppClient *client);
+
+    QString cachePath() const;
+    void setCachePath(const QString &path);
+
+    QString node() const;
+    QString ver() const;
+    void addCapabilities(QXmppPresence &presence) const;
+
+    bool hasCapabilities(const QString &jid) const;
+    bool hasFeature(const QString &jid, const QString &feature) const;
+    QStringList features(const QString &jid) const;
+    QList<QXmppDiscoveryIq::Identity> identities(const QString &jid) const;
+
+signals:
+    /// This signal is emitted when the capabilities of the given full jid
+    /// become known or change.
+    void capabilitiesReceived(const QString &jid);
+
+private slots:
+    void discoveryIqReceived(const QXmppDiscoveryIq &iq);
+    void disconnected();
+    void iqReceived(const QXmppIq &iq);
+    void presenceReceived(const QXmppPresence &presence);
+
+private:
+    struct Capabilities
+    {
+        QStringList features;
+        QList<QXmppDiscoveryIq::Identity> identities;
+    };
+
+    struct Candidate
+    {
+        QString jid;
+        QString node;
+        QString hash;
+    };
+
+    struct Request
+    {
+        QString key;
+        QString hash;
+    };
+
+    bool lookup(const QString &key);
+    void queryNext(const QString &key);
+    void store(const QString &key, const QXmppDiscoveryIq &iq);
+
+    // reference to to client object (no ownership)
+    QXmppClient *m_client;
+    QString m_ver;
+    QSettings *m_cache;
+
+    // capabilities by verification string
+    QHash<QString, Capabilities> m_capabilities;
+    // verification string advertised by each full jid
+    QHash<QString, QString> m_jids;
+    // verification strings being queried, and the queries by request id
+    QSet<QString> m_pending;
+    QHash<QString, Request> m_requests;
+    // full jids which can be queried next for each verification string
+    QHash<QString, QList<Candidate> > m_candidates;
+    // verification strings which did not match the answer, for this session
+    QSet<QString> m_mismatched;
+};
+
+#endif
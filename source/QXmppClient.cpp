@@ -227,7 +227,7 @@ void QXmppClient::disconnect()
     m_clientPrecence.setType(QXmppPresence::Unavailable);
     m_clientPrecence.getStatus().setType(QXmppPresence::Status::Online);
     m_clientPrecence.getStatus().setStatusText("Logged out");
-    sendPacket(m_clientPrecence);
+    sendClientPresence();
     if(m_stream)
         m_stream->disconnect();
 }
@@ -265,7 +265,7 @@ void QXmppClient::sendMessage(const QString& bareJid, const QString& message)
 void QXmppClient::setClientPresence(const QXmppPresence& presence)
 {
     m_clientPrecence = presence;
-    sendPacket(m_clientPrecence);
+    sendClientPresence();
 }
 
 /// Overloaded function.
@@ -278,7 +278,7 @@ void QXmppClient::setClientPresence(const QXmppPresence& presence)
 void QXmppClient::setClientPresence(const QString& statusText)
 {
     m_clientPrecence.getStatus().setStatusText(statusText);
-    sendPacket(m_clientPrecence);
+    sendClientPresence();
 }
 
 /// Overloaded function.
@@ -297,7 +297,7 @@ void QXmppClient::setClientPresence(QXmppPresence::Type presenceType)
     else
     {
         m_clientPrecence.setType(presenceType);
-        sendPacket(m_clientPrecence);
+        sendClientPresence();
     }
 }
 
@@ -311,7 +311,7 @@ void QXmppClient::setClientPresence(QXmppPresence::Type presenceType)
 void QXmppClient::setClientPresence(QXmppPresence::Status::Type statusType)
 {
     m_clientPrecence.getStatus().setType(statusType);
-    sendPacket(m_clientPrecence);
+    sendClientPresence();
 }
 
 /// Function to get the client's current presence.
@@ -507,6 +507,34 @@ QXmppTransferManager& QXmppClient::getTransferManager()
     return m_stream->getTransferManager();
 }
 
+/// Returns the reference to QXmppCapabilitiesManager, implementation of:
+///
+///  * XEP-0115: Entity Capabilities
+///
+
+QXmppCapabilitiesManager& QXmppClient::getCapabilitiesManager()
+{
+    return m_stream->getCapabilitiesManager();
+}
+
+/// Returns the reference to QXmppDiscoveryManager, which caches the results
+/// of XEP-0030: Service Discovery queries.
+///
+
+QXmppDiscoveryManager& QXmppClient::getDiscoveryManager()
+{
+    return m_stream->getDiscoveryManager();
+}
+
+/// Sends the client's presence, advertising its capabilities.
+
+void QXmppClient::sendClientPresence()
+{
+    if(m_stream)
+        m_stream->getCapabilitiesManager().addCapabilities(m_clientPrecence);
+    sendPacket(m_clientPrecence);
+}
+
 /// Reimplement in your subclass of QXmppClient if you want to handle
 /// raw XML elements yourself.
 ///
@@ -46,7 +46,9 @@ class QXmppRpcInvokeIq;
 class QXmppRemoteMethod;
 struct QXmppRemoteMethodResult;
 class QXmppArchiveManager;
+class QXmppCapabilitiesManager;
 class QXmppDiscoveryIq;
+class QXmppDiscoveryManager;
 class QXmppTransferManager;
 class QXmppVersionIq;
 
@@ -119,6 +121,8 @@ public:
     QXmppVCardManager& getVCardManager();
     QXmppArchiveManager& getArchiveManager();
     QXmppTransferManager& getTransferManager();
+    QXmppCapabilitiesManager& getCapabilitiesManager();
+    QXmppDiscoveryManager& getDiscoveryManager();
 
 signals:
 
@@ -221,6 +225,8 @@ private:
     QXmppPresence m_clientPrecence; ///< Stores the current presence of the connected client
     QXmppReconnectionManager* m_reconnectionManager;    ///< Pointer to the reconnection manager
     QHash<QString,QXmppInvokable *> m_interfaces;
+
+    void sendClientPresence();
 };
 
 #endif // QXMPPCLIENT_H
@@ -0,0 +1,275 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <QByteArray>
+#include <QString>
+
+#include "QXmppCodec.h"
+
+// The SSSE3 code paths are selected at runtime, so that the library
+// can still be built for and run on older processors.
+#if (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define QXMPP_BASE64_SSSE3
+#include <tmmintrin.h>
+#endif
+
+// size of the blocks encoded at once by base64Write(), a multiple
+// of 3 so that only the last block is padded
+static const int base64WriteBlock = 3 * 4096;
+
+static const char base64Alphabet[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+// value of each ASCII character, or -1 if it is not in the alphabet
+static const signed char base64Values[128] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 62, -1, -1, -1, 63,
+    52, 53, 54, 55, 56, 57, 58, 59, 60, 61, -1, -1, -1, -1, -1, -1,
+    -1,  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14,
+    15, 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, -1, -1, -1, -1, -1,
+    -1, 26, 27, 28, 29, 30, 31, 32, 33, 34, 35, 36, 37, 38, 39, 40,
+    41, 42, 43, 44, 45, 46, 47, 48, 49, 50, 51, -1, -1, -1, -1, -1,
+};
+
+// Feeds one character to the decoder, skipping characters which
+// are not part of the base64 alphabet.
+static inline void decodeChar(ushort ch, uint &buffer, int &bits, char *&out)
+{
+    const int value = ch < 128 ? base64Values[ch] : -1;
+    if (value < 0)
+        return;
+
+    buffer = (buffer << 6) | value;
+    bits += 6;
+    if (bits >= 8)
+    {
+        bits -= 8;
+        *out++ = char(buffer >> bits);
+        buffer &= (1 << bits) - 1;
+    }
+}
+
+static int decodeScalar(const ushort *in, int length, char *out)
+{
+    char *start = out;
+    uint buffer = 0;
+    int bits = 0;
+    for (int i = 0; i < length; ++i)
+        decodeChar(in[i], buffer, bits, out);
+    return out - start;
+}
+
+static int encodeScalar(const uchar *in, int length, ushort *out)
+{
+    ushort *start = out;
+    int i = 0;
+    for ( ; length - i >= 3; i += 3)
+    {
+        const uint value = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+        *out++ = base64Alphabet[value >> 18];
+        *out++ = base64Alphabet[(value >> 12) & 0x3f];
+        *out++ = base64Alphabet[(value >> 6) & 0x3f];
+        *out++ = base64Alphabet[value & 0x3f];
+    }
+
+    // pad the last group
+    if (i < length)
+    {
+        const uint value = (in[i] << 16) | ((i + 1 < length) ? (in[i + 1] << 8) : 0);
+        *out++ = base64Alphabet[value >> 18];
+        *out++ = base64Alphabet[(value >> 12) & 0x3f];
+        *out++ = (i + 1 < length) ? base64Alphabet[(value >> 6) & 0x3f] : '=';
+        *out++ = '=';
+    }
+    return out - start;
+}
+
+#ifdef QXMPP_BASE64_SSSE3
+static bool hasSsse3()
+{
+    static const bool supported = __builtin_cpu_supports("ssse3");
+    return supported;
+}
+
+// Decodes 16 characters at a time, using the nibble lookup technique
+// described by Wojciech Mula. Blocks holding anything other than
+// base64 characters, such as padding or line breaks, are handed over
+// to the scalar decoder.
+__attribute__((target("ssse3")))
+static int decodeSsse3(const ushort *in, int length, char *out)
+{
+    const __m128i lutLo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+    const __m128i lutHi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lutRoll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask2F = _mm_set1_epi8(0x2f);
+    const __m128i pack = _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+    char *start = out;
+    uint buffer = 0;
+    int bits = 0;
+    int i = 0;
+    int scalarEnd = 0;
+    while (i < length)
+    {
+        if (!bits && i >= scalarEnd && length - i >= 16)
+        {
+            // narrow to bytes, characters past U+00FF saturate to
+            // 0x00 or 0xff which are both rejected below
+            const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+            const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i + 8));
+            __m128i str = _mm_packus_epi16(lo, hi);
+
+            const __m128i hiNibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask2F);
+            const __m128i loNibbles = _mm_and_si128(str, mask2F);
+            const __m128i invalid = _mm_and_si128(_mm_shuffle_epi8(lutLo, loNibbles),
+                                                  _mm_shuffle_epi8(lutHi, hiNibbles));
+            if (!_mm_movemask_epi8(_mm_cmpgt_epi8(invalid, _mm_setzero_si128())))
+            {
+                // translate to 6-bit values
+                const __m128i eq2F = _mm_cmpeq_epi8(str, mask2F);
+                str = _mm_add_epi8(str, _mm_shuffle_epi8(lutRoll, _mm_add_epi8(eq2F, hiNibbles)));
+
+                // merge the 6-bit values into 12 bytes
+                str = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+                str = _mm_madd_epi16(str, _mm_set1_epi32(0x00011000));
+                str = _mm_shuffle_epi8(str, pack);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(out), str);
+
+                i += 16;
+                out += 12;
+                continue;
+            }
+            scalarEnd = i + 16;
+        }
+        decodeChar(in[i++], buffer, bits, out);
+    }
+    return out - start;
+}
+
+// Encodes 12 bytes into 16 characters at a time.
+__attribute__((target("ssse3")))
+static int encodeSsse3(const uchar *in, int length, ushort *out)
+{
+    const __m128i spread = _mm_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1);
+    const __m128i lut = _mm_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    const __m128i zero = _mm_setzero_si128();
+
+    ushort *start = out;
+    int i = 0;
+    for ( ; length - i >= 16; i += 12)
+    {
+        // split each group of 3 bytes into 4 6-bit values
+        __m128i str = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        str = _mm_shuffle_epi8(str, spread);
+        const __m128i t0 = _mm_mulhi_epu16(_mm_and_si128(str, _mm_set1_epi32(0x0fc0fc00)),
+                                           _mm_set1_epi32(0x04000040));
+        const __m128i t1 = _mm_mullo_epi16(_mm_and_si128(str, _mm_set1_epi32(0x003f03f0)),
+                                           _mm_set1_epi32(0x01000010));
+        str = _mm_or_si128(t0, t1);
+
+        // translate to the alphabet
+        __m128i indices = _mm_subs_epu8(str, _mm_set1_epi8(51));
+        indices = _mm_sub_epi8(indices, _mm_cmpgt_epi8(str, _mm_set1_epi8(25)));
+        str = _mm_add_epi8(str, _mm_shuffle_epi8(lut, indices));
+
+        // widen to UTF-16
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm_unpacklo_epi8(str, zero));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + 8), _mm_unpackhi_epi8(str, zero));
+        out += 16;
+    }
+    return (out - start) + encodeScalar(in + i, length - i, out);
+}
+#endif
+
+static int encode(const uchar *in, int length, ushort *out)
+{
+#ifdef QXMPP_BASE64_SSSE3
+    if (hasSsse3())
+        return encodeSsse3(in, length, out);
+#endif
+    return encodeScalar(in, length, out);
+}
+
+/// Decodes base64 \a text, skipping characters outside the base64 alphabet.
+///
+/// This works on the UTF-16 data of the string, without converting it
+/// to Latin-1 first.
+///
+
+QByteArray base64Decode(const QString &text)
+{
+    const ushort *in = reinterpret_cast<const ushort*>(text.unicode());
+    const int length = text.size();
+
+    // the SSSE3 decoder stores 16 bytes for every 12 it decodes
+    QByteArray data;
+    data.resize((length / 4) * 3 + 16);
+#ifdef QXMPP_BASE64_SSSE3
+    if (hasSsse3())
+    {
+        data.resize(decodeSsse3(in, length, data.data()));
+        return data;
+    }
+#endif
+    data.resize(decodeScalar(in, length, data.data()));
+    return data;
+}
+
+/// Encodes \a data to base64.
+///
+
+QString base64Encode(const QByteArray &data)
+{
+    QString text;
+    text.resize(((data.size() + 2) / 3) * 4);
+    encode(reinterpret_cast<const uchar*>(data.constData()), data.size(),
+           reinterpret_cast<ushort*>(text.data()));
+    return text;
+}
+
+/// Writes \a data to an XML stream as base64 characters.
+///
+/// The data is encoded in blocks, so the whole encoded string is never
+/// held in memory.
+///
+
+void base64Write(QXmlStreamWriter *writer, const QByteArray &data)
+{
+    const uchar *in = reinterpret_cast<const uchar*>(data.constData());
+    QString text;
+    for (int i = 0; i < data.size(); i += base64WriteBlock)
+    {
+        const int length = qMin(base64WriteBlock, data.size() - i);
+        text.resize(((length + 2) / 3) * 4);
+        encode(in + i, length, reinterpret_cast<ushort*>(text.data()));
+        writer->writeCharacters(text);
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPCODEC_H
+#define QXMPPCODEC_H
+
+// forward declarations of QXmlStream* classes will not work on Mac, we need to
+// include the whole header.
+#include <QXmlStreamWriter>
+
+class QByteArray;
+class QString;
+
+// Base64 encoding and decoding for binary payloads (XEP-0047 data,
+// vCard photos, XML-RPC values).
+//
+// Like QByteArray::fromBase64(), the decoder skips any character which
+// is not part of the base64 alphabet, such as line breaks.
+QByteArray base64Decode(const QString &text);
+QString base64Encode(const QByteArray &data);
+void base64Write(QXmlStreamWriter *writer, const QByteArray &data);
+
+#endif // QXMPPCODEC_H
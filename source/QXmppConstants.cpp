@@ -31,6 +31,7 @@ const char* ns_tls = "urn:ietf:params:xml:ns:xmpp-tls";
 const char* ns_sasl = "urn:ietf:params:xml:ns:xmpp-sasl";
 const char* ns_bind = "urn:ietf:params:xml:ns:xmpp-bind";
 const char* ns_session = "urn:ietf:params:xml:ns:xmpp-session";
+const char* ns_rosterver = "urn:xmpp:features:rosterver";
 const char* ns_stanza = "urn:ietf:params:xml:ns:xmpp-stanzas";
 const char* ns_vcard = "vcard-temp";
 const char* ns_auth = "jabber:iq:auth";
@@ -38,6 +39,8 @@ const char* ns_authFeature = "http://jabber.org/features/iq-auth";
 const char* ns_disco_info = "http://jabber.org/protocol/disco#info";
 const char* ns_disco_items = "http://jabber.org/protocol/disco#items";
 const char* ns_ibb = "http://jabber.org/protocol/ibb";
+// XEP-0115: Entity Capabilities
+const char *ns_capabilities = "http://jabber.org/protocol/caps";
 const char* ns_rpc = "jabber:iq:rpc";
 const char *ns_ping = "urn:xmpp:ping";
 const char *ns_conference = "jabber:x:conference";
@@ -54,5 +57,8 @@ const char *ns_bytestreams = "http://jabber.org/protocol/bytestreams";
 // XEP-0092: Software Version
 const char *ns_version = "jabber:iq:version";
 const char *ns_data = "jabber:x:data";
+const char *ns_parallel_bytestreams = "http://code.google.com/p/qxmpp/protocol/parallel-bytestreams";
+const char *ns_compressed_bytestreams = "http://code.google.com/p/qxmpp/protocol/compressed-bytestreams";
+const char *ns_bytestream_fallback = "http://code.google.com/p/qxmpp/protocol/bytestream-fallback";
 
 const char *svn_revision = "$Rev$";
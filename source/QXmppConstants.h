@@ -32,6 +32,7 @@ extern const char* ns_tls;
 extern const char* ns_sasl;
 extern const char* ns_bind;
 extern const char* ns_session;
+extern const char* ns_rosterver;
 extern const char* ns_stanza;
 extern const char* ns_vcard;
 extern const char* ns_auth;
@@ -39,6 +40,7 @@ extern const char* ns_authFeature;
 extern const char* ns_disco_info;
 extern const char* ns_disco_items;
 extern const char* ns_ibb;
+extern const char *ns_capabilities;
 extern const char* ns_rpc;
 extern const char* ns_ping;
 extern const char *ns_conference;
@@ -54,6 +56,9 @@ extern const char *ns_feature_negotiation;
 extern const char *ns_bytestreams;
 extern const char *ns_version;
 extern const char *ns_data;
+extern const char *ns_parallel_bytestreams;
+extern const char *ns_compressed_bytestreams;
+extern const char *ns_bytestream_fallback;
 extern const char *svn_revision;
 
 #endif // QXMPPCONSTANTS_H
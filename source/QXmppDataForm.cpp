@@ -220,7 +220,14 @@ void QXmppDataForm::parse(const QDomElement &element)
                 break;
             }
         }
-        if (type < 0)
+        if (typeStr.isEmpty())
+        {
+            // fields of result forms may omit their type
+            const QDomElement valueElement = fieldElement.firstChildElement("value");
+            type = valueElement.nextSiblingElement("value").isNull() ?
+                QXmppDataForm::Field::TextSingleField : QXmppDataForm::Field::TextMultiField;
+        }
+        else if (type < 0)
             qWarning() << "Unknown field type" << typeStr;
         field.setType(type);
 
@@ -26,6 +26,46 @@
 #include "QXmppUtils.h"
 
 #include <QDomElement>
+#include <QStringList>
+
+// returns the value of the FORM_TYPE field of a data form
+static QString formType(const QXmppDataForm &form)
+{
+    foreach (const QXmppDataForm::Field &field, form.fields())
+        if (field.key() == "FORM_TYPE")
+            return field.value().toString();
+    return QString();
+}
+
+static bool formLessThan(const QXmppDataForm &f1, const QXmppDataForm &f2)
+{
+    return formType(f1) < formType(f2);
+}
+
+static bool fieldLessThan(const QXmppDataForm::Field &f1, const QXmppDataForm::Field &f2)
+{
+    return f1.key() < f2.key();
+}
+
+// returns the values of a data form field as they appear on the wire
+static QStringList fieldValues(const QXmppDataForm::Field &field)
+{
+    const QVariant value = field.value();
+    if (value.type() == QVariant::StringList)
+        return value.toStringList();
+    if (value.type() == QVariant::Bool)
+        return QStringList(value.toBool() ? "1" : "0");
+    return QStringList(value.toString());
+}
+
+static bool identityLessThan(const QXmppDiscoveryIq::Identity &i1, const QXmppDiscoveryIq::Identity &i2)
+{
+    if (i1.category() != i2.category())
+        return i1.category() < i2.category();
+    if (i1.type() != i2.type())
+        return i1.type() < i2.type();
+    return i1.name() < i2.name();
+}
 
 QString QXmppDiscoveryIq::Identity::category() const
 {
@@ -107,6 +147,16 @@ void QXmppDiscoveryIq::setIdentities(const QList<QXmppDiscoveryIq::Identity> &id
     m_identities = identities;
 }
 
+QList<QXmppDataForm> QXmppDiscoveryIq::forms() const
+{
+    return m_forms;
+}
+
+void QXmppDiscoveryIq::setForms(const QList<QXmppDataForm> &forms)
+{
+    m_forms = forms;
+}
+
 QList<QXmppDiscoveryIq::Item> QXmppDiscoveryIq::items() const
 {
     return m_items;
@@ -137,6 +187,53 @@ void QXmppDiscoveryIq::setQueryType(enum QXmppDiscoveryIq::QueryType type)
     m_queryType = type;
 }
 
+/// Computes the XEP-0115 verification string of the identities, features
+/// and XEP-0128 data forms, which an entity advertises in its presence.
+///
+/// Forms without a FORM_TYPE field are left out, as the specification
+/// requires. Boolean values are hashed as "1" or "0".
+///
+
+QString QXmppDiscoveryIq::verificationString(QCryptographicHash::Algorithm algorithm) const
+{
+    QString S;
+
+    QList<QXmppDiscoveryIq::Identity> sortedIdentities = m_identities;
+    qSort(sortedIdentities.begin(), sortedIdentities.end(), identityLessThan);
+    foreach (const QXmppDiscoveryIq::Identity &identity, sortedIdentities)
+        S += identity.category() + "/" + identity.type() + "//" + identity.name() + "<";
+
+    QStringList sortedFeatures = m_features;
+    sortedFeatures.sort();
+    foreach (const QString &feature, sortedFeatures)
+        S += feature + "<";
+
+    QList<QXmppDataForm> sortedForms = m_forms;
+    qSort(sortedForms.begin(), sortedForms.end(), formLessThan);
+    foreach (const QXmppDataForm &form, sortedForms)
+    {
+        const QString type = formType(form);
+        if (type.isEmpty())
+            continue;
+        S += type + "<";
+
+        QList<QXmppDataForm::Field> sortedFields = form.fields();
+        qSort(sortedFields.begin(), sortedFields.end(), fieldLessThan);
+        foreach (const QXmppDataForm::Field &field, sortedFields)
+        {
+            if (field.key() == "FORM_TYPE")
+                continue;
+            S += field.key() + "<";
+            QStringList sortedValues = fieldValues(field);
+            sortedValues.sort();
+            foreach (const QString &value, sortedValues)
+                S += value + "<";
+        }
+    }
+
+    return QCryptographicHash::hash(S.toUtf8(), algorithm).toBase64();
+}
+
 bool QXmppDiscoveryIq::isDiscoveryIq(const QDomElement &element)
 {
     QDomElement queryElement = element.firstChildElement("query");
@@ -174,6 +271,11 @@ void QXmppDiscoveryIq::parse(const QDomElement &element)
             item.setName(itemElement.attribute("name"));
             item.setNode(itemElement.attribute("node"));
             m_items.append(item);
+        } else if (itemElement.tagName() == "x" && itemElement.namespaceURI() == ns_data) {
+            QXmppDataForm form;
+            form.parse(itemElement);
+            if (!form.isNull())
+                m_forms.append(form);
         }
         itemElement = itemElement.nextSiblingElement();
     }
@@ -211,6 +313,9 @@ void QXmppDiscoveryIq::toXmlElementFromChild(QXmlStreamWriter *writer) const
         writer->writeEndElement();
     }
 
+    foreach (const QXmppDataForm &form, m_forms)
+        form.toXml(writer);
+
     writer->writeEndElement();
 }
 
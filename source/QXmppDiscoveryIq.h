@@ -24,6 +24,9 @@
 #ifndef QXMPPDISCOVERY_H
 #define QXMPPDISCOVERY_H
 
+#include <QCryptographicHash>
+
+#include "QXmppDataForm.h"
 #include "QXmppElement.h"
 #include "QXmppIq.h"
 
@@ -79,6 +82,9 @@ public:
     QList<QXmppDiscoveryIq::Identity> identities() const;
     void setIdentities(const QList<QXmppDiscoveryIq::Identity> &identities);
 
+    QList<QXmppDataForm> forms() const;
+    void setForms(const QList<QXmppDataForm> &forms);
+
     QList<QXmppDiscoveryIq::Item> items() const;
     void setItems(const QList<QXmppDiscoveryIq::Item> &items);
 
@@ -88,12 +94,15 @@ public:
     enum QueryType queryType() const;
     void setQueryType(enum QueryType type);
 
+    QString verificationString(QCryptographicHash::Algorithm algorithm = QCryptographicHash::Sha1) const;
+
     static bool isDiscoveryIq(const QDomElement &element);
     void parse(const QDomElement &element);
     void toXmlElementFromChild(QXmlStreamWriter *writer) const;
 
 private:
     QStringList m_features;
+    QList<QXmppDataForm> m_forms;
     QList<QXmppDiscoveryIq::Identity> m_identities;
     QList<QXmppDiscoveryIq::Item> m_items;
     QString m_queryNode;
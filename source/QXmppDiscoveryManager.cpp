@@ -0,0 +1,384 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#include <QTimer>
+
+#include "QXmppClient.h"
+#include "QXmppDiscoveryManager.h"
+#include "QXmppInformationRequestResult.h"
+#include "QXmppPresence.h"
+
+// time for which discovery results are cached (15 minutes)
+const int defaultCacheTimeout = 900000;
+
+// time after which an unanswered query fails (30 seconds)
+const int defaultRequestTimeout = 30000;
+
+// interval at which unanswered queries and expired results are checked (5 seconds)
+const int timeoutCheckInterval = 5000;
+
+QXmppDiscoveryManager::QXmppDiscoveryManager(QXmppClient *client)
+    : QObject(client),
+    m_client(client),
+    m_cacheTimeout(defaultCacheTimeout),
+    m_requestTimeout(defaultRequestTimeout)
+{
+    // our own information never changes, build it once
+    m_ownInfo = QXmppInformationRequestResult();
+
+    m_timeoutTimer = new QTimer(this);
+    m_timeoutTimer->setInterval(timeoutCheckInterval);
+    connect(m_timeoutTimer, SIGNAL(timeout()), this, SLOT(checkTimeouts()));
+}
+
+/// Returns the time in milliseconds for which results are cached.
+///
+
+int QXmppDiscoveryManager::cacheTimeout() const
+{
+    return m_cacheTimeout;
+}
+
+/// Sets the time in milliseconds for which results are cached.
+///
+/// Set a timeout of 0 to disable caching, in which case identical
+/// queries are still coalesced while they are in flight.
+///
+/// \param msecs
+///
+
+void QXmppDiscoveryManager::setCacheTimeout(int msecs)
+{
+    m_cacheTimeout = qMax(0, msecs);
+}
+
+/// Returns the time in milliseconds after which an unanswered query is
+/// reported as failed.
+///
+
+int QXmppDiscoveryManager::requestTimeout() const
+{
+    return m_requestTimeout;
+}
+
+/// Sets the time in milliseconds after which an unanswered query is
+/// reported as failed.
+///
+/// \param msecs
+///
+
+void QXmppDiscoveryManager::setRequestTimeout(int msecs)
+{
+    m_requestTimeout = qMax(0, msecs);
+}
+
+/// Removes the expired entries from a cache.
+
+void QXmppDiscoveryManager::expire(Cache &cache, const QDateTime &now)
+{
+    QMutableHashIterator<QString, QHash<QString, Entry> > it(cache);
+    while (it.hasNext())
+    {
+        QMutableHashIterator<QString, Entry> entry(it.next().value());
+        while (entry.hasNext())
+            if (entry.next().value().expires <= now)
+                entry.remove();
+        if (it.value().isEmpty())
+            it.remove();
+    }
+}
+
+/// Returns the cached entry of the given type for the given jid and node,
+/// or 0 if there is none or it has expired, in which case it is removed.
+
+const QXmppDiscoveryManager::Entry *QXmppDiscoveryManager::lookup(QXmppDiscoveryIq::QueryType type, const QString &jid, const QString &node) const
+{
+    Cache &cache = (type == QXmppDiscoveryIq::InfoQuery) ? m_info : m_items;
+    Cache::iterator it = cache.find(jid);
+    if (it == cache.end())
+        return 0;
+    QHash<QString, Entry>::iterator entry = it.value().find(node);
+    if (entry == it.value().end())
+        return 0;
+    if (entry.value().expires <= QDateTime::currentDateTime().toUTC())
+    {
+        it.value().erase(entry);
+        if (it.value().isEmpty())
+            cache.erase(it);
+        return 0;
+    }
+    return &entry.value();
+}
+
+/// Returns true if the information about the given jid and node is cached.
+///
+/// \param jid
+/// \param node
+///
+
+bool QXmppDiscoveryManager::hasInfo(const QString &jid, const QString &node) const
+{
+    return lookup(QXmppDiscoveryIq::InfoQuery, jid, node) != 0;
+}
+
+/// Returns the cached information about the given jid and node, or an
+/// empty result if it is not cached.
+///
+/// \param jid
+/// \param node
+///
+
+QXmppDiscoveryIq QXmppDiscoveryManager::info(const QString &jid, const QString &node) const
+{
+    const Entry *entry = lookup(QXmppDiscoveryIq::InfoQuery, jid, node);
+    return entry ? entry->iq : QXmppDiscoveryIq();
+}
+
+/// Returns true if the items of the given jid and node are cached.
+///
+/// \param jid
+/// \param node
+///
+
+bool QXmppDiscoveryManager::hasItems(const QString &jid, const QString &node) const
+{
+    return lookup(QXmppDiscoveryIq::ItemsQuery, jid, node) != 0;
+}
+
+/// Returns the cached items of the given jid and node, or an empty result
+/// if they are not cached.
+///
+/// \param jid
+/// \param node
+///
+
+QXmppDiscoveryIq QXmppDiscoveryManager::items(const QString &jid, const QString &node) const
+{
+    const Entry *entry = lookup(QXmppDiscoveryIq::ItemsQuery, jid, node);
+    return entry ? entry->iq : QXmppDiscoveryIq();
+}
+
+/// Requests the information about the given jid and node. The result is
+/// reported by infoReceived().
+///
+/// \param jid
+/// \param node
+///
+
+void QXmppDiscoveryManager::requestInfo(const QString &jid, const QString &node)
+{
+    request(QXmppDiscoveryIq::InfoQuery, jid, node);
+}
+
+/// Requests the items of the given jid and node. The result is reported by
+/// itemsReceived().
+///
+/// \param jid
+/// \param node
+///
+
+void QXmppDiscoveryManager::requestItems(const QString &jid, const QString &node)
+{
+    request(QXmppDiscoveryIq::ItemsQuery, jid, node);
+}
+
+void QXmppDiscoveryManager::request(QXmppDiscoveryIq::QueryType type, const QString &jid, const QString &node)
+{
+    // answer from the cache
+    const Entry *entry = lookup(type, jid, node);
+    if (entry)
+    {
+        if (m_cachedResults.isEmpty())
+            QTimer::singleShot(0, this, SLOT(emitCached()));
+        m_cachedResults.append(entry->iq);
+        return;
+    }
+
+    // join the query in flight
+    const Key key = qMakePair(jid, node);
+    QHash<Key, QString> &pending = (type == QXmppDiscoveryIq::InfoQuery) ? m_pendingInfo : m_pendingItems;
+    if (pending.contains(key))
+        return;
+
+    QXmppDiscoveryIq iq;
+    iq.setType(QXmppIq::Get);
+    iq.setQueryType(type);
+    iq.setQueryNode(node);
+    iq.setTo(jid);
+
+    Request info;
+    info.type = type;
+    info.key = key;
+    info.sent.start();
+    m_requests.insert(iq.id(), info);
+    pending.insert(key, iq.id());
+    if (!m_timeoutTimer->isActive())
+        m_timeoutTimer->start();
+    m_client->sendPacket(iq);
+}
+
+/// Reports the failure of the query with the given request id.
+
+void QXmppDiscoveryManager::fail(const QString &id, const QXmppStanza::Error &error)
+{
+    const Request info = m_requests.take(id);
+
+    // failures are reported but not cached
+    QXmppDiscoveryIq result;
+    result.setType(QXmppIq::Error);
+    result.setId(id);
+    result.setFrom(info.key.first);
+    QXmppStanza::Error resultError = error;
+    result.setError(resultError);
+    result.setQueryType(info.type);
+    result.setQueryNode(info.key.second);
+    if (info.type == QXmppDiscoveryIq::InfoQuery)
+    {
+        m_pendingInfo.remove(info.key);
+        emit infoReceived(result);
+    } else {
+        m_pendingItems.remove(info.key);
+        emit itemsReceived(result);
+    }
+}
+
+/// Drops all the cached results about the given jid.
+///
+/// \param jid
+///
+
+void QXmppDiscoveryManager::invalidate(const QString &jid)
+{
+    m_info.remove(jid);
+    m_items.remove(jid);
+}
+
+/// Returns the information we send when our own features are queried.
+///
+/// It is only built once.
+///
+
+QXmppDiscoveryIq QXmppDiscoveryManager::ownInfo() const
+{
+    return m_ownInfo;
+}
+
+void QXmppDiscoveryManager::emitCached()
+{
+    const QList<QXmppDiscoveryIq> results = m_cachedResults;
+    m_cachedResults.clear();
+    foreach (const QXmppDiscoveryIq &iq, results)
+    {
+        if (iq.queryType() == QXmppDiscoveryIq::InfoQuery)
+            emit infoReceived(iq);
+        else
+            emit itemsReceived(iq);
+    }
+}
+
+void QXmppDiscoveryManager::checkTimeouts()
+{
+    QStringList expired;
+    QHash<QString, Request>::const_iterator it;
+    for (it = m_requests.constBegin(); it != m_requests.constEnd(); ++it)
+        if (it.value().sent.elapsed() >= m_requestTimeout)
+            expired << it.key();
+
+    const QXmppStanza::Error error(QXmppStanza::Error::Wait, QXmppStanza::Error::RemoteServerTimeout);
+    foreach (const QString &id, expired)
+        fail(id, error);
+
+    // drop the cached results which expired, so that the cache does not
+    // keep every jid which was ever queried
+    const QDateTime now = QDateTime::currentDateTime().toUTC();
+    expire(m_info, now);
+    expire(m_items, now);
+
+    if (m_requests.isEmpty() && m_info.isEmpty() && m_items.isEmpty())
+        m_timeoutTimer->stop();
+}
+
+void QXmppDiscoveryManager::discoveryIqReceived(const QXmppDiscoveryIq &iq)
+{
+    if (iq.type() != QXmppIq::Result || !m_requests.contains(iq.id()))
+        return;
+    const Request info = m_requests.take(iq.id());
+
+    // the result does not always repeat the node we asked for
+    QXmppDiscoveryIq result = iq;
+    result.setQueryNode(info.key.second);
+
+    Entry entry;
+    entry.iq = result;
+    entry.expires = QDateTime::currentDateTime().toUTC().addMSecs(m_cacheTimeout);
+    if (m_cacheTimeout > 0 && !m_timeoutTimer->isActive())
+        m_timeoutTimer->start();
+    if (info.type == QXmppDiscoveryIq::InfoQuery)
+    {
+        m_pendingInfo.remove(info.key);
+        if (m_cacheTimeout > 0)
+            m_info[info.key.first].insert(info.key.second, entry);
+        emit infoReceived(result);
+    } else {
+        m_pendingItems.remove(info.key);
+        if (m_cacheTimeout > 0)
+            m_items[info.key.first].insert(info.key.second, entry);
+        emit itemsReceived(result);
+    }
+}
+
+void QXmppDiscoveryManager::disconnected()
+{
+    // the answers are lost along with the stream
+    const QXmppStanza::Error error(QXmppStanza::Error::Cancel, QXmppStanza::Error::RemoteServerNotFound);
+    foreach (const QString &id, m_requests.keys())
+        fail(id, error);
+}
+
+void QXmppDiscoveryManager::iqReceived(const QXmppIq &iq)
+{
+    if (iq.type() != QXmppIq::Error || !m_requests.contains(iq.id()))
+        return;
+    fail(iq.id(), iq.error());
+}
+
+void QXmppDiscoveryManager::presenceReceived(const QXmppPresence &presence)
+{
+    const QString jid = presence.from();
+    if (presence.getType() == QXmppPresence::Unavailable)
+    {
+        m_capabilities.remove(jid);
+        invalidate(jid);
+    }
+    else if (presence.getType() == QXmppPresence::Available)
+    {
+        // the entity changed its features
+        const QString ver = presence.capabilityNode() + "#" + presence.capabilityVer();
+        QHash<QString, QString>::iterator it = m_capabilities.find(jid);
+        if (it == m_capabilities.end())
+            m_capabilities.insert(jid, ver);
+        else if (it.value() != ver)
+        {
+            it.value() = ver;
+            invalidate(jid);
+        }
+    }
+}
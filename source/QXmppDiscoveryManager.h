@@ -0,0 +1,139 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#ifndef QXMPPDISCOVERYMANAGER_H
+#define QXMPPDISCOVERYMANAGER_H
+
+#include <QDateTime>
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QTime>
+
+#include "QXmppDiscoveryIq.h"
+
+class QTimer;
+class QXmppClient;
+class QXmppPresence;
+
+/// \brief The QXmppDiscoveryManager class implements a cache for
+/// XEP-0030: Service Discovery.
+///
+/// Information and items are cached per jid and node for cacheTimeout()
+/// milliseconds, so that the components which need to discover a server
+/// or a peer do not query it again and again. Identical queries made
+/// while one is in flight share a single request. The information about
+/// a full jid is dropped when it goes offline or advertises different
+/// capabilities.
+///
+/// Results are reported asynchronously by infoReceived() and
+/// itemsReceived(), even when they were already cached. Queries which
+/// are not answered within requestTimeout() milliseconds, or which are
+/// in flight when the stream is lost, are reported as failed.
+///
+
+class QXmppDiscoveryManager : public QObject
+{
+    Q_OBJECT
+
+public:
+    QXmppDiscoveryManager(QXmppClient *client);
+
+    int cacheTimeout() const;
+    void setCacheTimeout(int msecs);
+
+    int requestTimeout() const;
+    void setRequestTimeout(int msecs);
+
+    bool hasInfo(const QString &jid, const QString &node = QString()) const;
+    QXmppDiscoveryIq info(const QString &jid, const QString &node = QString()) const;
+    bool hasItems(const QString &jid, const QString &node = QString()) const;
+    QXmppDiscoveryIq items(const QString &jid, const QString &node = QString()) const;
+
+    void requestInfo(const QString &jid, const QString &node = QString());
+    void requestItems(const QString &jid, const QString &node = QString());
+    void invalidate(const QString &jid);
+
+    QXmppDiscoveryIq ownInfo() const;
+
+signals:
+    /// This signal is emitted when the information requested with
+    /// requestInfo() is available. If the query failed, the type of
+    /// the iq is QXmppIq::Error.
+    void infoReceived(const QXmppDiscoveryIq &iq);
+
+    /// This signal is emitted when the items requested with
+    /// requestItems() are available. If the query failed, the type of
+    /// the iq is QXmppIq::Error.
+    void itemsReceived(const QXmppDiscoveryIq &iq);
+
+private slots:
+    void checkTimeouts();
+    void discoveryIqReceived(const QXmppDiscoveryIq &iq);
+    void disconnected();
+    void emitCached();
+    void iqReceived(const QXmppIq &iq);
+    void presenceReceived(const QXmppPresence &presence);
+
+private:
+    typedef QPair<QString, QString> Key;
+
+    struct Entry
+    {
+        QXmppDiscoveryIq iq;
+        QDateTime expires;
+    };
+
+    struct Request
+    {
+        QXmppDiscoveryIq::QueryType type;
+        Key key;
+        QTime sent;
+    };
+
+    typedef QHash<QString, QHash<QString, Entry> > Cache;
+
+    static void expire(Cache &cache, const QDateTime &now);
+    const Entry *lookup(QXmppDiscoveryIq::QueryType type, const QString &jid, const QString &node) const;
+    void request(QXmppDiscoveryIq::QueryType type, const QString &jid, const QString &node);
+    void fail(const QString &id, const QXmppStanza::Error &error);
+
+    // reference to to client object (no ownership)
+    QXmppClient *m_client;
+    int m_cacheTimeout;
+    int m_requestTimeout;
+    QTimer *m_timeoutTimer;
+    QXmppDiscoveryIq m_ownInfo;
+
+    // cached results by jid, then by node, dropped once they expire
+    mutable Cache m_info;
+    mutable Cache m_items;
+    // queries in flight by request id, and their ids by jid and node
+    QHash<QString, Request> m_requests;
+    QHash<Key, QString> m_pendingInfo;
+    QHash<Key, QString> m_pendingItems;
+    // cached results waiting to be reported
+    QList<QXmppDiscoveryIq> m_cachedResults;
+    // capabilities last advertised by each full jid
+    QHash<QString, QString> m_capabilities;
+};
+
+#endif
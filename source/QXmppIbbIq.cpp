@@ -1,6 +1,7 @@
 #include <QDomElement>
 #include <QXmlStreamWriter>
 
+#include "QXmppCodec.h"
 #include "QXmppConstants.h"
 #include "QXmppIbbIq.h"
 
@@ -144,7 +145,7 @@ void QXmppIbbDataIq::parse(const QDomElement &element)
     QDomElement dataElement = element.firstChildElement("data");
     m_sid = dataElement.attribute( "sid" );
     m_seq = dataElement.attribute( "seq" ).toLong();
-    m_payload = QByteArray::fromBase64( dataElement.text().toLatin1() );
+    m_payload = base64Decode(dataElement.text());
 }
 
 void QXmppIbbDataIq::toXmlElementFromChild(QXmlStreamWriter *writer) const
@@ -153,6 +154,6 @@ void QXmppIbbDataIq::toXmlElementFromChild(QXmlStreamWriter *writer) const
     writer->writeAttribute( "xmlns",ns_ibb);
     writer->writeAttribute( "sid",m_sid);
     writer->writeAttribute( "seq",QString::number(m_seq) );
-    writer->writeCharacters( m_payload.toBase64() );
+    base64Write(writer, m_payload);
     writer->writeEndElement();
 }
@@ -18,7 +18,11 @@ QXmppInformationRequestResult::QXmppInformationRequestResult()
         << ns_version           // XEP-0092: Software Version
         << ns_stream_initiation // XEP-0095: Stream Initiation
         << ns_stream_initiation_file_transfer // XEP-0096: SI File Transfer
-        << ns_ping;             // XEP-0199: XMPP Ping
+        << ns_capabilities      // XEP-0115: Entity Capabilities
+        << ns_ping              // XEP-0199: XMPP Ping
+        << ns_parallel_bytestreams   // parallel SOCKS5 bytestreams
+        << ns_compressed_bytestreams // compressed bytestreams
+        << ns_bytestream_fallback;   // SOCKS5 to IBB fallback
     setFeatures(features);
 
     // identities
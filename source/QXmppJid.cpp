@@ -0,0 +1,255 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#include <QHash>
+#include <QThreadStorage>
+#include <QUrl>
+
+#include "QXmppJid.h"
+
+// size below which the bare JID pool is never swept (1024 entries)
+const int jidPoolMinimum = 1024;
+
+// number of normalised JIDs remembered, the cache is emptied when it
+// grows beyond this size (16384 entries)
+const int normalizedCacheLimit = 16384;
+
+/// The bare JIDs and normalised JIDs known to a thread, so that they can
+/// be looked up without any locking.
+///
+/// The bare JIDs which nobody else references are dropped whenever the
+/// pool doubles in size, so that it follows the number of JIDs in use.
+
+struct QXmppJidPool
+{
+    QXmppJidPool()
+        : bareJidsSweep(jidPoolMinimum)
+    {
+    }
+
+    // bare JIDs along with their hash
+    QHash<QString, uint> bareJids;
+    int bareJidsSweep;
+    QHash<QString, QXmppJid> normalized;
+};
+
+Q_GLOBAL_STATIC(QThreadStorage<QXmppJidPool*>, jidPools)
+
+static QXmppJidPool *jidPool()
+{
+    QThreadStorage<QXmppJidPool*> *pools = jidPools();
+    if (!pools->hasLocalData())
+        pools->setLocalData(new QXmppJidPool);
+    return pools->localData();
+}
+
+static void sweepBareJids(QXmppJidPool *pool)
+{
+    if (pool->bareJids.size() < pool->bareJidsSweep)
+        return;
+    QMutableHashIterator<QString, uint> it(pool->bareJids);
+    while (it.hasNext())
+        if (it.next().key().isDetached())
+            it.remove();
+    pool->bareJidsSweep = qMax(jidPoolMinimum, 2 * pool->bareJids.size());
+}
+
+// same function as qHash(QString), for a part of a string
+static uint hashChars(const QChar *p, int n)
+{
+    uint h = 0;
+    while (n--)
+    {
+        h = (h << 4) + (*p++).unicode();
+        h ^= (h & 0xf0000000) >> 23;
+        h &= 0x0fffffff;
+    }
+    return h;
+}
+
+/// Returns the interned copy of a bare JID and stores its hash in \a hash.
+
+static QString internBareJid(const QString &bareJid, uint &hash)
+{
+    QXmppJidPool *pool = jidPool();
+    QHash<QString, uint>::const_iterator it = pool->bareJids.constFind(bareJid);
+    if (it != pool->bareJids.constEnd())
+    {
+        hash = it.value();
+        return it.key();
+    }
+    sweepBareJids(pool);
+    hash = qHash(bareJid);
+    pool->bareJids.insert(bareJid, hash);
+    return bareJid;
+}
+
+/// Constructs a null JID.
+///
+
+QXmppJid::QXmppJid()
+    : m_nodeLength(-1),
+    m_hash(0)
+{
+}
+
+/// Constructs a JID by parsing the given string.
+///
+/// \param jid
+///
+
+QXmppJid::QXmppJid(const QString &jid)
+    : m_nodeLength(-1),
+    m_hash(0)
+{
+    if (jid.isEmpty())
+        return;
+
+    // the hash of a full JID combines the cached hash of its bare JID
+    // with that of its resource, so the bare JID is only hashed once
+    const int slash = jid.indexOf(QChar('/'));
+    m_bareJid = internBareJid(slash < 0 ? jid : jid.left(slash), m_hash);
+    if (slash < 0)
+        m_jid = m_bareJid;
+    else
+    {
+        m_jid = jid;
+        m_hash = m_hash * 31 + hashChars(jid.constData() + slash, jid.size() - slash);
+    }
+    m_nodeLength = m_bareJid.indexOf(QChar('@'));
+}
+
+/// Returns true if the JID is empty.
+///
+
+bool QXmppJid::isNull() const
+{
+    return m_jid.isEmpty();
+}
+
+/// Returns true if the JID has no resource.
+///
+
+bool QXmppJid::isBare() const
+{
+    return m_jid.size() == m_bareJid.size();
+}
+
+/// Returns the node, that is the part before the '@', or an empty string.
+///
+
+QString QXmppJid::node() const
+{
+    if (m_nodeLength < 0)
+        return QString();
+    return m_bareJid.left(m_nodeLength);
+}
+
+/// Returns the domain.
+///
+
+QString QXmppJid::domain() const
+{
+    return m_bareJid.mid(m_nodeLength + 1);
+}
+
+/// Returns the resource, or an empty string if the JID is bare.
+///
+
+QString QXmppJid::resource() const
+{
+    if (isBare())
+        return QString();
+    return m_jid.mid(m_bareJid.size() + 1);
+}
+
+/// Returns the bare JID, that is the JID without its resource.
+///
+/// The returned string shares its data with every other bare JID equal
+/// to it.
+///
+
+QString QXmppJid::bareJid() const
+{
+    return m_bareJid;
+}
+
+/// Returns the full JID as a string.
+///
+
+QString QXmppJid::toString() const
+{
+    return m_jid;
+}
+
+/// Returns the JID in its canonical form, so that JIDs which only differ
+/// by case or Unicode composition compare equal.
+///
+/// The node is case-folded and the domain goes through IDNA nameprep, as
+/// done by nodeprep and nameprep, and all the parts are normalised to
+/// NFKC. The prohibited characters of the stringprep profiles are not
+/// checked. Results are cached, so normalising the same JID again is a
+/// single lookup.
+///
+
+QXmppJid QXmppJid::normalized() const
+{
+    if (m_jid.isEmpty())
+        return *this;
+
+    QXmppJidPool *pool = jidPool();
+    QHash<QString, QXmppJid>::const_iterator it = pool->normalized.constFind(m_jid);
+    if (it != pool->normalized.constEnd())
+        return it.value();
+
+    QString domain = QUrl::fromAce(QUrl::toAce(this->domain()));
+    if (domain.isEmpty())
+        domain = this->domain().normalized(QString::NormalizationForm_KC).toLower();
+    QString jid = domain;
+    if (m_nodeLength >= 0)
+        jid.prepend(node().normalized(QString::NormalizationForm_KC).toCaseFolded() + "@");
+    if (!isBare())
+        jid += "/" + resource().normalized(QString::NormalizationForm_KC);
+    const QXmppJid result(jid);
+
+    if (pool->normalized.size() >= normalizedCacheLimit)
+        pool->normalized.clear();
+    pool->normalized.insert(m_jid, result);
+    return result;
+}
+
+bool QXmppJid::operator==(const QXmppJid &other) const
+{
+    // interned bare JIDs share their data
+    if (m_jid.constData() == other.m_jid.constData())
+        return true;
+    return m_hash == other.m_hash && m_jid == other.m_jid;
+}
+
+bool QXmppJid::operator!=(const QXmppJid &other) const
+{
+    return !(*this == other);
+}
+
+uint qHash(const QXmppJid &jid)
+{
+    return jid.m_hash;
+}
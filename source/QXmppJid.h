@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+
+#ifndef QXMPPJID_H
+#define QXMPPJID_H
+
+#include <QString>
+
+/// \brief The QXmppJid class represents a Jabber ID.
+///
+/// The JID is split into its node, domain and resource once, when it is
+/// constructed, and a hash of it is cached so that comparing JIDs or
+/// looking them up in a QHash does not scan the strings again.
+///
+/// Bare JIDs are interned: all the QXmppJid with the same bare JID created
+/// by a thread share a single copy of it, which is kept for as long as any
+/// of them is alive.
+///
+
+class QXmppJid
+{
+public:
+    QXmppJid();
+    explicit QXmppJid(const QString &jid);
+
+    bool isNull() const;
+    bool isBare() const;
+
+    QString node() const;
+    QString domain() const;
+    QString resource() const;
+    QString bareJid() const;
+    QString toString() const;
+
+    QXmppJid normalized() const;
+
+    bool operator==(const QXmppJid &other) const;
+    bool operator!=(const QXmppJid &other) const;
+
+private:
+    QString m_jid;
+    QString m_bareJid;
+    // length of the node, or -1 if there is none
+    int m_nodeLength;
+    uint m_hash;
+
+    friend uint qHash(const QXmppJid &jid);
+};
+
+uint qHash(const QXmppJid &jid);
+
+#endif
@@ -24,6 +24,7 @@
 
 #include "QXmppPresence.h"
 #include "QXmppUtils.h"
+#include "QXmppConstants.h"
 #include <QtDebug>
 #include <QDomElement>
 #include <QXmlStreamWriter>
@@ -65,6 +66,43 @@ void QXmppPresence::setStatus(const QXmppPresence::Status& status)
     m_status = status;
 }
 
+/// Returns the algorithm used to compute the capabilities verification
+/// string, for instance "sha-1", or an empty string for legacy clients.
+
+QString QXmppPresence::capabilityHash() const
+{
+    return m_capabilityHash;
+}
+
+void QXmppPresence::setCapabilityHash(const QString& hash)
+{
+    m_capabilityHash = hash;
+}
+
+/// Returns the URI identifying the software of the sender.
+
+QString QXmppPresence::capabilityNode() const
+{
+    return m_capabilityNode;
+}
+
+void QXmppPresence::setCapabilityNode(const QString& node)
+{
+    m_capabilityNode = node;
+}
+
+/// Returns the capabilities verification string of the sender.
+
+QString QXmppPresence::capabilityVer() const
+{
+    return m_capabilityVer;
+}
+
+void QXmppPresence::setCapabilityVer(const QString& ver)
+{
+    m_capabilityVer = ver;
+}
+
 void QXmppPresence::parse(const QDomElement &element)
 {
     QXmppStanza::parse(element);
@@ -86,6 +124,15 @@ void QXmppPresence::parse(const QDomElement &element)
     QDomElement xElement = element.firstChildElement("x");
     if(!xElement.isNull())
         setExtensions(QXmppElement(xElement));
+
+    // XEP-0115: Entity Capabilities
+    QDomElement cElement = element.firstChildElement("c");
+    if(!cElement.isNull() && cElement.namespaceURI() == ns_capabilities)
+    {
+        m_capabilityHash = cElement.attribute("hash");
+        m_capabilityNode = cElement.attribute("node");
+        m_capabilityVer = cElement.attribute("ver");
+    }
 }
 
 void  QXmppPresence::toXml(QXmlStreamWriter *xmlWriter ) const
@@ -102,6 +149,17 @@ void  QXmppPresence::toXml(QXmlStreamWriter *xmlWriter ) const
     if(getStatus().getPriority() != 0)
         helperToXmlAddNumberElement(xmlWriter,"priority", getStatus().getPriority());
     helperToXmlAddTextElement(xmlWriter,"show", getStatus().getTypeStr());
+
+    // XEP-0115: Entity Capabilities
+    if(!m_capabilityVer.isEmpty())
+    {
+        xmlWriter->writeStartElement("c");
+        helperToXmlAddAttribute(xmlWriter, "xmlns", ns_capabilities);
+        helperToXmlAddAttribute(xmlWriter, "hash", m_capabilityHash);
+        helperToXmlAddAttribute(xmlWriter, "node", m_capabilityNode);
+        helperToXmlAddAttribute(xmlWriter, "ver", m_capabilityVer);
+        xmlWriter->writeEndElement();
+    }
     
     error().toXml(xmlWriter);
     foreach (const QXmppElement &extension, extensions())
@@ -87,6 +87,14 @@ public:
     const QXmppPresence::Status& getStatus() const;
     void setStatus(const QXmppPresence::Status&);
 
+    // XEP-0115: Entity Capabilities
+    QString capabilityHash() const;
+    void setCapabilityHash(const QString&);
+    QString capabilityNode() const;
+    void setCapabilityNode(const QString&);
+    QString capabilityVer() const;
+    void setCapabilityVer(const QString&);
+
     void parse(const QDomElement &element);
     void toXml( QXmlStreamWriter *writer ) const;
 
@@ -96,6 +104,11 @@ private:
 
     Type m_type;
     QXmppPresence::Status m_status;
+
+    // XEP-0115: Entity Capabilities
+    QString m_capabilityHash;
+    QString m_capabilityNode;
+    QString m_capabilityVer;
 };
 
 #endif // QXMPPPRESENCE_H
@@ -23,43 +23,400 @@
  */
 
 
+#include <QTimer>
+#include <QXmlStreamWriter>
+
+#include "QXmppJid.h"
 #include "QXmppRoster.h"
-#include "QXmppUtils.h"
 #include "QXmppRosterIq.h"
 #include "QXmppPresence.h"
 #include "QXmppStream.h"
 
+// delay before writing changes to the store, so that a burst of
+// roster pushes or presences only causes a single write (1 second)
+const int storeDelay = 1000;
+
+// time after receiving the roster during which the stored presences
+// are expected to be confirmed by the server (15 seconds)
+const int defaultStaleTimeout = 15000;
+
+// rank of a status when choosing the best resource of a contact
+static int availability(const QXmppPresence& presence)
+{
+    switch(presence.getStatus().getType())
+    {
+    case QXmppPresence::Status::Chat:
+        return 6;
+    case QXmppPresence::Status::Online:
+        return 5;
+    case QXmppPresence::Status::Away:
+        return 4;
+    case QXmppPresence::Status::XA:
+        return 3;
+    case QXmppPresence::Status::DND:
+        return 2;
+    case QXmppPresence::Status::Invisible:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// whether presence a should be preferred over presence b: by priority,
+// then by status
+static bool isBetterPresence(const QXmppPresence& a, const QXmppPresence& b)
+{
+    const int priorityA = a.getStatus().getPriority();
+    const int priorityB = b.getStatus().getPriority();
+    if(priorityA != priorityB)
+        return priorityA > priorityB;
+    return availability(a) > availability(b);
+}
+
+static bool isSameEntry(const QXmppRoster::QXmppRosterEntry& a,
+                        const QXmppRoster::QXmppRosterEntry& b)
+{
+    return a.name() == b.name() &&
+           a.subscriptionType() == b.subscriptionType() &&
+           a.subscriptionStatus() == b.subscriptionStatus() &&
+           a.groups() == b.groups();
+}
+
+static QByteArray extensionsXml(const QXmppPresence& presence)
+{
+    QByteArray data;
+    QXmlStreamWriter writer(&data);
+    foreach(const QXmppElement& extension, presence.extensions())
+        extension.toXml(&writer);
+    return data;
+}
+
+// returns which parts of a presence differ, as QXmppRoster::PresenceField
+// values, ignoring the stanza id and addresses
+static int presenceChanges(const QXmppPresence& previous,
+                           const QXmppPresence& presence)
+{
+    int changes = 0;
+    if(previous.getStatus().getType() != presence.getStatus().getType())
+        changes |= QXmppRoster::ShowField;
+    if(previous.getStatus().getStatusText() != presence.getStatus().getStatusText())
+        changes |= QXmppRoster::StatusTextField;
+    if(previous.getStatus().getPriority() != presence.getStatus().getPriority())
+        changes |= QXmppRoster::PriorityField;
+    if(previous.capabilityHash() != presence.capabilityHash() ||
+       previous.capabilityNode() != presence.capabilityNode() ||
+       previous.capabilityVer() != presence.capabilityVer())
+        changes |= QXmppRoster::CapabilitiesField;
+    if((!previous.extensions().isEmpty() || !presence.extensions().isEmpty()) &&
+       extensionsXml(previous) != extensionsXml(presence))
+        changes |= QXmppRoster::ExtensionsField;
+    return changes;
+}
+
 QXmppRoster::QXmppRoster(QXmppStream* stream) : m_stream(stream),
-                                m_isRosterReceived(false)
+                                m_isRosterReceived(false),
+                                m_storePending(false),
+                                m_storeSnapshot(false)
 {
+    m_staleTimer = new QTimer(this);
+    m_staleTimer->setSingleShot(true);
+    m_staleTimer->setInterval(defaultStaleTimeout);
+    connect(m_staleTimer, SIGNAL(timeout()), this, SLOT(dropStalePresences()));
+
+    m_batchTimer = new QTimer(this);
+    m_batchTimer->setSingleShot(true);
+    m_batchTimer->setInterval(0);
+    connect(m_batchTimer, SIGNAL(timeout()), this, SLOT(emitBatch()));
 }
 
 QXmppRoster::~QXmppRoster()
 {
+    if(m_storePending)
+        saveStore();
+}
 
+void QXmppRoster::connected()
+{
+    // the state kept across reconnections belongs to another account
+    const QString accountJid = m_stream->getConfiguration().jidBare();
+    if(!m_accountJid.isEmpty() && m_accountJid != accountJid)
+        clearState();
+    m_accountJid = accountJid;
 }
 
 void QXmppRoster::disconnected()
 {
-    m_entries = QMap<QString, QXmppRoster::QXmppRosterEntry>();
-    m_presences = QMap<QString, QMap<QString, QXmppPresence> >();
+    m_staleTimer->stop();
     m_isRosterReceived = false;
+
+    // keep showing the last known state until the server confirms it,
+    // so that reconnecting only reports what actually changed
+    if(m_storePending)
+        saveStore();
+    markPresencesStale();
+}
+
+/// Returns a copy of the given bare JID which shares its data with the
+/// key already used for it in the roster or the presences, if any.
+
+QString QXmppRoster::internBareJid(const QString& bareJid) const
+{
+    QHash<QString, QXmppRoster::QXmppRosterEntry>::const_iterator entry =
+        m_entries.constFind(bareJid);
+    if(entry != m_entries.constEnd())
+        return entry.key();
+
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator presences =
+        m_presences.constFind(bareJid);
+    if(presences != m_presences.constEnd())
+        return presences.key();
+
+    return bareJid;
+}
+
+/// Forgets the presence of the given resource, and the bareJid itself
+/// once it has no resources left.
+
+void QXmppRoster::removePresence(const QString& bareJid, const QString& resource)
+{
+    QHash<QString, QMap<QString, QXmppPresence> >::iterator it =
+        m_presences.find(bareJid);
+    if(it == m_presences.end())
+        return;
+    it->remove(resource);
+    if(it->isEmpty())
+        m_presences.erase(it);
+    updateBestResource(bareJid, resource);
+}
+
+/// Updates the best resource of the given bareJid after the presence of
+/// one of its resources was set or removed.
+
+void QXmppRoster::updateBestResource(const QString& bareJid,
+                                     const QString& resource)
+{
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it =
+        m_presences.constFind(bareJid);
+    if(it == m_presences.constEnd())
+    {
+        m_bestResources.remove(bareJid);
+        return;
+    }
+    const QMap<QString, QXmppPresence>& resources = it.value();
+
+    // another resource changed, it only needs to be compared with the
+    // current best one
+    QHash<QString, QString>::iterator best = m_bestResources.find(bareJid);
+    if(best != m_bestResources.end() && best.value() != resource)
+    {
+        QMap<QString, QXmppPresence>::const_iterator changed =
+            resources.constFind(resource);
+        if(changed != resources.constEnd() &&
+           isBetterPresence(changed.value(), resources.value(best.value())))
+            best.value() = changed.key();
+        return;
+    }
+
+    // the best resource changed or went away, look at all of them
+    QMap<QString, QXmppPresence>::const_iterator candidate = resources.constBegin();
+    QMap<QString, QXmppPresence>::const_iterator i;
+    for(i = candidate + 1; i != resources.constEnd(); ++i)
+        if(isBetterPresence(i.value(), candidate.value()))
+            candidate = i;
+    m_bestResources.insert(bareJid, candidate.key());
+}
+
+/// Drops the presences which were loaded from the store or known before
+/// a disconnection and were not confirmed since.
+
+void QXmppRoster::dropStalePresences()
+{
+    if(!m_isRosterReceived)
+        return;
+
+    const QSet<QString> stale = m_stalePresences;
+    m_stalePresences.clear();
+    foreach(const QString &jid, stale)
+    {
+        const QXmppJid parsed(jid);
+        const QString bareJid = parsed.bareJid();
+        const QString resource = parsed.resource();
+        removePresence(bareJid, resource);
+        m_store.removePresence(jid);
+        notifyPresenceChanged(jid, bareJid, resource, AllPresenceFields);
+    }
+    scheduleStore();
+}
+
+/// Reports a change to the roster entry of the given bareJid.
+
+void QXmppRoster::notifyEntryChanged(const QString& bareJid)
+{
+    emit rosterChanged(bareJid);
+    m_changedEntries.insert(bareJid);
+    if(!m_batchTimer->isActive())
+        m_batchTimer->start();
+}
+
+/// Reports a change to the presence of the given resource.
+
+void QXmppRoster::notifyPresenceChanged(const QString& jid,
+                                        const QString& bareJid,
+                                        const QString& resource,
+                                        int fields)
+{
+    emit presenceChanged(bareJid, resource);
+    emit presenceUpdated(bareJid, resource, fields);
+    m_changedPresences.insert(jid);
+    if(!m_batchTimer->isActive())
+        m_batchTimer->start();
+}
+
+/// Emits the batched signals for the changes accumulated so far.
+
+void QXmppRoster::emitBatch()
+{
+    const QSet<QString> entries = m_changedEntries;
+    const QSet<QString> presences = m_changedPresences;
+    m_changedEntries.clear();
+    m_changedPresences.clear();
+
+    if(!entries.isEmpty())
+        emit rosterEntriesChanged(entries.toList());
+    if(!presences.isEmpty())
+        emit presencesChanged(presences.toList());
+}
+
+/// Drops the whole roster and all the presences, reporting them as
+/// removed.
+
+void QXmppRoster::clearState()
+{
+    const QStringList bareJids = m_entries.keys();
+    const QHash<QString, QMap<QString, QXmppPresence> > presences = m_presences;
+
+    m_staleTimer->stop();
+    m_stalePresences.clear();
+    m_entries.clear();
+    m_presences.clear();
+    m_bestResources.clear();
+    m_version = QString();
+
+    foreach(const QString &bareJid, bareJids)
+        notifyEntryChanged(bareJid);
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it;
+    for(it = presences.constBegin(); it != presences.constEnd(); ++it)
+        foreach(const QString &resource, it.value().keys())
+            notifyPresenceChanged(it.key() + "/" + resource, it.key(),
+                                  resource, AllPresenceFields);
+
+    m_storeSnapshot = true;
+    scheduleStore();
+}
+
+/// Marks all the known presences as stale.
+
+void QXmppRoster::markPresencesStale()
+{
+    m_stalePresences.clear();
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it;
+    for(it = m_presences.constBegin(); it != m_presences.constEnd(); ++it)
+        foreach(const QString &resource, it.value().keys())
+            m_stalePresences.insert(it.key() + "/" + resource);
+}
+
+/// Schedules writing the changes to the store.
+
+void QXmppRoster::scheduleStore()
+{
+    if(m_store.path().isEmpty() || m_storePending)
+        return;
+    m_storePending = true;
+    QTimer::singleShot(storeDelay, this, SLOT(saveStore()));
+}
+
+/// Writes the changes to the store, or a new snapshot if the roster was
+/// replaced, the store cannot be appended to or most of the records in
+/// the store are outdated.
+
+void QXmppRoster::saveStore()
+{
+    if(!m_storePending)
+        return;
+    m_storePending = false;
+
+    int live = m_entries.size();
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it;
+    for(it = m_presences.constBegin(); it != m_presences.constEnd(); ++it)
+        live += it.value().size();
+
+    if(m_storeSnapshot || m_store.needsSnapshot() ||
+       m_store.records() > 2 * live + 64)
+        m_store.snapshot(m_entries, m_presences, m_version);
+    else
+        m_store.flush();
+    m_storeSnapshot = false;
 }
 
 void QXmppRoster::presenceReceived(const QXmppPresence& presence)
 {
-    QString jid = presence.from();
-    QString bareJid = jidToBareJid(jid);
-    QString resource = jidToResource(jid);
+    const QXmppJid from(presence.from());
+    QString jid = from.toString();
+    QString bareJid = internBareJid(from.bareJid());
+    QString resource = from.resource();
 
+    // compare with what we know, many clients repeat their presence
+    const QXmppPresence *previous = 0;
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it =
+        m_presences.constFind(bareJid);
+    if (it != m_presences.constEnd())
+    {
+        QMap<QString, QXmppPresence>::const_iterator known =
+            it.value().constFind(resource);
+        if (known != it.value().constEnd())
+            previous = &known.value();
+    }
+
+    int changes = 0;
     if (presence.getType() == QXmppPresence::Available)
-        m_presences[bareJid][resource] = presence;
+        changes = previous ? presenceChanges(*previous, presence) : AllPresenceFields;
     else if (presence.getType() == QXmppPresence::Unavailable)
-        m_presences[bareJid].remove(resource);
+        changes = previous ? AllPresenceFields : 0;
     else
         return;
 
-    emit presenceChanged(bareJid, resource);
+    // live data supersedes what we remembered
+    if (m_stalePresences.remove(bareJid + "/" + resource))
+        changes |= StaleField;
+    if (!changes)
+        return;
+
+    if (presence.getType() == QXmppPresence::Available)
+    {
+        m_presences[bareJid][resource] = presence;
+        if (changes & (AvailabilityField | ShowField | PriorityField))
+            updateBestResource(bareJid, resource);
+    }
+    else
+        removePresence(bareJid, resource);
+
+    // a presence repeated after reconnecting is not a change
+    if (changes == StaleField)
+    {
+        emit presenceUpdated(bareJid, resource, changes);
+        return;
+    }
+
+    if (m_entries.contains(bareJid))
+    {
+        if (presence.getType() == QXmppPresence::Available)
+            m_store.addPresence(presence);
+        else
+            m_store.removePresence(jid);
+        scheduleStore();
+    }
+
+    notifyPresenceChanged(jid, bareJid, resource, changes);
 }
 
 void QXmppRoster::rosterIqReceived(const QXmppRosterIq& rosterIq)
@@ -72,10 +429,32 @@ void QXmppRoster::rosterIqReceived(const QXmppRosterIq& rosterIq)
             QList<QXmppRosterIq::Item> items = rosterIq.items();
             for(int i = 0; i < items.count(); ++i)
             {
-                QString bareJid = items.at(i).bareJid();
-                m_entries[bareJid] = items.at(i);
-                emit rosterChanged(bareJid);
+                QXmppRoster::QXmppRosterEntry entry = items.at(i);
+                QString bareJid = internBareJid(entry.bareJid());
+                if(entry.subscriptionType() == QXmppRosterIq::Item::Remove)
+                {
+                    m_entries.remove(bareJid);
+                    m_store.removeEntry(bareJid);
+                }
+                else
+                {
+                    entry.setBareJid(bareJid);
+                    m_entries.insert(bareJid, entry);
+                    m_store.addEntry(entry);
+                }
+                notifyEntryChanged(bareJid);
+            }
+
+            // XEP-0237: each push carries the new roster version
+            if(m_isRosterReceived && !items.isEmpty() &&
+               !rosterIq.version().isNull() && rosterIq.version() != m_version)
+            {
+                m_version = rosterIq.version();
+                m_store.setVersion(m_version);
             }
+            if(!items.isEmpty())
+                scheduleStore();
+
             if(rosterIq.type() == QXmppIq::Set) // send result iq
             {
                 QXmppIq returnIq(QXmppIq::Result);
@@ -96,11 +475,42 @@ void QXmppRoster::rosterRequestIqReceived(const QXmppRosterIq& rosterIq)
     case QXmppIq::Set:
     case QXmppIq::Result:
         {
+            // XEP-0237: if the version we sent is still current, the server
+            // does not send any items and we keep the stored roster
             QList<QXmppRosterIq::Item> items = rosterIq.items();
-            for(int i = 0; i < items.count(); ++i)
+            if(m_version.isEmpty() || rosterIq.version() != m_version ||
+               !items.isEmpty())
             {
-                QString bareJid = items.at(i).bareJid();
-                m_entries[bareJid] = items.at(i);
+                const QHash<QString, QXmppRoster::QXmppRosterEntry> previous = m_entries;
+                m_entries = QHash<QString, QXmppRoster::QXmppRosterEntry>();
+                m_entries.reserve(items.count());
+                for(int i = 0; i < items.count(); ++i)
+                {
+                    QXmppRoster::QXmppRosterEntry entry = items.at(i);
+                    QString bareJid = internBareJid(entry.bareJid());
+                    entry.setBareJid(bareJid);
+                    m_entries.insert(bareJid, entry);
+                }
+
+                // when we already knew the roster, report the entries which
+                // were added, changed or removed meanwhile
+                if(!previous.isEmpty())
+                {
+                    QHash<QString, QXmppRoster::QXmppRosterEntry>::const_iterator it;
+                    for(it = m_entries.constBegin(); it != m_entries.constEnd(); ++it)
+                    {
+                        QHash<QString, QXmppRoster::QXmppRosterEntry>::const_iterator old =
+                            previous.constFind(it.key());
+                        if(old == previous.constEnd() || !isSameEntry(old.value(), it.value()))
+                            notifyEntryChanged(it.key());
+                    }
+                    for(it = previous.constBegin(); it != previous.constEnd(); ++it)
+                        if(!m_entries.contains(it.key()))
+                            notifyEntryChanged(it.key());
+                }
+                m_version = rosterIq.version();
+                m_storeSnapshot = true;
+                scheduleStore();
             }
             if(rosterIq.type() == QXmppIq::Set) // send result iq
             {
@@ -109,6 +519,8 @@ void QXmppRoster::rosterRequestIqReceived(const QXmppRosterIq& rosterIq)
                 m_stream->sendPacket(returnIq);
             }
             m_isRosterReceived = true;
+            if(!m_stalePresences.isEmpty())
+                m_staleTimer->start();
             emit rosterReceived();
             break;
         }
@@ -117,14 +529,16 @@ void QXmppRoster::rosterRequestIqReceived(const QXmppRosterIq& rosterIq)
     }
 }
 
-/// Function to get all the bareJids present in the roster.
+/// Function to get all the bareJids present in the roster, sorted.
 ///
 /// \return QStringList list of all the bareJids
 ///
 
 QStringList QXmppRoster::getRosterBareJids() const
 {
-    return m_entries.keys();
+    QStringList bareJids = m_entries.keys();
+    bareJids.sort();
+    return bareJids;
 }
 
 /// Returns the roster entry of the given bareJid. If the bareJid is not in the
@@ -138,8 +552,10 @@ QXmppRoster::QXmppRosterEntry QXmppRoster::getRosterEntry(
         const QString& bareJid) const
 {
     // will return blank entry if bareJid does'nt exist
-    if(m_entries.contains(bareJid))
-        return m_entries.value(bareJid);
+    QHash<QString, QXmppRoster::QXmppRosterEntry>::const_iterator it =
+        m_entries.constFind(bareJid);
+    if(it != m_entries.constEnd())
+        return it.value();
     else
     {
         qWarning("QXmppRoster::getRosterEntry(): bareJid doesn't exist in roster db");
@@ -151,14 +567,18 @@ QXmppRoster::QXmppRosterEntry QXmppRoster::getRosterEntry(
 ///
 /// \return Map of bareJid and its respective QXmppRoster::QXmppRosterEntry
 ///
-/// \note This function is obsolete, use getRosterBareJids() and
-/// getRosterEntry() to get all the roster entries.
+/// \note This function is obsolete and copies the whole roster, use
+/// entries() or getRosterBareJids() and getRosterEntry() instead.
 ///
 
 QMap<QString, QXmppRoster::QXmppRosterEntry>
         QXmppRoster::getRosterEntries() const
 {
-    return m_entries;
+    QMap<QString, QXmppRoster::QXmppRosterEntry> entries;
+    QHash<QString, QXmppRoster::QXmppRosterEntry>::const_iterator it;
+    for(it = m_entries.constBegin(); it != m_entries.constEnd(); ++it)
+        entries.insert(it.key(), it.value());
+    return entries;
 }
 
 /// Get all the associated resources with the given bareJid.
@@ -169,8 +589,10 @@ QMap<QString, QXmppRoster::QXmppRosterEntry>
 
 QStringList QXmppRoster::getResources(const QString& bareJid) const
 {
-    if(m_presences.contains(bareJid))
-        return m_presences[bareJid].keys();
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it =
+        m_presences.constFind(bareJid);
+    if(it != m_presences.constEnd())
+        return it.value().keys();
     else
         return QStringList();
 }
@@ -186,8 +608,11 @@ QStringList QXmppRoster::getResources(const QString& bareJid) const
 QMap<QString, QXmppPresence> QXmppRoster::getAllPresencesForBareJid(
         const QString& bareJid) const
 {
-    if(m_presences.contains(bareJid))
-        return m_presences[bareJid];
+    // the map is implicitly shared, so this does not copy the presences
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it =
+        m_presences.constFind(bareJid);
+    if(it != m_presences.constEnd())
+        return it.value();
     else
         return QMap<QString, QXmppPresence>();
 }
@@ -202,13 +627,18 @@ QMap<QString, QXmppPresence> QXmppRoster::getAllPresencesForBareJid(
 QXmppPresence QXmppRoster::getPresence(const QString& bareJid,
                                        const QString& resource) const
 {
-    if(m_presences.contains(bareJid) && m_presences[bareJid].contains(resource))
-        return m_presences[bareJid][resource];
-    else
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it =
+        m_presences.constFind(bareJid);
+    if(it != m_presences.constEnd())
     {
-        qWarning("QXmppRoster::getPresence(): invalid bareJid");
-        return QXmppPresence();
+        QMap<QString, QXmppPresence>::const_iterator presence =
+            it.value().constFind(resource);
+        if(presence != it.value().constEnd())
+            return presence.value();
     }
+
+    qWarning("QXmppRoster::getPresence(): invalid bareJid");
+    return QXmppPresence();
 }
 
 /// [OBSOLETE] Returns all the presence entries in the database.
@@ -216,15 +646,95 @@ QXmppPresence QXmppRoster::getPresence(const QString& bareJid,
 /// \return Map of bareJid and map of resource and its presence that is
 /// QMap<QString, QMap<QString, QXmppPresence> >
 ///
-/// \note This function is obsolete, use getRosterBareJids(), getResources()
-/// and getPresence() or getAllPresencesForBareJid()
-/// to get all the presence entries.
+/// \note This function is obsolete and copies all the presences, use
+/// presences() or getRosterBareJids(), getResources() and getPresence()
+/// or getAllPresencesForBareJid() instead.
 
 QMap<QString, QMap<QString, QXmppPresence> > QXmppRoster::getAllPresences() const
+{
+    QMap<QString, QMap<QString, QXmppPresence> > presences;
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it;
+    for(it = m_presences.constBegin(); it != m_presences.constEnd(); ++it)
+        presences.insert(it.key(), it.value());
+    return presences;
+}
+
+/// Returns all the roster entries, keyed by bareJid.
+///
+/// The hash is implicitly shared with the roster: this is a constant time
+/// operation and the entries are only copied if the roster changes while
+/// the returned hash is still in use.
+///
+/// \return Hash of bareJid and its respective QXmppRoster::QXmppRosterEntry
+///
+
+QHash<QString, QXmppRoster::QXmppRosterEntry> QXmppRoster::entries() const
+{
+    return m_entries;
+}
+
+/// Returns the presences of all the resources of all the bareJids.
+///
+/// Like entries(), this is a constant time operation which does not copy
+/// the presences unless they change while the returned hash is in use.
+///
+/// \return Hash of bareJid and map of resource and its presence
+///
+
+QHash<QString, QMap<QString, QXmppPresence> > QXmppRoster::presences() const
 {
     return m_presences;
 }
 
+/// Returns the resource of the given bareJid which should receive messages
+/// addressed to the contact: the one with the highest priority and, among
+/// those, the most available status.
+///
+/// This is kept up to date as presences are received, so it does not
+/// depend on the number of resources.
+///
+/// \param bareJid as a QString
+/// \return resource as a QString, or an empty string if the bareJid has
+/// no available resource
+///
+
+QString QXmppRoster::bestResource(const QString& bareJid) const
+{
+    return m_bestResources.value(bareJid);
+}
+
+/// Returns the presence of the best resource of the given bareJid, as
+/// returned by bestResource().
+///
+/// \param bareJid as a QString
+/// \return QXmppPresence, which is unavailable if the bareJid has no
+/// available resource
+///
+
+QXmppPresence QXmppRoster::bestPresence(const QString& bareJid) const
+{
+    QHash<QString, QString>::const_iterator best = m_bestResources.constFind(bareJid);
+    if(best != m_bestResources.constEnd())
+    {
+        QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it =
+            m_presences.constFind(bareJid);
+        if(it != m_presences.constEnd())
+            return it.value().value(best.value());
+    }
+    return QXmppPresence(QXmppPresence::Unavailable);
+}
+
+/// Returns the number of bareJids which have at least one available
+/// resource.
+///
+/// \return count as an int
+///
+
+int QXmppRoster::onlineCount() const
+{
+    return m_bestResources.size();
+}
+
 /// Function to check whether the roster has been received or not.
 ///
 /// \return true if roster received else false
@@ -234,3 +744,124 @@ bool QXmppRoster::isRosterReceived()
     return m_isRosterReceived;
 }
 
+/// Returns the path of the file in which the roster is stored, or an empty
+/// string if the roster is not stored.
+///
+/// \return path as a QString
+///
+
+QString QXmppRoster::storePath() const
+{
+    return m_store.path();
+}
+
+/// Sets the path of the file in which the roster and the last known
+/// presences are stored between sessions, and loads its contents.
+///
+/// The stored roster can be read immediately, before connecting, and
+/// is kept across disconnections. Stored presences are reported as stale
+/// by isPresenceStale() until the server confirms them. Those which are not
+/// confirmed shortly after the roster is received are dropped.
+///
+/// When the server supports XEP-0237: Roster Versioning, only the changes
+/// made since the stored version are downloaded on login.
+///
+/// The store should be set before connecting and must not be shared
+/// between accounts.
+///
+/// \param path as a QString
+///
+
+void QXmppRoster::setStorePath(const QString& path)
+{
+    if(m_storePending)
+        saveStore();
+
+    m_store.setPath(path);
+    if(!m_isRosterReceived &&
+       m_store.load(m_entries, m_presences, m_version))
+    {
+        m_bestResources.clear();
+        QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it;
+        for(it = m_presences.constBegin(); it != m_presences.constEnd(); ++it)
+            updateBestResource(it.key(), QString());
+        markPresencesStale();
+    }
+}
+
+/// Returns true if the presence of the given resource was loaded from the
+/// store or known before a disconnection, and has not been confirmed since.
+///
+/// \param bareJid as a QString
+/// \param resource as a QString
+/// \return true if the presence is stale
+///
+
+bool QXmppRoster::isPresenceStale(const QString& bareJid,
+                                  const QString& resource) const
+{
+    return m_stalePresences.contains(bareJid + "/" + resource);
+}
+
+/// Returns the version of the roster, as defined by XEP-0237: Roster
+/// Versioning, or a null string if the roster is not versioned.
+///
+/// \return version as a QString
+///
+
+QString QXmppRoster::version() const
+{
+    return m_version;
+}
+
+/// Returns the interval in milliseconds over which changes are accumulated
+/// before presencesChanged() and rosterEntriesChanged() are emitted.
+///
+/// \return interval in milliseconds
+///
+
+int QXmppRoster::batchInterval() const
+{
+    return m_batchTimer->interval();
+}
+
+/// Sets the interval in milliseconds over which changes are accumulated
+/// before presencesChanged() and rosterEntriesChanged() are emitted.
+///
+/// The default of 0 reports the changes once control returns to the event
+/// loop, which already merges all the items of a roster push or all the
+/// presences received in a single read. A longer interval trades latency
+/// for fewer updates.
+///
+/// \param msecs interval in milliseconds
+///
+
+void QXmppRoster::setBatchInterval(int msecs)
+{
+    m_batchTimer->setInterval(qMax(0, msecs));
+}
+
+/// Returns the time in milliseconds after the roster is received during
+/// which the presences known before connecting are kept, waiting for the
+/// server to confirm them.
+///
+/// \return timeout in milliseconds
+///
+
+int QXmppRoster::staleTimeout() const
+{
+    return m_staleTimer->interval();
+}
+
+/// Sets the time in milliseconds after the roster is received during
+/// which the presences known before connecting are kept, waiting for the
+/// server to confirm them. Those which are not confirmed by then are
+/// reported as unavailable.
+///
+/// \param msecs timeout in milliseconds
+///
+
+void QXmppRoster::setStaleTimeout(int msecs)
+{
+    m_staleTimer->setInterval(qMax(0, msecs));
+}
@@ -26,13 +26,16 @@
 #define QXMPPROSTER_H
 
 #include <QObject>
+#include <QHash>
 #include <QMap>
 #include <QSet>
 #include <QStringList>
 
 #include "QXmppClient.h"
 #include "QXmppRosterIq.h"
+#include "QXmppRosterStore.h"
 
+class QTimer;
 class QXmppRosterIq;
 class QXmppPresence;
 
@@ -58,6 +61,24 @@ class QXmppPresence;
 /// Signals presenceChanged() or rosterChanged() are emitted whenever presence
 /// or roster changes respectively.
 ///
+/// For large rosters, presencesChanged() and rosterEntriesChanged() report
+/// the same changes in batches, once per event loop iteration or once per
+/// batchInterval(), so that a login does not trigger a separate update for
+/// every contact.
+///
+/// The roster and presences are kept when the connection is lost. After
+/// reconnecting, only the entries and presences which actually changed are
+/// reported. The presences known before the disconnection stay until the
+/// next roster arrives, and those which are not confirmed by the server
+/// within staleTimeout() of it are then reported as unavailable. If the
+/// client reconnects with a different account, the previous roster and
+/// presences are dropped instead.
+///
+/// If a store path is set with setStorePath(), the roster and the last known
+/// presences are saved to disk and available as soon as the application
+/// starts. When the server supports XEP-0237: Roster Versioning, only the
+/// changes since the stored version are downloaded on the next login.
+///
 
 class QXmppRoster : public QObject
 {
@@ -67,6 +88,20 @@ public:
     // FIXME : is this class really necessary?
     typedef QXmppRosterIq::Item QXmppRosterEntry;
 
+    /// This enum describes the parts of a presence reported as changed
+    /// by presenceUpdated().
+    enum PresenceField
+    {
+        AvailabilityField = 1,  ///< The resource became available or unavailable.
+        ShowField = 2,          ///< The status type changed.
+        StatusTextField = 4,    ///< The status text changed.
+        PriorityField = 8,      ///< The priority changed.
+        CapabilitiesField = 16, ///< The advertised capabilities changed.
+        ExtensionsField = 32,   ///< The extension elements changed.
+        StaleField = 64,        ///< A stale presence was confirmed.
+        AllPresenceFields = 63,
+    };
+
     QXmppRoster(QXmppStream* stream);
     ~QXmppRoster();
     
@@ -82,6 +117,26 @@ public:
     QXmppPresence getPresence(const QString& bareJid,
                               const QString& resource) const;
 
+    QHash<QString, QXmppRoster::QXmppRosterEntry> entries() const;
+    QHash<QString, QMap<QString, QXmppPresence> > presences() const;
+
+    QString bestResource(const QString& bareJid) const;
+    QXmppPresence bestPresence(const QString& bareJid) const;
+    int onlineCount() const;
+
+    bool isPresenceStale(const QString& bareJid,
+                         const QString& resource) const;
+
+    QString storePath() const;
+    void setStorePath(const QString& path);
+    QString version() const;
+
+    int batchInterval() const;
+    void setBatchInterval(int msecs);
+
+    int staleTimeout() const;
+    void setStaleTimeout(int msecs);
+
 signals:
     /// This signal is emitted when the Roster IQ is received after a successful
     /// connection.
@@ -90,21 +145,68 @@ signals:
     /// This signal is emitted when the presence of a particular bareJid and resource changes.
     void presenceChanged(const QString& bareJid, const QString& resource);
 
+    /// This signal is emitted along with presenceChanged(), and tells which
+    /// parts of the presence changed as a combination of PresenceField values.
+    /// It is also emitted alone, with StaleField, when a presence known
+    /// before reconnecting is confirmed unchanged.
+    void presenceUpdated(const QString& bareJid, const QString& resource,
+                         int fields);
+
     /// This signal is emitted when the roster entry of a particular bareJid changes.
     void rosterChanged(const QString& bareJid);
 
+    /// This signal is emitted with the full jids of all the resources whose
+    /// presence changed since it was last emitted, in no particular order.
+    void presencesChanged(const QStringList& jids);
+
+    /// This signal is emitted with all the bareJids whose roster entry
+    /// changed since it was last emitted, in no particular order.
+    void rosterEntriesChanged(const QStringList& bareJids);
+
 private:
     //reverse pointer to stream
     QXmppStream* m_stream;
-    //map of bareJid and its rosterEntry
-    QMap<QString, QXmppRoster::QXmppRosterEntry> m_entries;
-    // map of resources of the jid and map of resouces and presences
-    QMap<QString, QMap<QString, QXmppPresence> > m_presences;
+    // bare JID of the account the roster and presences belong to
+    QString m_accountJid;
+    // hash of bareJid and its rosterEntry
+    QHash<QString, QXmppRoster::QXmppRosterEntry> m_entries;
+    // hash of bareJid and map of its resources and presences, the keys
+    // share their data with those of m_entries
+    QHash<QString, QMap<QString, QXmppPresence> > m_presences;
+    // hash of bareJid and its most available resource
+    QHash<QString, QString> m_bestResources;
     // flag to store that QXmppRoster has been populated
     bool m_isRosterReceived;
+    // XEP-0237: version of the roster
+    QString m_version;
+    // snapshot of the roster and presences on disk
+    QXmppRosterStore m_store;
+    bool m_storePending;
+    bool m_storeSnapshot;
+    // full jids of the presences which have not been confirmed yet
+    QSet<QString> m_stalePresences;
+    QTimer *m_staleTimer;
+    // changes waiting to be reported by the batched signals
+    QSet<QString> m_changedEntries;
+    QSet<QString> m_changedPresences;
+    QTimer *m_batchTimer;
+
+    QString internBareJid(const QString& bareJid) const;
+    void removePresence(const QString& bareJid, const QString& resource);
+    void updateBestResource(const QString& bareJid, const QString& resource);
+    void clearState();
+    void markPresencesStale();
+    void scheduleStore();
+    void notifyEntryChanged(const QString& bareJid);
+    void notifyPresenceChanged(const QString& jid, const QString& bareJid,
+                               const QString& resource, int fields);
 
 private slots:
+    void connected();
     void disconnected();
+    void dropStalePresences();
+    void emitBatch();
+    void saveStore();
     void presenceReceived(const QXmppPresence&);
     void rosterIqReceived(const QXmppRosterIq&);
     void rosterRequestIqReceived(const QXmppRosterIq&);
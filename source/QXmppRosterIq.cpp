@@ -39,6 +39,31 @@ QList<QXmppRosterIq::Item> QXmppRosterIq::items() const
     return m_items;
 }
 
+/// Returns the roster version, as defined by XEP-0237: Roster Versioning.
+///
+/// A null string means the roster is not versioned.
+///
+/// \return version as a QString
+///
+
+QString QXmppRosterIq::version() const
+{
+    return m_version;
+}
+
+/// Sets the roster version, as defined by XEP-0237: Roster Versioning.
+///
+/// Set an empty but non-null string to request a versioned roster
+/// when no version is known yet.
+///
+/// \param version as a QString
+///
+
+void QXmppRosterIq::setVersion(const QString& version)
+{
+    m_version = version;
+}
+
 bool QXmppRosterIq::isRosterIq(const QDomElement &element)
 {
     return (element.firstChildElement("query").namespaceURI() == ns_roster);
@@ -49,9 +74,11 @@ void QXmppRosterIq::parse(const QDomElement &element)
     QXmppStanza::parse(element);
     setTypeFromStr(element.attribute("type"));
 
-    QDomElement itemElement = element.
-                              firstChildElement("query").
-                              firstChildElement("item");
+    QDomElement queryElement = element.firstChildElement("query");
+    if(queryElement.hasAttribute("ver"))
+        m_version = queryElement.attribute("ver");
+
+    QDomElement itemElement = queryElement.firstChildElement("item");
     while(!itemElement.isNull())
     {
         QXmppRosterIq::Item item;
@@ -65,6 +92,8 @@ void QXmppRosterIq::toXmlElementFromChild(QXmlStreamWriter *writer) const
 {
     writer->writeStartElement("query");
     writer->writeAttribute( "xmlns", ns_roster);
+    if(!m_version.isNull())
+        writer->writeAttribute("ver", m_version);
 
     for(int i = 0; i < m_items.count(); ++i)
         m_items.at(i).toXml(writer);
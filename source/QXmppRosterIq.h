@@ -90,6 +90,9 @@ public:
     void addItem(const Item&);
     QList<Item> items() const;
 
+    QString version() const;
+    void setVersion(const QString&);
+
     static bool isRosterIq(const QDomElement &element);
     void parse(const QDomElement &element);
     void toXmlElementFromChild(QXmlStreamWriter *writer) const;
@@ -99,6 +102,7 @@ public:
 
 private:
     QList<Item> m_items;
+    QString m_version;
 };
 
 #endif // QXMPPROSTERIQ_H
@@ -0,0 +1,456 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <QDataStream>
+#include <QDomDocument>
+#include <QFile>
+#include <QRunnable>
+#include <QStringList>
+#include <QXmlStreamWriter>
+
+#include "QXmppJid.h"
+#include "QXmppRosterStore.h"
+
+// file header ("QXRS" and the format version)
+const quint32 storeMagic = 0x51585253;
+const quint32 storeFormat = 2;
+
+enum StoreRecord
+{
+    VersionRecord = 1,
+    EntryRecord,
+    EntryRemovedRecord,
+    PresenceRecord,
+    PresenceRemovedRecord,
+};
+
+static QDataStream &operator<<(QDataStream &stream, const QXmppRosterIq::Item &item)
+{
+    return stream << item.bareJid()
+                  << item.name()
+                  << quint8(item.subscriptionType())
+                  << item.subscriptionStatus()
+                  << QStringList(item.groups().toList());
+}
+
+static QDataStream &operator>>(QDataStream &stream, QXmppRosterIq::Item &item)
+{
+    QString bareJid, name, status;
+    quint8 type;
+    QStringList groups;
+    stream >> bareJid >> name >> type >> status >> groups;
+    item.setBareJid(bareJid);
+    item.setName(name);
+    item.setSubscriptionType(QXmppRosterIq::Item::SubscriptionType(type));
+    item.setSubscriptionStatus(status);
+    item.setGroups(groups.toSet());
+    return stream;
+}
+
+// the extensions are kept as XML, wrapped in a single element
+static QDataStream &operator<<(QDataStream &stream, const QXmppPresence &presence)
+{
+    QByteArray extensions;
+    if (!presence.extensions().isEmpty())
+    {
+        QXmlStreamWriter writer(&extensions);
+        writer.writeStartElement("extensions");
+        foreach (const QXmppElement &extension, presence.extensions())
+            extension.toXml(&writer);
+        writer.writeEndElement();
+    }
+
+    return stream << presence.from()
+                  << quint8(presence.getStatus().getType())
+                  << presence.getStatus().getStatusText()
+                  << qint32(presence.getStatus().getPriority())
+                  << presence.capabilityHash()
+                  << presence.capabilityNode()
+                  << presence.capabilityVer()
+                  << extensions;
+}
+
+static QDataStream &operator>>(QDataStream &stream, QXmppPresence &presence)
+{
+    QString jid, text, capabilityHash, capabilityNode, capabilityVer;
+    quint8 type;
+    qint32 priority;
+    QByteArray extensions;
+    stream >> jid >> type >> text >> priority
+           >> capabilityHash >> capabilityNode >> capabilityVer >> extensions;
+    presence.setFrom(jid);
+    presence.setType(QXmppPresence::Available);
+    presence.setStatus(QXmppPresence::Status(QXmppPresence::Status::Type(type), text, priority));
+    presence.setCapabilityHash(capabilityHash);
+    presence.setCapabilityNode(capabilityNode);
+    presence.setCapabilityVer(capabilityVer);
+
+    QDomDocument document;
+    if (!extensions.isEmpty() && document.setContent(extensions, true))
+    {
+        QXmppElementList list;
+        QDomElement element = document.documentElement().firstChildElement();
+        for (; !element.isNull(); element = element.nextSiblingElement())
+            list << QXmppElement(element);
+        presence.setExtensions(list);
+    }
+    return stream;
+}
+
+/// Writes a block of records to the store, either appending it or
+/// replacing the whole file.
+///
+/// A new snapshot is written aside and then swapped in. If the application
+/// stops between removing the old file and renaming the new one, load()
+/// picks up the new one.
+
+class QXmppRosterStoreWriter : public QRunnable
+{
+public:
+    QXmppRosterStoreWriter(const QString &path, const QByteArray &data, bool replace)
+        : m_data(data), m_path(path), m_replace(replace)
+    {
+    }
+
+    void run()
+    {
+        if (m_replace)
+        {
+            // write the new snapshot aside, then swap it in
+            QFile file(m_path + ".tmp");
+            if (!file.open(QIODevice::WriteOnly) || file.write(m_data) != m_data.size())
+            {
+                qWarning("QXmppRosterStore: could not write %s", qPrintable(file.fileName()));
+                return;
+            }
+            file.close();
+            QFile::remove(m_path);
+            if (!file.rename(m_path))
+                qWarning("QXmppRosterStore: could not replace %s", qPrintable(m_path));
+        } else {
+            QFile file(m_path);
+            if (!file.open(QIODevice::Append) || file.write(m_data) != m_data.size())
+                qWarning("QXmppRosterStore: could not append to %s", qPrintable(m_path));
+        }
+    }
+
+private:
+    QByteArray m_data;
+    QString m_path;
+    bool m_replace;
+};
+
+QXmppRosterStore::QXmppRosterStore()
+    : m_pendingRecords(0),
+    m_records(0),
+    m_needsSnapshot(true)
+{
+    m_pool.setMaxThreadCount(1);
+}
+
+QXmppRosterStore::~QXmppRosterStore()
+{
+    m_pool.waitForDone();
+}
+
+/// Returns the path of the store, or an empty string if it is disabled.
+///
+
+QString QXmppRosterStore::path() const
+{
+    return m_path;
+}
+
+/// Sets the path of the store. Set an empty path to disable the store.
+///
+/// \param path
+
+void QXmppRosterStore::setPath(const QString &path)
+{
+    m_pool.waitForDone();
+    m_path = path;
+    m_pending.clear();
+    m_pendingRecords = 0;
+    m_records = 0;
+    m_needsSnapshot = true;
+}
+
+/// Loads the roster, the presences and the roster version from the store.
+///
+/// Records which were cut short, for instance because the application
+/// was killed while appending them, are ignored and the store then needs
+/// a new snapshot before anything can be appended to it.
+///
+
+bool QXmppRosterStore::load(QHash<QString, QXmppRosterIq::Item> &entries,
+                            QHash<QString, QMap<QString, QXmppPresence> > &presences,
+                            QString &version)
+{
+    if (m_path.isEmpty())
+        return false;
+
+    // make sure we read our own writes
+    m_pool.waitForDone();
+    m_needsSnapshot = true;
+
+    // finish replacing the store if that was interrupted, the new
+    // snapshot is complete once the old file has been removed
+    if (!QFile::exists(m_path) && QFile::exists(m_path + ".tmp"))
+        QFile::rename(m_path + ".tmp", m_path);
+
+    QFile file(m_path);
+    if (!file.open(QIODevice::ReadOnly) || !file.size())
+        return false;
+
+    uchar *map = file.map(0, file.size());
+    const QByteArray data = map ?
+        QByteArray::fromRawData(reinterpret_cast<const char*>(map), file.size()) :
+        file.readAll();
+
+    QDataStream stream(data);
+    stream.setVersion(QDataStream::Qt_4_4);
+    quint32 magic, format;
+    stream >> magic >> format;
+    if (stream.status() != QDataStream::Ok || magic != storeMagic || format != storeFormat)
+    {
+        if (map)
+            file.unmap(map);
+        return false;
+    }
+
+    entries.clear();
+    presences.clear();
+    version = QString();
+    m_records = 0;
+    while (!stream.atEnd())
+    {
+        quint8 type;
+        stream >> type;
+        if (type == VersionRecord)
+        {
+            QString ver;
+            stream >> ver;
+            if (stream.status() == QDataStream::Ok)
+                version = ver;
+        }
+        else if (type == EntryRecord)
+        {
+            QXmppRosterIq::Item item;
+            stream >> item;
+            if (stream.status() == QDataStream::Ok)
+                entries[item.bareJid()] = item;
+        }
+        else if (type == EntryRemovedRecord)
+        {
+            QString bareJid;
+            stream >> bareJid;
+            if (stream.status() == QDataStream::Ok)
+            {
+                entries.remove(bareJid);
+                presences.remove(bareJid);
+            }
+        }
+        else if (type == PresenceRecord)
+        {
+            QXmppPresence presence;
+            stream >> presence;
+            if (stream.status() == QDataStream::Ok)
+            {
+                // share the bare JID with the roster entry
+                const QXmppJid from(presence.from());
+                QString bareJid = from.bareJid();
+                QHash<QString, QXmppRosterIq::Item>::const_iterator entry = entries.constFind(bareJid);
+                if (entry != entries.constEnd())
+                    bareJid = entry.key();
+                presences[bareJid][from.resource()] = presence;
+            }
+        }
+        else if (type == PresenceRemovedRecord)
+        {
+            QString jid;
+            stream >> jid;
+            if (stream.status() == QDataStream::Ok)
+            {
+                const QXmppJid parsed(jid);
+                QHash<QString, QMap<QString, QXmppPresence> >::iterator it = presences.find(parsed.bareJid());
+                if (it != presences.end())
+                {
+                    it->remove(parsed.resource());
+                    if (it->isEmpty())
+                        presences.erase(it);
+                }
+            }
+        }
+        else
+        {
+            break;
+        }
+        if (stream.status() != QDataStream::Ok)
+            break;
+        m_records++;
+    }
+
+    // appending after a partial record would hide everything that follows
+    m_needsSnapshot = stream.status() != QDataStream::Ok || !stream.atEnd();
+
+    if (map)
+        file.unmap(map);
+    return true;
+}
+
+/// Records a new or updated roster entry.
+///
+
+void QXmppRosterStore::addEntry(const QXmppRosterIq::Item &item)
+{
+    if (m_path.isEmpty())
+        return;
+    QDataStream stream(&m_pending, QIODevice::Append);
+    stream.setVersion(QDataStream::Qt_4_4);
+    stream << quint8(EntryRecord) << item;
+    m_pendingRecords++;
+}
+
+/// Records the removal of a roster entry, along with its presences.
+///
+
+void QXmppRosterStore::removeEntry(const QString &bareJid)
+{
+    if (m_path.isEmpty())
+        return;
+    QDataStream stream(&m_pending, QIODevice::Append);
+    stream.setVersion(QDataStream::Qt_4_4);
+    stream << quint8(EntryRemovedRecord) << bareJid;
+    m_pendingRecords++;
+}
+
+/// Records the presence of a resource.
+///
+
+void QXmppRosterStore::addPresence(const QXmppPresence &presence)
+{
+    if (m_path.isEmpty())
+        return;
+    QDataStream stream(&m_pending, QIODevice::Append);
+    stream.setVersion(QDataStream::Qt_4_4);
+    stream << quint8(PresenceRecord) << presence;
+    m_pendingRecords++;
+}
+
+/// Records that a resource went offline.
+///
+
+void QXmppRosterStore::removePresence(const QString &jid)
+{
+    if (m_path.isEmpty())
+        return;
+    QDataStream stream(&m_pending, QIODevice::Append);
+    stream.setVersion(QDataStream::Qt_4_4);
+    stream << quint8(PresenceRemovedRecord) << jid;
+    m_pendingRecords++;
+}
+
+/// Records a new roster version.
+///
+
+void QXmppRosterStore::setVersion(const QString &version)
+{
+    if (m_path.isEmpty())
+        return;
+    QDataStream stream(&m_pending, QIODevice::Append);
+    stream.setVersion(QDataStream::Qt_4_4);
+    stream << quint8(VersionRecord) << version;
+    m_pendingRecords++;
+}
+
+/// Returns the number of records in the store, including
+/// those which have not been flushed yet.
+///
+
+int QXmppRosterStore::records() const
+{
+    return m_records + m_pendingRecords;
+}
+
+/// Returns true if the store must be rewritten with snapshot() before
+/// records can be appended, because the file is missing, has an unknown
+/// format or ends with a record which was cut short.
+///
+
+bool QXmppRosterStore::needsSnapshot() const
+{
+    return m_needsSnapshot;
+}
+
+/// Appends the buffered records to the store.
+///
+/// Does nothing while needsSnapshot() is true.
+///
+
+void QXmppRosterStore::flush()
+{
+    if (m_path.isEmpty() || m_pending.isEmpty() || m_needsSnapshot)
+        return;
+
+    m_pool.start(new QXmppRosterStoreWriter(m_path, m_pending, false));
+    m_records += m_pendingRecords;
+    m_pending.clear();
+    m_pendingRecords = 0;
+}
+
+/// Replaces the store with a snapshot of the given roster, presences and
+/// version, discarding any buffered records.
+///
+
+void QXmppRosterStore::snapshot(const QHash<QString, QXmppRosterIq::Item> &entries,
+                                const QHash<QString, QMap<QString, QXmppPresence> > &presences,
+                                const QString &version)
+{
+    if (m_path.isEmpty())
+        return;
+
+    QByteArray data;
+    QDataStream stream(&data, QIODevice::WriteOnly);
+    stream.setVersion(QDataStream::Qt_4_4);
+    stream << storeMagic << storeFormat;
+    stream << quint8(VersionRecord) << version;
+    m_records = 1;
+    foreach (const QXmppRosterIq::Item &item, entries)
+    {
+        stream << quint8(EntryRecord) << item;
+        m_records++;
+    }
+    QHash<QString, QMap<QString, QXmppPresence> >::const_iterator it;
+    for (it = presences.constBegin(); it != presences.constEnd(); ++it)
+    {
+        if (!entries.contains(it.key()))
+            continue;
+        foreach (const QXmppPresence &presence, it.value())
+        {
+            stream << quint8(PresenceRecord) << presence;
+            m_records++;
+        }
+    }
+
+    m_pool.start(new QXmppRosterStoreWriter(m_path, data, true));
+    m_pending.clear();
+    m_pendingRecords = 0;
+    m_needsSnapshot = false;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPROSTERSTORE_H
+#define QXMPPROSTERSTORE_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QMap>
+#include <QThreadPool>
+
+#include "QXmppPresence.h"
+#include "QXmppRosterIq.h"
+
+/// \brief The QXmppRosterStore class keeps a binary snapshot of a roster
+/// and of the last known presences on disk.
+///
+/// The file starts with a snapshot of the whole roster followed by the
+/// changes recorded since, so that each change only appends a few bytes.
+/// Changes are buffered until flush() is called, and the file is written
+/// on a worker thread. It is memory-mapped for loading.
+///
+/// Records are only appended to a file which was loaded completely or
+/// written by snapshot(); any other file is replaced by the next snapshot.
+///
+
+class QXmppRosterStore
+{
+public:
+    QXmppRosterStore();
+    ~QXmppRosterStore();
+
+    QString path() const;
+    void setPath(const QString &path);
+
+    bool load(QHash<QString, QXmppRosterIq::Item> &entries,
+              QHash<QString, QMap<QString, QXmppPresence> > &presences,
+              QString &version);
+
+    void addEntry(const QXmppRosterIq::Item &item);
+    void removeEntry(const QString &bareJid);
+    void addPresence(const QXmppPresence &presence);
+    void removePresence(const QString &jid);
+    void setVersion(const QString &version);
+
+    int records() const;
+    bool needsSnapshot() const;
+    void flush();
+    void snapshot(const QHash<QString, QXmppRosterIq::Item> &entries,
+                  const QHash<QString, QMap<QString, QXmppPresence> > &presences,
+                  const QString &version);
+
+private:
+    QString m_path;
+    QByteArray m_pending;
+    int m_pendingRecords;
+    int m_records;
+    bool m_needsSnapshot;
+
+    // runs the writes one at a time, in order
+    QThreadPool m_pool;
+};
+
+#endif
@@ -31,6 +31,12 @@
 
 const static char SocksVersion = 5;
 
+// time allowed to complete a SOCKS5 handshake (10 seconds)
+const static int handshakeTimeout = 10000;
+
+// maximum number of incoming SOCKS5 handshakes in progress
+const static int maxPendingHandshakes = 64;
+
 enum AuthenticationMethod {
     NoAuthentication = 0,
     GSSAPI = 1,
@@ -81,21 +87,48 @@ static QByteArray encodeHostAndPort(quint8 type, const QByteArray &host, quint16
     return buffer;
 }
 
+/// Returns the length of the encoded type/host/port at the start of
+/// \a buffer, 0 if more data is needed to tell or -1 if the address
+/// type is not supported.
+///
+
+static int hostAndPortLength(const QByteArray &buffer)
+{
+    if (buffer.isEmpty())
+        return 0;
+
+    switch (buffer.at(0))
+    {
+    case IPv4Address:
+        return 1 + 4 + 2;
+    case IPv6Address:
+        return 1 + 16 + 2;
+    case DomainName:
+        if (buffer.size() < 2)
+            return 0;
+        return 1 + 1 + quint8(buffer.at(1)) + 2;
+    default:
+        return -1;
+    }
+}
+
 static bool parseHostAndPort(const QByteArray buffer, quint8 &type, QByteArray &host, quint16 &port)
 {
-    if (buffer.size() < 4)
+    const int length = hostAndPortLength(buffer);
+    if (length <= 0 || buffer.size() < length)
+    {
+        qWarning("Invalid host length");
         return false;
+    }
 
     QDataStream stream(buffer);
     // get host name
     quint8 hostLength;
     stream >> type;
-    stream >> hostLength;
-    if (buffer.size() < hostLength + 4)
-    {
-        qWarning("Invalid host length");
-        return false;
-    }
+    if (type == DomainName)
+        stream >> hostLength;
+    else
+        hostLength = length - 3;
     host.resize(hostLength);
     stream.readRawData(host.data(), hostLength);
     // get port
@@ -109,6 +142,10 @@ QXmppSocksClient::QXmppSocksClient(const QHostAddress &proxyAddress, quint16 pro
     m_proxyPort(proxyPort),
     m_step(ConnectState)
 {
+    m_timer = new QTimer(this);
+    m_timer->setSingleShot(true);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(slotTimeout()));
+
     connect(this, SIGNAL(connected()), this, SLOT(slotConnected()));
     connect(this, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
 }
@@ -117,9 +154,17 @@ void QXmppSocksClient::connectToHost(const QString &hostName, quint16 hostPort)
 {
     m_hostName = hostName;
     m_hostPort = hostPort;
+    m_timer->start(handshakeTimeout);
     QTcpSocket::connectToHost(m_proxyAddress, m_proxyPort);
 }
 
+void QXmppSocksClient::fail(const char *message)
+{
+    qWarning("QXmppSocksClient %s", message);
+    m_timer->stop();
+    close();
+}
+
 void QXmppSocksClient::slotConnected()
 {
     m_step = ConnectState;
@@ -138,20 +183,23 @@ void QXmppSocksClient::slotConnected()
 
 void QXmppSocksClient::slotReadyRead()
 {
+    // replies may arrive in any number of segments, only consume
+    // a reply once it is complete
     if (m_step == ConnectState)
     {
-        m_step++;
-
         // receive connect to server response
-        QByteArray buffer = readAll();
-        if (buffer.size() != 2 || buffer.at(0) != SocksVersion || buffer.at(1) != NoAuthentication)
+        if (bytesAvailable() < 2)
+            return;
+        const QByteArray reply = read(2);
+        if (reply.at(0) != SocksVersion || reply.at(1) != NoAuthentication)
         {
-            qWarning("QXmppSocksClient received an invalid response during handshake");
-            close();
+            fail("received an invalid response during handshake");
             return;
         }
+        m_step = CommandState;
 
         // send CONNECT command
+        QByteArray buffer;
         buffer.resize(3);
         buffer[0] = SocksVersion;
         buffer[1] = ConnectCommand;
@@ -161,46 +209,70 @@ void QXmppSocksClient::slotReadyRead()
             m_hostName.toAscii(),
             m_hostPort));
         write(buffer);
+    }
 
-    } else if (m_step == CommandState) {
-        m_step++;
-
-        // disconnect from signal
-        disconnect(this, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
-
-        // receive CONNECT response
-        QByteArray buffer = readAll();
-        if (buffer.size() < 6 ||
-            buffer.at(0) != SocksVersion ||
-            buffer.at(1) != Succeeded ||
-            buffer.at(2) != 0)
+    if (m_step == CommandState)
+    {
+        // receive CONNECT response, leaving any data which follows
+        // it to the socket's reader
+        if (bytesAvailable() < 5)
+            return;
+        const QByteArray header = peek(5);
+        if (header.at(0) != SocksVersion ||
+            header.at(1) != Succeeded ||
+            header.at(2) != 0)
+        {
+            fail("received an invalid response to CONNECT command");
+            return;
+        }
+        const int length = hostAndPortLength(header.mid(3));
+        if (length < 0)
         {
-            qWarning("QXmppSocksClient received an invalid response to CONNECT command");
-            close();
+            fail("received an unsupported address type");
             return;
         }
+        if (!length || bytesAvailable() < 3 + length)
+            return;
+        const QByteArray reply = read(3 + length);
 
         // parse host
         quint8 hostType;
         QByteArray hostName;
         quint16 hostPort;
-        if (!parseHostAndPort(buffer.mid(3), hostType, hostName, hostPort))
+        if (!parseHostAndPort(reply.mid(3), hostType, hostName, hostPort))
         {
-            qWarning("QXmppSocksClient could not parse type/host/port");
-            close();
+            fail("could not parse type/host/port");
             return;
         }
         // FIXME : what do we do with the resulting name / port?
 
+        // disconnect from signal
+        m_step = ReadyState;
+        m_timer->stop();
+        disconnect(this, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
+
         // notify of connection
         emit ready();
     }
 }
 
+void QXmppSocksClient::slotTimeout()
+{
+    if (m_step == ReadyState)
+        return;
+
+    qWarning("QXmppSocksClient timed out during handshake");
+    abort();
+    setErrorString("SOCKS5 handshake timed out");
+    setSocketError(QAbstractSocket::SocketTimeoutError);
+    emit error(QAbstractSocket::SocketTimeoutError);
+}
+
 bool QXmppSocksClient::waitForReady(int msecs)
 {
     QEventLoop loop;
     connect(this, SIGNAL(disconnected()), &loop, SLOT(quit()));
+    connect(this, SIGNAL(error(QAbstractSocket::SocketError)), &loop, SLOT(quit()));
     connect(this, SIGNAL(ready()), &loop, SLOT(quit()));
     QTimer::singleShot(msecs, &loop, SLOT(quit()));
     loop.exec();
@@ -211,11 +283,22 @@ bool QXmppSocksClient::waitForReady(int msecs)
         return false;
 }
 
+QXmppSocksServer::Handshake::Handshake()
+    : state(ConnectState)
+{
+    started.start();
+}
+
 QXmppSocksServer::QXmppSocksServer(QObject *parent)
     : QObject(parent)
 {
     m_server = new QTcpServer(this);
     connect(m_server, SIGNAL(newConnection()), this, SLOT(slotNewConnection()));
+
+    // the timer only runs while handshakes are in progress
+    m_timer = new QTimer(this);
+    m_timer->setInterval(1000);
+    connect(m_timer, SIGNAL(timeout()), this, SLOT(slotTimeout()));
 }
 
 void QXmppSocksServer::close()
@@ -243,37 +326,76 @@ quint16 QXmppSocksServer::serverPort() const
     return m_server->serverPort();
 }
 
-void QXmppSocksServer::slotNewConnection()
+void QXmppSocksServer::fail(QTcpSocket *socket, const char *message)
 {
-    QTcpSocket *socket = m_server->nextPendingConnection();
-    if (!socket)
+    if (message)
+        qWarning("QXmppSocksServer %s", message);
+    m_handshakes.remove(socket);
+    if (m_handshakes.isEmpty())
+        m_timer->stop();
+    disconnect(socket, 0, this, 0);
+    socket->close();
+    socket->deleteLater();
+}
+
+void QXmppSocksServer::slotDisconnected()
+{
+    QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
+    if (!socket || !m_handshakes.contains(socket))
         return;
 
-    // register socket
-    m_states.insert(socket, ConnectState);
-    connect(socket, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
+    fail(socket, 0);
+}
+
+void QXmppSocksServer::slotNewConnection()
+{
+    while (m_server->hasPendingConnections())
+    {
+        QTcpSocket *socket = m_server->nextPendingConnection();
+        if (!socket)
+            return;
+
+        // refuse connections once too many handshakes are in progress
+        if (m_handshakes.size() >= maxPendingHandshakes)
+        {
+            qWarning("QXmppSocksServer has too many pending handshakes");
+            socket->close();
+            socket->deleteLater();
+            continue;
+        }
+
+        // register socket
+        m_handshakes.insert(socket, Handshake());
+        connect(socket, SIGNAL(disconnected()), this, SLOT(slotDisconnected()));
+        connect(socket, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
+        if (!m_timer->isActive())
+            m_timer->start();
+    }
 }
 
 void QXmppSocksServer::slotReadyRead()
 {
     QTcpSocket *socket = qobject_cast<QTcpSocket*>(sender());
-    if (!socket || !m_states.contains(socket))
+    if (!socket || !m_handshakes.contains(socket))
         return;
 
-    if (m_states.value(socket) == ConnectState)
+    // requests may arrive in any number of segments, only consume
+    // a request once it is complete
+    if (m_handshakes.value(socket).state == ConnectState)
     {
-        m_states.insert(socket, CommandState);
-
         // receive connect to server request
-        QByteArray buffer = socket->readAll();
-        if (buffer.size() < 3 ||
-            buffer.at(0) != SocksVersion ||
-            buffer.at(1) + 2 != buffer.size())
+        if (socket->bytesAvailable() < 2)
+            return;
+        const QByteArray header = socket->peek(2);
+        if (header.at(0) != SocksVersion || !header.at(1))
         {
-            qWarning("QXmppSocksServer received invalid handshake");
-            socket->close();
+            fail(socket, "received invalid handshake");
             return;
         }
+        const int length = 2 + quint8(header.at(1));
+        if (socket->bytesAvailable() < length)
+            return;
+        QByteArray buffer = socket->read(length);
 
         // check authentication method
         bool foundMethod = false;
@@ -287,34 +409,41 @@ void QXmppSocksServer::slotReadyRead()
         }
         if (!foundMethod)
         {
-            qWarning("QXmppSocksServer received bad authentication method");
-            socket->close();
+            fail(socket, "received bad authentication method");
             return;
         }
+        m_handshakes[socket].state = CommandState;
 
         // send connect to server response
         buffer.resize(2);
         buffer[0] = SocksVersion;
         buffer[1] = NoAuthentication;
         socket->write(buffer);
+    }
 
-    } else if (m_states.value(socket) == CommandState) {
-        m_states.insert(socket, ReadyState);
-
-        // disconnect from signals
-        disconnect(socket, SIGNAL(readyRead()), this, SLOT(slotReadyRead()));
-
-        // receive command
-        QByteArray buffer = socket->readAll();
-        if (buffer.size() < 4 ||
-            buffer.at(0) != SocksVersion ||
-            buffer.at(1) != ConnectCommand ||
-            buffer.at(2) != 0x00)
+    if (m_handshakes.value(socket).state == CommandState)
+    {
+        // receive command, leaving any data which follows
+        // it to the socket's reader
+        if (socket->bytesAvailable() < 5)
+            return;
+        const QByteArray header = socket->peek(5);
+        if (header.at(0) != SocksVersion ||
+            header.at(1) != ConnectCommand ||
+            header.at(2) != 0x00)
         {
-            qWarning("QXmppSocksServer received an invalid command");
-            socket->close();
+            fail(socket, "received an invalid command");
             return;
         }
+        const int length = hostAndPortLength(header.mid(3));
+        if (length < 0)
+        {
+            fail(socket, "received an unsupported address type");
+            return;
+        }
+        if (!length || socket->bytesAvailable() < 3 + length)
+            return;
+        QByteArray buffer = socket->read(3 + length);
 
         // parse host
         quint8 hostType;
@@ -322,15 +451,22 @@ void QXmppSocksServer::slotReadyRead()
         quint16 hostPort;
         if (!parseHostAndPort(buffer.mid(3), hostType, hostName, hostPort))
         {
-            qWarning("QXmppSocksServer could not parse type/host/port");
-            socket->close();
+            fail(socket, "could not parse type/host/port");
             return;
         }
 
+        // the handshake is complete, hand over the socket
+        m_handshakes.remove(socket);
+        if (m_handshakes.isEmpty())
+            m_timer->stop();
+        disconnect(socket, 0, this, 0);
+
         // notify of connection
         emit newConnection(socket, hostName, hostPort);
 
-        // send response
+        // send response, unless the connection was refused
+        if (!socket->isOpen())
+            return;
         buffer.resize(3);
         buffer[0] = SocksVersion;
         buffer[1] = Succeeded;
@@ -343,3 +479,12 @@ void QXmppSocksServer::slotReadyRead()
     }
 }
 
+void QXmppSocksServer::slotTimeout()
+{
+    // drop handshakes which are taking too long
+    foreach (QTcpSocket *socket, m_handshakes.keys())
+    {
+        if (m_handshakes.value(socket).started.elapsed() > handshakeTimeout)
+            fail(socket, "timed out during handshake");
+    }
+}
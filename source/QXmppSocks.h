@@ -25,9 +25,12 @@
 #define QXMPPSOCKS_H
 
 #include <QHostAddress>
+#include <QMap>
 #include <QTcpSocket>
+#include <QTime>
 
 class QTcpServer;
+class QTimer;
 
 class QXmppSocksClient : public QTcpSocket
 {
@@ -44,13 +47,17 @@ signals:
 private slots:
     void slotConnected();
     void slotReadyRead();
+    void slotTimeout();
 
 private:
+    void fail(const char *message);
+
     QHostAddress m_proxyAddress;
     quint16 m_proxyPort;
     QString m_hostName;
     quint16 m_hostPort;
     int m_step;
+    QTimer *m_timer;
 };
 
 class QXmppSocksServer : public QObject
@@ -70,12 +77,26 @@ signals:
     void newConnection(QTcpSocket *socket, QString hostName, quint16 port);
 
 private slots:
+    void slotDisconnected();
     void slotNewConnection();
     void slotReadyRead();
+    void slotTimeout();
 
 private:
+    class Handshake
+    {
+    public:
+        Handshake();
+
+        int state;
+        QTime started;
+    };
+
+    void fail(QTcpSocket *socket, const char *message);
+
     QTcpServer *m_server;
-    QMap<QTcpSocket*, int> m_states;
+    QMap<QTcpSocket*, Handshake> m_handshakes;
+    QTimer *m_timer;
 };
 
 #endif
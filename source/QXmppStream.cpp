@@ -36,7 +36,6 @@
 #include "QXmppConstants.h"
 #include "QXmppVCard.h"
 #include "QXmppNonSASLAuth.h"
-#include "QXmppInformationRequestResult.h"
 #include "QXmppIbbIq.h"
 #include "QXmppRpcIq.h"
 #include "QXmppArchiveIq.h"
@@ -62,7 +61,10 @@ static const QByteArray streamRootElementEnd = "</stream:stream>";
 QXmppStream::QXmppStream(QXmppClient* client)
     : QObject(client), m_client(client), m_roster(this),
     m_sessionAvaliable(false),
+    m_rosterVersioning(false),
     m_archiveManager(m_client),
+    m_capabilitiesManager(m_client),
+    m_discoveryManager(m_client),
     m_transferManager(m_client),
     m_vCardManager(m_client),
     m_authStep(0)
@@ -94,6 +96,12 @@ QXmppStream::QXmppStream(QXmppClient* client)
                              SLOT(socketError(QAbstractSocket::SocketError)));
     Q_ASSERT(check);
 
+    check = QObject::connect(this,
+                            SIGNAL(xmppConnected()),
+                            &m_roster,
+                            SLOT(connected()));
+    Q_ASSERT(check);
+
     check = QObject::connect(this,
                             SIGNAL(disconnected()),
                             &m_roster,
@@ -130,6 +138,40 @@ QXmppStream::QXmppStream(QXmppClient* client)
         &m_archiveManager, SLOT(archivePrefIqReceived(const QXmppArchivePrefIq&)));
     Q_ASSERT(check);
 
+    // XEP-0030: Service Discovery
+    check = QObject::connect(this, SIGNAL(presenceReceived(const QXmppPresence&)),
+        &m_discoveryManager, SLOT(presenceReceived(const QXmppPresence&)));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(discoveryIqReceived(const QXmppDiscoveryIq&)),
+        &m_discoveryManager, SLOT(discoveryIqReceived(const QXmppDiscoveryIq&)));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(disconnected()),
+        &m_discoveryManager, SLOT(disconnected()));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(iqReceived(const QXmppIq&)),
+        &m_discoveryManager, SLOT(iqReceived(const QXmppIq&)));
+    Q_ASSERT(check);
+
+    // XEP-0115: Entity Capabilities
+    check = QObject::connect(this, SIGNAL(presenceReceived(const QXmppPresence&)),
+        &m_capabilitiesManager, SLOT(presenceReceived(const QXmppPresence&)));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(discoveryIqReceived(const QXmppDiscoveryIq&)),
+        &m_capabilitiesManager, SLOT(discoveryIqReceived(const QXmppDiscoveryIq&)));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(disconnected()),
+        &m_capabilitiesManager, SLOT(disconnected()));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(iqReceived(const QXmppIq&)),
+        &m_capabilitiesManager, SLOT(iqReceived(const QXmppIq&)));
+    Q_ASSERT(check);
+
     // XEP-0047: In-Band Bytestreams
     check = QObject::connect(this, SIGNAL(iqReceived(const QXmppIq&)),
         &m_transferManager, SLOT(iqReceived(const QXmppIq&)));
@@ -157,6 +199,15 @@ QXmppStream::QXmppStream(QXmppClient* client)
         &m_transferManager, SLOT(streamInitiationIqReceived(const QXmppStreamInitiationIq&)));
     Q_ASSERT(check);
 
+    // stop stalled file transfers and resume interrupted ones
+    check = QObject::connect(this, SIGNAL(xmppConnected()),
+        &m_transferManager, SLOT(connected()));
+    Q_ASSERT(check);
+
+    check = QObject::connect(this, SIGNAL(disconnected()),
+        &m_transferManager, SLOT(disconnected()));
+    Q_ASSERT(check);
+
     // XEP-0199: XMPP Ping
     m_pingTimer = new QTimer();
     check = QObject::connect(m_pingTimer, SIGNAL(timeout()), this, SLOT(pingSend()));
@@ -440,6 +491,10 @@ void QXmppStream::parser(const QByteArray& data)
                 {
                     m_sessionAvaliable = true;
                 }
+
+                // XEP-0237: Roster Versioning
+                m_rosterVersioning = nodeRecv.firstChildElement("ver").
+                                     namespaceURI() == ns_rosterver;
             }
             else if(ns == ns_stream && nodeRecv.tagName() == "error")
             {
@@ -559,6 +614,16 @@ void QXmppStream::parser(const QByteArray& data)
                         processRosterIq(rosterIq);
                         iqPacket = rosterIq;
                     }
+                    else if(id == m_rosterReqId && type == "result")
+                    {
+                        // XEP-0237: an empty result means the roster
+                        // version we sent is still current
+                        QXmppRosterIq rosterIq;
+                        rosterIq.parse(nodeRecv);
+                        rosterIq.setVersion(m_roster.version());
+                        processRosterIq(rosterIq);
+                        iqPacket = rosterIq;
+                    }
                     // extensions
 
                     // XEP-0030: Service Discovery
@@ -567,12 +632,18 @@ void QXmppStream::parser(const QByteArray& data)
                         QXmppDiscoveryIq discoIq;
                         discoIq.parse(nodeRecv);
 
+                        // XEP-0115: queries may be addressed to the node
+                        // we advertise in our capabilities
+                        const QString capabilitiesNode = m_capabilitiesManager.node() +
+                            "#" + m_capabilitiesManager.ver();
                         if (discoIq.type() == QXmppIq::Get &&
                             discoIq.queryType() == QXmppDiscoveryIq::InfoQuery &&
-                            discoIq.queryNode().isEmpty())
+                            (discoIq.queryNode().isEmpty() ||
+                             discoIq.queryNode() == capabilitiesNode))
                         {
                             // respond to info query
-                            QXmppInformationRequestResult qxmppFeatures;
+                            QXmppDiscoveryIq qxmppFeatures = m_discoveryManager.ownInfo();
+                            qxmppFeatures.setQueryNode(discoIq.queryNode());
                             qxmppFeatures.setId(id);
                             qxmppFeatures.setTo(from);
                             qxmppFeatures.setFrom(to);
@@ -974,7 +1045,12 @@ void QXmppStream::sendSessionIQ()
 void QXmppStream::sendInitialPresence()
 {
     if(m_client)
-        sendPacket(m_client->getClientPresence());
+    {
+        // XEP-0115: Entity Capabilities
+        QXmppPresence presence = m_client->getClientPresence();
+        m_capabilitiesManager.addCapabilities(presence);
+        sendPacket(presence);
+    }
 }
 
 void QXmppStream::acceptSubscriptionRequest(const QString& from, bool accept)
@@ -1005,6 +1081,11 @@ void QXmppStream::sendRosterRequest()
     QXmppRosterIq roster;
     roster.setType(QXmppIq::Get);
     roster.setFrom(getConfiguration().jid());
+
+    // XEP-0237: Roster Versioning
+    if(m_rosterVersioning && !m_roster.storePath().isEmpty())
+        roster.setVersion(m_roster.version().isNull() ?
+                          QString("") : m_roster.version());
     m_rosterReqId = roster.id();
     sendPacket(roster);
 }
@@ -1184,6 +1265,16 @@ QXmppArchiveManager& QXmppStream::getArchiveManager()
     return m_archiveManager;
 }
 
+QXmppCapabilitiesManager& QXmppStream::getCapabilitiesManager()
+{
+    return m_capabilitiesManager;
+}
+
+QXmppDiscoveryManager& QXmppStream::getDiscoveryManager()
+{
+    return m_discoveryManager;
+}
+
 QXmppTransferManager& QXmppStream::getTransferManager()
 {
     return m_transferManager;
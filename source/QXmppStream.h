@@ -31,6 +31,8 @@
 #include "QXmppRoster.h"
 #include "QXmppStanza.h"
 #include "QXmppVCardManager.h"
+#include "QXmppCapabilitiesManager.h"
+#include "QXmppDiscoveryManager.h"
 #include "QXmppArchiveManager.h"
 #include "QXmppTransferManager.h"
 
@@ -67,6 +69,8 @@ public:
     void sendSubscriptionRequest(const QString& to);
     void disconnect();
     QXmppArchiveManager& getArchiveManager();
+    QXmppCapabilitiesManager& getCapabilitiesManager();
+    QXmppDiscoveryManager& getDiscoveryManager();
     QXmppRoster& getRoster();
     QXmppTransferManager& getTransferManager();
     QXmppVCardManager& getVCardManager();
@@ -136,6 +140,7 @@ private:
     QByteArray m_dataBuffer;
     QSslSocket m_socket;
     bool m_sessionAvaliable;
+    bool m_rosterVersioning;
     QAbstractSocket::SocketError m_socketError;
     QString m_streamId;
     QString m_nonSASLAuthId;
@@ -146,6 +151,8 @@ private:
 //    m_xmppStanzaError;
 
     QXmppArchiveManager m_archiveManager;
+    QXmppCapabilitiesManager m_capabilitiesManager;
+    QXmppDiscoveryManager m_discoveryManager;
     QXmppTransferManager m_transferManager;
     QXmppVCardManager m_vCardManager;
     int m_authStep;
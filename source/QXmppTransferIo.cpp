@@ -0,0 +1,472 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#include <QCryptographicHash>
+#include <QFile>
+#include <QMetaObject>
+
+#include <zlib.h>
+
+#include "QXmppTransferIo.h"
+
+/// Constructs an I/O buffer for \a device, which compresses or
+/// decompresses the data at the given zlib \a compressionLevel unless
+/// it is 0.
+///
+
+QXmppTransferIo::QXmppTransferIo(QIODevice *device, int blockSize, qint64 bufferSize, int compressionLevel)
+    : m_device(device),
+    m_blockSize(blockSize),
+    m_bufferSize(bufferSize),
+    m_compressionLevel(compressionLevel),
+    m_hash(0),
+    m_inflating(false),
+    m_inflatePending(false),
+    m_zlib(0),
+    m_buffered(0),
+    m_inputSize(0),
+    m_inflated(0),
+    m_atEnd(false),
+    m_busy(false),
+    m_dataError(false),
+    m_error(false),
+    m_scheduled(false),
+    m_stopped(false)
+{
+}
+
+QXmppTransferIo::~QXmppTransferIo()
+{
+    if (m_zlib)
+    {
+        if (m_inflating)
+            inflateEnd(m_zlib);
+        else
+            deflateEnd(m_zlib);
+        delete m_zlib;
+    }
+}
+
+/// Returns true if the whole device has been read ahead.
+///
+
+bool QXmppTransferIo::atEnd() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_atEnd;
+}
+
+/// Returns the number of compressed bytes which are queued but not
+/// yet inflated.
+///
+
+qint64 QXmppTransferIo::bytesToInflate() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_inputSize;
+}
+
+/// Returns the number of uncompressed bytes which are queued but not
+/// yet written to the device.
+///
+
+qint64 QXmppTransferIo::bytesToWrite() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_buffered;
+}
+
+/// Returns true if the compressed data could not be inflated.
+///
+
+bool QXmppTransferIo::hasDataError() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_dataError;
+}
+
+/// Returns true if reading from or writing to the device failed,
+/// or if the compressed data could not be inflated.
+///
+
+bool QXmppTransferIo::hasError() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_error;
+}
+
+/// Returns the number of bytes which can be queued for writing
+/// before the buffer is full.
+///
+/// Compressed data is inflated one block at a time, so until then it
+/// only takes its own size.
+///
+
+qint64 QXmppTransferIo::freeSpace() const
+{
+    QMutexLocker locker(&m_mutex);
+    return qMax(m_bufferSize - m_buffered - m_inputSize, qint64(0));
+}
+
+/// Starts reading ahead from the device.
+///
+
+void QXmppTransferIo::prefetch()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_scheduled && !m_atEnd && !m_error)
+    {
+        m_scheduled = true;
+        QMetaObject::invokeMethod(this, "slotFill", Qt::QueuedConnection);
+    }
+}
+
+/// Takes up to \a maxSize bytes of the data which was read ahead.
+///
+/// If \a dataSize is not null, it receives the number of uncompressed
+/// bytes the data carries. A deflated block only counts once all of it
+/// was taken.
+///
+
+QByteArray QXmppTransferIo::read(qint64 maxSize, qint64 *dataSize)
+{
+    QByteArray data;
+    qint64 taken = 0;
+    {
+        QMutexLocker locker(&m_mutex);
+        while (!m_buffers.isEmpty() && data.size() < maxSize)
+        {
+            QByteArray &buffer = m_buffers.first();
+            const int length = qMin(maxSize - data.size(), qint64(buffer.size()));
+            if (data.isEmpty() && length == buffer.size())
+            {
+                // hand over the whole buffer without copying it
+                data = buffer;
+            } else {
+                data.append(buffer.constData(), length);
+            }
+
+            if (length == buffer.size())
+            {
+                m_buffers.removeFirst();
+                taken += m_compressionLevel ? m_bufferSizes.takeFirst() : length;
+            } else {
+                buffer.remove(0, length);
+                if (!m_compressionLevel)
+                    taken += length;
+            }
+        }
+        m_buffered -= taken;
+        if (dataSize)
+            *dataSize = taken;
+
+        // refill once half the buffer was consumed
+        if (m_buffered > m_bufferSize / 2)
+            return data;
+    }
+    prefetch();
+    return data;
+}
+
+/// Adds the data inflated by the worker thread to \a hash.
+///
+/// This must be called before any data is written, and the caller must
+/// not use the hash until all the data was written or stop() returns.
+///
+
+void QXmppTransferIo::setHash(QCryptographicHash *hash)
+{
+    m_hash = hash;
+}
+
+/// Returns the number of bytes inflated since the last call.
+///
+
+qint64 QXmppTransferIo::takeInflated()
+{
+    QMutexLocker locker(&m_mutex);
+    const qint64 inflated = m_inflated;
+    m_inflated = 0;
+    return inflated;
+}
+
+/// Queues \a data for writing to the device, inflating it first if
+/// the data is compressed.
+///
+/// The data is always accepted, use freeSpace() to stay within the
+/// buffer size.
+///
+
+void QXmppTransferIo::write(const QByteArray &data)
+{
+    QMutexLocker locker(&m_mutex);
+    if (m_compressionLevel)
+    {
+        m_input.append(data);
+        m_inputSize += data.size();
+    } else {
+        m_buffers.append(data);
+        m_buffered += data.size();
+    }
+    if (!m_scheduled && !m_error)
+    {
+        m_scheduled = true;
+        QMetaObject::invokeMethod(this, "slotFlush", Qt::QueuedConnection);
+    }
+}
+
+/// Stops accessing the device, waiting for any pending read or
+/// write to complete.
+///
+
+void QXmppTransferIo::stop()
+{
+    QMutexLocker locker(&m_mutex);
+    m_stopped = true;
+    while (m_busy)
+        m_idle.wait(&m_mutex);
+}
+
+void QXmppTransferIo::slotFill()
+{
+    forever
+    {
+        {
+            QMutexLocker locker(&m_mutex);
+            if (m_stopped || m_buffered >= m_bufferSize)
+            {
+                m_scheduled = false;
+                return;
+            }
+            m_busy = true;
+        }
+
+        QByteArray block;
+        block.resize(m_blockSize);
+        qint64 length = m_device->read(block.data(), m_blockSize);
+        if (length > 0)
+        {
+            block.resize(length);
+            if (m_compressionLevel)
+            {
+                QByteArray deflated;
+                if (deflateBlock(block, &deflated))
+                    block = deflated;
+                else
+                    length = -1;
+            }
+        }
+
+        // a sequential device may simply have no data yet
+        const bool waiting = !length && m_device->isSequential();
+
+        {
+            QMutexLocker locker(&m_mutex);
+            m_busy = false;
+            m_idle.wakeAll();
+            if (length > 0)
+            {
+                m_buffers.append(block);
+                if (m_compressionLevel)
+                    m_bufferSizes.append(length);
+                m_buffered += length;
+            } else {
+                m_atEnd = !waiting;
+                m_error = (length < 0);
+                m_scheduled = false;
+            }
+        }
+        if (!waiting)
+            emit ready();
+
+        if (length <= 0)
+            return;
+    }
+}
+
+void QXmppTransferIo::slotFlush()
+{
+    forever
+    {
+        QByteArray block;
+        QByteArray input;
+        bool inflate;
+        bool last = false;
+        {
+            QMutexLocker locker(&m_mutex);
+            inflate = m_buffers.isEmpty();
+            if (m_stopped || (inflate && m_input.isEmpty() && !m_inflatePending))
+            {
+                m_scheduled = false;
+                return;
+            }
+            if (inflate && !m_input.isEmpty())
+                input = m_input.first();
+            else if (!inflate)
+            {
+                block = m_buffers.first();
+                last = (m_buffers.size() == 1 && m_input.isEmpty());
+            }
+            m_busy = true;
+        }
+
+        // inflate the next block once the previous one was written,
+        // so that at most one block of inflated data is held
+        if (inflate)
+        {
+            int consumed = 0;
+            QByteArray output;
+            const bool ok = inflateBlock(input, &consumed, &output);
+            if (ok && m_hash)
+                m_hash->addData(output);
+
+            {
+                QMutexLocker locker(&m_mutex);
+                m_busy = false;
+                m_idle.wakeAll();
+                if (ok)
+                {
+                    if (consumed == input.size() && consumed)
+                        m_input.removeFirst();
+                    else if (consumed)
+                        m_input.first().remove(0, consumed);
+                    m_inputSize -= consumed;
+                    if (!output.isEmpty())
+                    {
+                        m_buffers.append(output);
+                        m_buffered += output.size();
+                        m_inflated += output.size();
+                    }
+                } else {
+                    m_dataError = true;
+                    m_error = true;
+                    m_scheduled = false;
+                }
+            }
+            emit ready();
+
+            if (!ok)
+                return;
+            continue;
+        }
+
+        // make sure the data reached the file before reporting it
+        // as written, so that closing the file does not block
+        bool ok = (m_device->write(block) == block.size());
+        QFile *file = qobject_cast<QFile*>(m_device);
+        if (ok && last && file)
+            ok = file->flush();
+
+        {
+            QMutexLocker locker(&m_mutex);
+            m_busy = false;
+            m_idle.wakeAll();
+            if (ok)
+            {
+                m_buffers.removeFirst();
+                m_buffered -= block.size();
+            } else {
+                m_error = true;
+                m_scheduled = false;
+            }
+        }
+        emit ready();
+
+        if (!ok)
+            return;
+    }
+}
+
+/// Deflates a block of data read from the device, flushing the zlib
+/// stream so that the receiver can inflate the whole block.
+
+bool QXmppTransferIo::deflateBlock(const QByteArray &data, QByteArray *output)
+{
+    if (!m_zlib)
+    {
+        m_zlib = new z_stream;
+        m_zlib->zalloc = Z_NULL;
+        m_zlib->zfree = Z_NULL;
+        m_zlib->opaque = Z_NULL;
+        if (deflateInit(m_zlib, m_compressionLevel) != Z_OK)
+        {
+            delete m_zlib;
+            m_zlib = 0;
+            return false;
+        }
+    }
+
+    m_zlib->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    m_zlib->avail_in = data.size();
+    output->clear();
+    do
+    {
+        const int offset = output->size();
+        output->resize(offset + deflateBound(m_zlib, m_zlib->avail_in) + 16);
+        m_zlib->next_out = reinterpret_cast<Bytef*>(output->data() + offset);
+        m_zlib->avail_out = output->size() - offset;
+        if (deflate(m_zlib, Z_SYNC_FLUSH) == Z_STREAM_ERROR)
+            return false;
+        output->resize(output->size() - m_zlib->avail_out);
+    } while (!m_zlib->avail_out);
+    return true;
+}
+
+/// Inflates at most one block from the received data, setting
+/// \a consumed to the number of bytes of \a data which were used.
+///
+/// Returns false if the data is not a valid zlib stream.
+
+bool QXmppTransferIo::inflateBlock(const QByteArray &data, int *consumed, QByteArray *output)
+{
+    if (!m_zlib)
+    {
+        m_zlib = new z_stream;
+        m_zlib->zalloc = Z_NULL;
+        m_zlib->zfree = Z_NULL;
+        m_zlib->opaque = Z_NULL;
+        m_zlib->next_in = Z_NULL;
+        m_zlib->avail_in = 0;
+        if (inflateInit(m_zlib) != Z_OK)
+        {
+            delete m_zlib;
+            m_zlib = 0;
+            return false;
+        }
+        m_inflating = true;
+    }
+
+    m_zlib->next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.constData()));
+    m_zlib->avail_in = data.size();
+    output->resize(m_blockSize);
+    m_zlib->next_out = reinterpret_cast<Bytef*>(output->data());
+    m_zlib->avail_out = output->size();
+    const int result = inflate(m_zlib, Z_SYNC_FLUSH);
+    *consumed = data.size() - m_zlib->avail_in;
+    output->resize(output->size() - m_zlib->avail_out);
+
+    // a full block may leave more output inside the zlib stream
+    m_inflatePending = !m_zlib->avail_out;
+
+    // no progress is only expected when looking for such output
+    return result == Z_OK ||
+           (result == Z_BUF_ERROR && data.isEmpty()) ||
+           (result == Z_STREAM_END && !m_zlib->avail_in);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2008-2010 QXmpp Developers
+ *
+ * Source:
+ *	http://code.google.com/p/qxmpp
+ *
+ * This file is a part of QXmpp library.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ */
+
+#ifndef QXMPPTRANSFERIO_H
+#define QXMPPTRANSFERIO_H
+
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QWaitCondition>
+
+class QCryptographicHash;
+class QIODevice;
+struct z_stream_s;
+
+/// \brief The QXmppTransferIo class performs a transfer job's disk I/O
+/// on a worker thread.
+///
+/// Outgoing data is read ahead from the device and incoming data is
+/// queued for writing, in both cases up to a bounded number of bytes.
+/// The read(), write() and stop() methods are called from the job's
+/// thread, while the device is only accessed from the worker thread
+/// until stop() returns.
+///
+/// For compressed bytestreams, the worker also holds the zlib stream:
+/// outgoing data is deflated as it is read ahead and incoming data is
+/// inflated as it is written out. The buffer size always counts
+/// uncompressed bytes.
+///
+
+class QXmppTransferIo : public QObject
+{
+    Q_OBJECT
+
+public:
+    QXmppTransferIo(QIODevice *device, int blockSize, qint64 bufferSize, int compressionLevel = 0);
+    ~QXmppTransferIo();
+
+    bool atEnd() const;
+    qint64 bytesToInflate() const;
+    qint64 bytesToWrite() const;
+    bool hasDataError() const;
+    bool hasError() const;
+    qint64 freeSpace() const;
+
+    void prefetch();
+    QByteArray read(qint64 maxSize, qint64 *dataSize = 0);
+    void setHash(QCryptographicHash *hash);
+    qint64 takeInflated();
+    void write(const QByteArray &data);
+    void stop();
+
+signals:
+    /// This signal is emitted when data was read ahead or written out,
+    /// or when an error occured.
+    void ready();
+
+private slots:
+    void slotFill();
+    void slotFlush();
+
+private:
+    bool deflateBlock(const QByteArray &data, QByteArray *output);
+    bool inflateBlock(const QByteArray &data, int *consumed, QByteArray *output);
+
+    QIODevice *m_device;
+    int m_blockSize;
+    qint64 m_bufferSize;
+    int m_compressionLevel;
+
+    // only used by the worker thread
+    QCryptographicHash *m_hash;
+    bool m_inflating;
+    bool m_inflatePending;
+    z_stream_s *m_zlib;
+
+    // shared between the threads
+    mutable QMutex m_mutex;
+    QWaitCondition m_idle;
+    QList<QByteArray> m_buffers;
+    // uncompressed size of each buffer, for deflated data
+    QList<qint64> m_bufferSizes;
+    qint64 m_buffered;
+    // compressed data which was not inflated yet
+    QList<QByteArray> m_input;
+    qint64 m_inputSize;
+    qint64 m_inflated;
+    bool m_atEnd;
+    bool m_busy;
+    bool m_dataError;
+    bool m_error;
+    bool m_scheduled;
+    bool m_stopped;
+};
+
+#endif
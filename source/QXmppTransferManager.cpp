@@ -21,10 +21,15 @@
  *
  */
 
+#include <cstring>
+
 #include <QDomElement>
 #include <QFile>
 #include <QFileInfo>
 #include <QNetworkInterface>
+#include <QSet>
+#include <QSettings>
+#include <QThread>
 #include <QTimer>
 
 #include "QXmppByteStreamIq.h"
@@ -34,12 +39,43 @@
 #include "QXmppLogger.h"
 #include "QXmppSocks.h"
 #include "QXmppStreamInitiationIq.h"
+#include "QXmppTransferIo.h"
 #include "QXmppTransferManager.h"
 #include "QXmppUtils.h"
 
 // time to try to connect to a SOCKS host (7 seconds)
 const int socksTimeout = 7000;
 
+// delay before trying the next SOCKS host in parallel (250 milliseconds)
+const int socksStagger = 250;
+
+// time for which the local stream hosts are cached (60 seconds)
+const int streamHostsTtl = 60000;
+
+// interval at which bandwidth allowances are refilled (100 milliseconds)
+const int schedulerInterval = 100;
+
+// smallest range carried by a parallel bytestream (1 MiB)
+const qint64 parallelStreamSize = 1024 * 1024;
+
+// data hashed per event loop iteration for parallel bytestreams (1 MiB)
+const qint64 hashStepSize = 1024 * 1024;
+
+// data read ahead or queued for writing by the I/O thread, per job (256 KiB)
+const qint64 ioBufferSize = 256 * 1024;
+
+// interval over which the current transfer speed is sampled (500 milliseconds)
+const int speedSampleInterval = 500;
+
+// time for which a failed SOCKS5 connection to a peer is remembered (10 minutes)
+const int peerFailureTtl = 600000;
+
+// interval at which the resume point of a job is journaled (5 seconds)
+const int journalInterval = 5000;
+
+// smallest transfer used to measure a peer's throughput (256 KiB)
+const qint64 peerSpeedMinimum = 256 * 1024;
+
 static QString streamHash(const QString &sid, const QString &initiatorJid, const QString &targetJid)
 {
     QCryptographicHash hash(QCryptographicHash::Sha1);
@@ -48,6 +84,33 @@ static QString streamHash(const QString &sid, const QString &initiatorJid, const
     return hash.result().toHex();
 }
 
+static QString journalKey(const QXmppTransferJob *job)
+{
+    const QString str = QString::number(job->direction()) + job->jid() + job->sid();
+    return QCryptographicHash::hash(str.toUtf8(), QCryptographicHash::Sha1).toHex();
+}
+
+// whether the scheduler can limit the rate of a job, incoming in-band
+// data arrives at whatever rate the sender chooses
+static bool isThrottled(const QXmppTransferJob *job)
+{
+    return job->method() == QXmppTransferJob::SocksMethod ||
+           (job->method() == QXmppTransferJob::InBandMethod &&
+            job->direction() == QXmppTransferJob::OutgoingDirection);
+}
+
+static QList<QXmppByteStreamIq::StreamHost> preferStreamHost(const QList<QXmppByteStreamIq::StreamHost> &streamHosts, const QString &jid)
+{
+    QList<QXmppByteStreamIq::StreamHost> sorted;
+    foreach (const QXmppByteStreamIq::StreamHost &streamHost, streamHosts)
+        if (streamHost.jid() == jid)
+            sorted.append(streamHost);
+    foreach (const QXmppByteStreamIq::StreamHost &streamHost, streamHosts)
+        if (streamHost.jid() != jid)
+            sorted.append(streamHost);
+    return sorted;
+}
+
 QXmppTransferFileInfo::QXmppTransferFileInfo()
     : m_size(0)
 {
@@ -109,10 +172,40 @@ QXmppTransferJob::QXmppTransferJob(const QString &jid, QXmppTransferJob::Directi
     m_hash(QCryptographicHash::Md5),
     m_iodevice(0),
     m_jid(jid),
+    m_peer(jid),
     m_method(NoMethod),
+    m_priority(NormalPriority),
     m_state(OfferState),
+    m_allowance(-1),
+    m_allowanceRefill(-1),
+    m_allowanceFraction(0),
+    m_rangeSupported(false),
+    m_rangeOffset(0),
     m_ibbSequence(0),
-    m_socksSocket(0)
+    m_ibbStalled(false),
+    m_ibbFallback(false),
+    m_socksSocket(0),
+    m_socksTimer(0),
+    m_fileMap(0),
+    m_fileMapSize(0),
+    m_fileOriginalSize(0),
+    m_parentJob(0),
+    m_streamCount(1),
+    m_streamEnd(0),
+    m_hashEnd(0),
+    m_hashScheduled(false),
+    m_io(0),
+    m_ioFlushing(false),
+    m_ioThread(0),
+    m_compressionLevel(0),
+    m_wireDone(0),
+    m_progressInterval(0),
+    m_progressStep(0),
+    m_progressReported(0),
+    m_transferDuration(-1),
+    m_transferStart(0),
+    m_sampleDone(0),
+    m_speed(0)
 {
 }
 
@@ -128,18 +221,55 @@ void QXmppTransferJob::abort()
 ///
 
 void QXmppTransferJob::accept(QIODevice *iodevice)
+{
+    accept(iodevice, 0);
+}
+
+/// Call this method if you wish to accept an incoming transfer job and
+/// resume it from the given \a offset, for instance after a previous
+/// attempt was interrupted (XEP-0096 ranged transfer).
+///
+/// The output device must already hold the first \a offset bytes of the
+/// file and must be open for both reading and writing (QIODevice::ReadWrite
+/// does not truncate a QFile). The existing prefix is fed into the file
+/// hash, so a prefix which does not match the offered file is reported
+/// as a QXmppTransferJob::FileCorruptError once the transfer completes.
+///
+/// If the remote party did not offer ranged transfers or the prefix cannot
+/// be read back, the whole file is requested instead.
+///
+/// If the output device is a QFile opened with QIODevice::ReadWrite and the
+/// file size is known, the file is grown to its final size and the received
+/// data is copied straight into a memory mapping of the file. The file is
+/// truncated back to the received data if the transfer fails.
+
+void QXmppTransferJob::accept(QIODevice *iodevice, qint64 offset)
 {
     if (m_direction == IncomingDirection && m_state == OfferState && !m_iodevice)
     {
         m_iodevice = iodevice;
+        if (offset > 0 && m_rangeSupported && (!fileSize() || offset < fileSize()))
+            seekOffset(offset);
         setState(QXmppTransferJob::StartState);
     }
 }
 
 void QXmppTransferJob::checkData()
 {
-    if ((m_fileInfo.size() && m_done != m_fileInfo.size()) ||
-        (!m_fileInfo.hash().isEmpty() && m_hash.result() != m_fileInfo.hash()))
+    // wait for the queued data to reach the disk, compressed data is
+    // checked first as it moves on to the write queue once inflated
+    if (m_io && (m_io->bytesToInflate() || m_io->bytesToWrite()))
+    {
+        m_ioFlushing = true;
+        return;
+    }
+    if (m_io)
+        m_done += m_io->takeInflated();
+
+    // with parallel streams, the hash of the whole file is
+    // checked once all the streams are complete
+    if ((streamEnd() && m_done != streamEnd()) ||
+        (m_streams.isEmpty() && !m_fileInfo.hash().isEmpty() && m_hash.result() != m_fileInfo.hash()))
         terminate(QXmppTransferJob::FileCorruptError);
     else
         terminate(QXmppTransferJob::NoError);
@@ -215,6 +345,25 @@ QXmppTransferJob::Method QXmppTransferJob::method() const
     return m_method;
 }
 
+/// Returns the job's priority.
+///
+
+QXmppTransferJob::Priority QXmppTransferJob::priority() const
+{
+    return m_priority;
+}
+
+/// Sets the job's priority.
+///
+/// Queued jobs with a higher priority are started first, and when the
+/// transfer manager's bandwidth is limited, running jobs share it in
+/// proportion to their priority.
+
+void QXmppTransferJob::setPriority(QXmppTransferJob::Priority priority)
+{
+    m_priority = priority;
+}
+
 QString QXmppTransferJob::sid() const
 {
     return m_sid;
@@ -225,15 +374,448 @@ QXmppTransferJob::State QXmppTransferJob::state() const
     return m_state;
 }
 
+/// Returns true if the sending party supports ranged transfers, i.e.
+/// an incoming job can be resumed using accept(QIODevice*, qint64).
+///
+
+bool QXmppTransferJob::isRangeSupported() const
+{
+    return m_rangeSupported;
+}
+
+/// Returns the offset from which the file data is being transferred,
+/// or 0 if the whole file is transferred.
+///
+
+qint64 QXmppTransferJob::rangeOffset() const
+{
+    return m_rangeOffset;
+}
+
+/// Returns true if the file data is compressed on the wire.
+///
+
+bool QXmppTransferJob::isCompressed() const
+{
+    return m_compressionLevel != 0;
+}
+
+/// Returns the number of bytes which were sent or received over the
+/// bytestream. Unless the job is compressed, this is the same as the
+/// number of file bytes transferred.
+///
+
+qint64 QXmppTransferJob::wireBytes() const
+{
+    qint64 bytes = m_compressionLevel ? m_wireDone : m_done - m_rangeOffset;
+    foreach (QXmppTransferJob *stream, m_streams)
+        bytes += stream->wireBytes();
+    return bytes;
+}
+
+/// Returns the minimum interval in milliseconds between two progress()
+/// signals, or 0 if the signal is not time-throttled.
+///
+
+int QXmppTransferJob::progressInterval() const
+{
+    return m_progressInterval;
+}
+
+/// Sets the minimum interval in milliseconds between two progress()
+/// signals. Set it to 0 to disable time-based throttling.
+///
+/// \param msecs as an int
+///
+
+void QXmppTransferJob::setProgressInterval(int msecs)
+{
+    m_progressInterval = qMax(0, msecs);
+}
+
+/// Returns the minimum number of bytes transferred between two progress()
+/// signals, or 0 if the signal is not size-throttled.
+///
+
+qint64 QXmppTransferJob::progressStep() const
+{
+    return m_progressStep;
+}
+
+/// Sets the minimum number of bytes transferred between two progress()
+/// signals. Set it to 0 to disable size-based throttling.
+///
+/// \param bytes as a qint64
+///
+
+void QXmppTransferJob::setProgressStep(qint64 bytes)
+{
+    m_progressStep = qMax(qint64(0), bytes);
+}
+
+/// Returns the average speed of the transfer in bytes per second,
+/// measured since the job entered the TransferState.
+///
+
+qint64 QXmppTransferJob::averageSpeed() const
+{
+    if (m_transferTime.isNull())
+        return 0;
+
+    const int elapsed = (m_state == FinishedState) ? m_transferDuration : m_transferTime.elapsed();
+    if (elapsed <= 0)
+        return 0;
+    return (doneBytes() - m_transferStart) * 1000 / elapsed;
+}
+
+/// Returns the estimated number of seconds until the transfer completes,
+/// or -1 if it cannot be estimated.
+///
+
+int QXmppTransferJob::remainingTime() const
+{
+    if (m_state == FinishedState)
+        return 0;
+
+    const qint64 rate = speed();
+    if (!fileSize() || rate <= 0)
+        return -1;
+    return qMax(qint64(0), fileSize() - doneBytes()) / rate;
+}
+
+/// Returns the current speed of the transfer in bytes per second.
+///
+
+qint64 QXmppTransferJob::speed() const
+{
+    if (m_state != TransferState || m_sampleTime.isNull())
+        return 0;
+
+    // if no data arrived for a while, the last sample is stale
+    const int elapsed = m_sampleTime.elapsed();
+    if (elapsed >= 2 * speedSampleInterval)
+        return (doneBytes() - m_sampleDone) * 1000 / elapsed;
+    return m_speed ? m_speed : averageSpeed();
+}
+
+qint64 QXmppTransferJob::doneBytes() const
+{
+    qint64 done = m_done;
+    foreach (QXmppTransferJob *stream, m_streams)
+        done += stream->m_done - stream->m_rangeOffset;
+    return done;
+}
+
+bool QXmppTransferJob::seekOffset(qint64 offset)
+{
+    if (!m_iodevice || m_iodevice->isSequential())
+        return false;
+
+    if (m_direction == QXmppTransferJob::IncomingDirection)
+    {
+        // hash the prefix we already hold, leaving the device
+        // positioned at the end of the prefix
+        if (!m_iodevice->isReadable() || !m_iodevice->seek(0))
+            return false;
+        qint64 remaining = offset;
+        while (remaining > 0)
+        {
+            const QByteArray buffer = m_iodevice->read(qMin(remaining, qint64(m_blockSize)));
+            if (buffer.isEmpty())
+            {
+                m_hash.reset();
+                m_iodevice->seek(0);
+                return false;
+            }
+            m_hash.addData(buffer);
+            remaining -= buffer.size();
+        }
+    } else if (!m_iodevice->seek(offset)) {
+        return false;
+    }
+
+    m_rangeOffset = offset;
+    m_done = offset;
+    return true;
+}
+
+/// Returns true if the job cannot move data because the socket or the
+/// disk is not keeping up, as opposed to waiting for the remote party.
+
+bool QXmppTransferJob::isBlocked() const
+{
+    if (!m_socksSocket)
+        return false;
+    if (m_direction == QXmppTransferJob::OutgoingDirection)
+        return m_socksSocket->bytesToWrite() > 2 * m_blockSize ||
+               (m_io && !m_io->atEnd() && m_io->freeSpace() >= ioBufferSize);
+    return m_io && m_io->freeSpace() <= 0;
+}
+
+bool QXmppTransferJob::mapFile()
+{
+    if (m_fileMap)
+        return true;
+
+    // parallel streams share their parent's mapping
+    if (m_parentJob)
+    {
+        if (!m_parentJob->mapFile())
+            return false;
+        m_fileMap = m_parentJob->m_fileMap;
+        m_fileMapSize = m_parentJob->m_fileMapSize;
+        return true;
+    }
+
+    QFile *file = qobject_cast<QFile*>(m_iodevice);
+    if (!file || !file->isOpen() || file->isSequential())
+        return false;
+
+    if (m_direction == QXmppTransferJob::IncomingDirection)
+    {
+        // mapping a file for writing requires it to be readable too
+        const qint64 size = fileSize();
+        if (size <= 0 || file->openMode() != QIODevice::ReadWrite)
+            return false;
+
+        // preallocate the file
+        m_fileOriginalSize = file->size();
+        if (m_fileOriginalSize < size && !file->resize(size))
+            return false;
+        m_fileMap = file->map(0, size);
+        if (!m_fileMap)
+        {
+            if (m_fileOriginalSize < size)
+                file->resize(m_fileOriginalSize);
+            return false;
+        }
+        m_fileMapSize = size;
+    } else {
+        const qint64 size = file->size();
+        if (size <= 0)
+            return false;
+        m_fileMap = file->map(0, size);
+        if (!m_fileMap)
+            return false;
+        m_fileMapSize = size;
+    }
+    return true;
+}
+
+/// Returns the end of the mapped region this job's stream may access.
+
+qint64 QXmppTransferJob::mappedEnd() const
+{
+    return m_streamEnd > 0 ? qMin(m_streamEnd, m_fileMapSize) : m_fileMapSize;
+}
+
+/// Reads up to \a maxSize bytes to send, setting \a dataSize to the
+/// number of file bytes they carry.
+
+QByteArray QXmppTransferJob::readData(qint64 maxSize, qint64 *dataSize)
+{
+    if (m_io)
+        return m_io->read(maxSize, dataSize);
+
+    QByteArray data;
+    if (!m_fileMap)
+    {
+        data = m_iodevice->read(maxSize);
+    } else {
+        // the mapping outlives the returned array, so no copy is needed
+        const qint64 length = qMax(qMin(maxSize, mappedEnd() - m_done), qint64(0));
+        data = QByteArray::fromRawData(reinterpret_cast<const char*>(m_fileMap) + m_done, length);
+    }
+    *dataSize = data.size();
+    return data;
+}
+
+void QXmppTransferJob::reportProgress()
+{
+    if (m_parentJob)
+    {
+        m_parentJob->reportProgress();
+        return;
+    }
+
+    const qint64 done = doneBytes();
+
+    // sample the current speed, smoothing out bursts
+    if (!m_sampleTime.isNull())
+    {
+        const int elapsed = m_sampleTime.elapsed();
+        if (elapsed >= speedSampleInterval)
+        {
+            const qint64 rate = (done - m_sampleDone) * 1000 / elapsed;
+            m_speed = m_speed ? (m_speed + rate) / 2 : rate;
+            m_sampleDone = done;
+            m_sampleTime.start();
+        }
+    }
+
+    // throttle the signal, except for the final report
+    if (!fileSize() || done < fileSize())
+    {
+        if (m_progressInterval > 0 && !m_progressTime.isNull() &&
+            m_progressTime.elapsed() < m_progressInterval)
+            return;
+        if (m_progressStep > 0 && done - m_progressReported < m_progressStep)
+            return;
+    }
+    else if (done == m_progressReported)
+        return;
+
+    m_progressReported = done;
+    m_progressTime.start();
+    emit progress(done, fileSize());
+}
+
 void QXmppTransferJob::setState(QXmppTransferJob::State state)
 {
     if (m_state != state)
     {
         m_state = state;
+
+        // parallel streams can only work on a mapped file
+        if (m_state == QXmppTransferJob::TransferState && !startIo() && !mapFile() &&
+            (m_parentJob || !m_streams.isEmpty()))
+        {
+            terminate(QXmppTransferJob::FileAccessError);
+            return;
+        }
+
+        // start measuring the speed
+        if (m_state == QXmppTransferJob::TransferState && !m_parentJob)
+        {
+            m_transferStart = m_sampleDone = m_progressReported = doneBytes();
+            m_transferTime.start();
+            m_sampleTime.start();
+        }
         emit stateChanged(m_state);
     }
 }
 
+/// Hands the device over to the I/O thread, if there is one.
+///
+/// This is only done for SOCKS5 bytestreams to or from a QFile, as the
+/// socket can then be throttled while the disk catches up. Parallel
+/// streams keep using the memory mapping they share.
+///
+/// Compressed bytestreams always go through a QXmppTransferIo, which
+/// holds the zlib stream, but it only runs on the I/O thread for a QFile.
+
+bool QXmppTransferJob::startIo()
+{
+    if (m_io || !m_iodevice)
+        return false;
+    const bool threaded = m_ioThread && !m_parentJob && m_streams.isEmpty() &&
+                          qobject_cast<QFile*>(m_iodevice);
+    if (!m_compressionLevel && (!threaded || m_method != QXmppTransferJob::SocksMethod))
+        return false;
+
+    m_io = new QXmppTransferIo(m_iodevice, m_blockSize, ioBufferSize, m_compressionLevel);
+    if (m_compressionLevel && m_direction == QXmppTransferJob::IncomingDirection &&
+        !m_fileInfo.hash().isEmpty())
+        m_io->setHash(&m_hash);
+    if (threaded)
+        m_io->moveToThread(m_ioThread);
+    connect(m_io, SIGNAL(ready()), this, SLOT(ioReady()));
+    if (m_direction == QXmppTransferJob::OutgoingDirection)
+        m_io->prefetch();
+    return true;
+}
+
+void QXmppTransferJob::ioReady()
+{
+    if (m_state != QXmppTransferJob::TransferState || !m_io)
+        return;
+
+    if (m_io->hasDataError())
+        terminate(QXmppTransferJob::ProtocolError);
+    else if (m_io->hasError())
+        terminate(QXmppTransferJob::FileAccessError);
+    else if (m_direction == QXmppTransferJob::OutgoingDirection)
+    {
+        // in-band bytestreams are resumed by the manager
+        if (m_socksSocket)
+            sendData();
+    } else {
+        // account for the data which was inflated meanwhile
+        const qint64 inflated = m_io->takeInflated();
+        if (inflated)
+        {
+            m_done += inflated;
+            reportProgress();
+        }
+
+        if (m_ioFlushing || (streamEnd() && m_done >= streamEnd()))
+            checkData();
+        else if (m_socksSocket)
+            receiveData();
+    }
+}
+
+/// Returns the end of the data carried by this job's own stream.
+///
+/// This is the file size, unless the file is split across parallel
+/// streams.
+
+qint64 QXmppTransferJob::streamEnd() const
+{
+    return m_streamEnd > 0 ? m_streamEnd : m_fileInfo.size();
+}
+
+void QXmppTransferJob::streamFinished(QXmppTransferJob *stream)
+{
+    if (m_state == QXmppTransferJob::FinishedState)
+        return;
+
+    if (stream->m_error != QXmppTransferJob::NoError)
+        terminate(stream->m_error);
+    else if (m_done >= streamEnd())
+        terminate(QXmppTransferJob::NoError);
+}
+
+/// Adds the ranges received by the parallel streams to the hash of the
+/// file, in order and at most hashStepSize bytes at a time so that the
+/// other transfers keep running.
+
+void QXmppTransferJob::hashStreams()
+{
+    m_hashScheduled = false;
+    if (m_state == QXmppTransferJob::FinishedState || !m_fileMap)
+        return;
+
+    // the job's own range is hashed as it is written
+    if (m_done < streamEnd())
+        return;
+
+    const char *data = reinterpret_cast<const char*>(m_fileMap);
+    qint64 budget = hashStepSize;
+    foreach (QXmppTransferJob *stream, m_streams)
+    {
+        if (stream->m_streamEnd <= m_hashEnd)
+            continue;
+        if (stream->m_state != QXmppTransferJob::FinishedState || stream->m_error != QXmppTransferJob::NoError)
+            return;
+
+        const qint64 length = qMin(stream->m_streamEnd - m_hashEnd, budget);
+        m_hash.addData(data + m_hashEnd, length);
+        m_hashEnd += length;
+        budget -= length;
+        if (!budget)
+            break;
+    }
+
+    if (m_hashEnd >= fileSize())
+        terminate(QXmppTransferJob::NoError);
+    else if (!budget)
+    {
+        m_hashScheduled = true;
+        QTimer::singleShot(0, this, SLOT(hashStreams()));
+    }
+}
+
 void QXmppTransferJob::disconnected()
 {
     if (m_state == QXmppTransferJob::FinishedState)
@@ -242,9 +824,12 @@ void QXmppTransferJob::disconnected()
     // terminate transfer
     if (m_direction == QXmppTransferJob::IncomingDirection)
     {
+        // flush any data which was held back by rate limiting
+        if (m_socksSocket && m_socksSocket->bytesAvailable())
+            writeData(m_socksSocket->readAll());
         checkData();
     } else {
-        if (fileSize() && m_done != fileSize())
+        if (streamEnd() && m_done != streamEnd())
             terminate(QXmppTransferJob::ProtocolError);
         else
             terminate(QXmppTransferJob::NoError);
@@ -259,10 +844,39 @@ void QXmppTransferJob::receiveData()
     // receive data block
     if (m_direction == QXmppTransferJob::IncomingDirection)
     {
-        writeData(m_socksSocket->readAll());
+        qint64 length = m_socksSocket->bytesAvailable();
+        if (m_allowance >= 0)
+            length = qMin(length, m_allowance);
+
+        // leave the data in the socket while the disk is catching up,
+        // the I/O thread resumes the job once it has written some out
+        if (m_io)
+            length = qMin(length, m_io->freeSpace());
+        if (length <= 0)
+            return;
+
+        if (m_fileMap && m_done + length <= mappedEnd())
+        {
+            // read straight into the mapped file
+            char *data = reinterpret_cast<char*>(m_fileMap) + m_done;
+            length = m_socksSocket->read(data, length);
+            if (length > 0)
+            {
+                m_done += length;
+                if (!m_fileInfo.hash().isEmpty())
+                    m_hash.addData(data, length);
+                reportProgress();
+            }
+        } else {
+            const QByteArray data = m_socksSocket->read(length);
+            writeData(data);
+            length = data.size();
+        }
+        if (m_allowance >= 0 && length > 0)
+            m_allowance -= length;
 
         // if we have received all the data, stop here
-        if (fileSize() && m_done >= fileSize())
+        if (streamEnd() && m_done >= streamEnd())
             checkData();
     }
 }
@@ -277,32 +891,74 @@ void QXmppTransferJob::sendData()
         return;
 
     // check whether we have written the whole file
-    if (m_fileInfo.size() && m_done >= m_fileInfo.size())
+    if (streamEnd() && m_done >= streamEnd())
     {
         if (!m_socksSocket->bytesToWrite())
             terminate(QXmppTransferJob::NoError);
         return;
     }
 
-    char *buffer = new char[m_blockSize];
-    qint64 length = m_iodevice->read(buffer, m_blockSize);
-    if (length < 0)
+    // respect the bandwidth allowance
+    qint64 blockSize = m_blockSize;
+    if (m_allowance >= 0)
+        blockSize = qMin(blockSize, m_allowance);
+    if (!blockSize)
+        return;
+
+    qint64 length;
+    qint64 wireLength = 0;
+    if (m_fileMap)
     {
+        // write straight from the mapped file
+        length = qMin(blockSize, mappedEnd() - m_done);
+        if (length > 0)
+            m_socksSocket->write(reinterpret_cast<const char*>(m_fileMap) + m_done, length);
+    }
+    else if (m_io)
+    {
+        // take the data which the I/O thread read ahead, and deflated
+        // if the bytestream is compressed
+        const QByteArray block = m_io->read(blockSize, &length);
+        wireLength = block.size();
+        if (wireLength > 0)
+            m_socksSocket->write(block);
+    } else {
+        char *buffer = new char[blockSize];
+        length = m_iodevice->read(buffer, blockSize);
+        if (length > 0)
+            m_socksSocket->write(buffer, length);
         delete [] buffer;
+    }
+    if (length < 0)
+    {
         terminate(QXmppTransferJob::FileAccessError);
         return;
     }
-    if (length > 0)
+
+    // the allowance is spent in bytes on the wire
+    if (m_compressionLevel)
+        m_wireDone += wireLength;
+    else
+        wireLength = length;
+    if (wireLength > 0)
     {
-        m_socksSocket->write(buffer, length);
-        delete [] buffer;
         m_done += length;
-        emit progress(m_done, fileSize());
+        if (m_allowance >= 0)
+            m_allowance -= wireLength;
+        reportProgress();
     }
 }
 
 void QXmppTransferJob::slotTerminated()
 {
+    // report any progress which was held back by throttling
+    const qint64 done = doneBytes();
+    if (!m_parentJob && m_error == NoError && done != m_progressReported)
+    {
+        m_progressReported = done;
+        emit progress(done, fileSize());
+    }
+
     emit stateChanged(m_state);
     if (m_error != NoError)
         emit error(m_error);
@@ -314,10 +970,71 @@ void QXmppTransferJob::terminate(QXmppTransferJob::Error cause)
     if (m_state == FinishedState)
         return;
 
-    // change state
-    m_error = cause;
-    m_state = FinishedState;
-
+    if (cause == NoError && !m_streams.isEmpty())
+    {
+        // the ranges were received out of order, so the ranges of the
+        // streams are hashed in the background once they are complete
+        const bool checkHash = m_direction == IncomingDirection &&
+            !m_fileInfo.hash().isEmpty() && m_fileMap;
+        if (checkHash && m_hashEnd < fileSize())
+        {
+            if (!m_hashScheduled)
+            {
+                m_hashScheduled = true;
+                QTimer::singleShot(0, this, SLOT(hashStreams()));
+            }
+            return;
+        }
+
+        // wait for the parallel streams to complete
+        foreach (QXmppTransferJob *stream, m_streams)
+            if (stream->m_state != FinishedState)
+                return;
+
+        if (checkHash && m_hash.result() != m_fileInfo.hash())
+            cause = FileCorruptError;
+    }
+
+    // change state
+    m_error = cause;
+    m_state = FinishedState;
+    if (!m_transferTime.isNull())
+        m_transferDuration = m_transferTime.elapsed();
+
+    // stop the parallel streams
+    foreach (QXmppTransferJob *stream, m_streams)
+        stream->terminate(AbortError);
+
+    // take the device back from the I/O thread
+    if (m_io)
+    {
+        m_io->stop();
+        m_io->deleteLater();
+        m_io = 0;
+    }
+
+    // release the file mapping, dropping any preallocated space which
+    // was not filled but none of the data the file held before
+    if (m_fileMap && m_parentJob)
+    {
+        m_fileMap = 0;
+    }
+    else if (m_fileMap)
+    {
+        QFile *file = static_cast<QFile*>(m_iodevice);
+        file->unmap(m_fileMap);
+        m_fileMap = 0;
+        if (m_direction == QXmppTransferJob::IncomingDirection && cause != NoError &&
+            file->size() > qMax(m_fileOriginalSize, m_done))
+            file->resize(qMax(m_fileOriginalSize, m_done));
+    }
+
+    // a file which was larger than the one received keeps no stale tail
+    QFile *file = qobject_cast<QFile*>(m_iodevice);
+    if (file && !m_parentJob && m_direction == QXmppTransferJob::IncomingDirection &&
+        cause == NoError && fileSize() > 0 && file->size() > fileSize())
+        file->resize(fileSize());
+
     // close IO device
     if (m_iodevice)
         m_iodevice->close();
@@ -331,17 +1048,55 @@ void QXmppTransferJob::terminate(QXmppTransferJob::Error cause)
 
     // emit signals later
     QTimer::singleShot(0, this, SLOT(slotTerminated()));
+
+    // let the parent job know this stream is done
+    if (m_parentJob)
+        m_parentJob->streamFinished(this);
 }
 
 bool QXmppTransferJob::writeData(const QByteArray &data)
 {
-    const qint64 written = m_iodevice->write(data);
-    if (written < 0)
+    // compressed data is inflated and hashed on its way to the device,
+    // ioReady() then accounts for the file bytes
+    if (m_compressionLevel)
+    {
+        if (!m_io)
+            return false;
+        m_io->write(data);
+        m_wireDone += data.size();
+        return true;
+    }
+
+    if (m_fileMap && m_done + data.size() <= mappedEnd())
+    {
+        // copy into the mapped file and hash the mapped pages
+        char *mapped = reinterpret_cast<char*>(m_fileMap) + m_done;
+        memcpy(mapped, data.constData(), data.size());
+        m_done += data.size();
+        if (!m_fileInfo.hash().isEmpty())
+            m_hash.addData(mapped, data.size());
+        reportProgress();
+        return true;
+    }
+
+    // data past the announced size goes through the device
+    if (!m_iodevice)
         return false;
+    qint64 written = data.size();
+    if (m_io)
+    {
+        m_io->write(data);
+    } else {
+        if (m_fileMap && m_iodevice->pos() != m_done && !m_iodevice->seek(m_done))
+            return false;
+        written = m_iodevice->write(data);
+        if (written < 0)
+            return false;
+    }
     m_done += written;
     if (!m_fileInfo.hash().isEmpty())
         m_hash.addData(data);
-    progress(m_done, m_fileInfo.size());
+    reportProgress();
     return true;
 }
 
@@ -350,8 +1105,21 @@ QXmppTransferManager::QXmppTransferManager(QXmppClient *client)
     m_ibbBlockSize(4096),
     m_proxyOnly(false),
     m_socksServer(0),
-    m_supportedMethods(QXmppTransferJob::AnyMethod)
-{
+    m_supportedMethods(QXmppTransferJob::AnyMethod),
+    m_compressionLevel(0),
+    m_parallelStreams(1),
+    m_threadedIo(false),
+    m_ioThread(0),
+    m_journal(0),
+    m_bandwidthLimit(0),
+    m_maximumActiveJobs(0),
+    m_peerBandwidthLimit(0)
+{
+    // the scheduler only runs when bandwidth is limited
+    m_schedulerTimer = new QTimer(this);
+    m_schedulerTimer->setInterval(schedulerInterval);
+    connect(m_schedulerTimer, SIGNAL(timeout()), this, SLOT(schedulerTick()));
+
     // start SOCKS server
     m_socksServer = new QXmppSocksServer(this);
     if (m_socksServer->listen())
@@ -363,20 +1131,31 @@ QXmppTransferManager::QXmppTransferManager(QXmppClient *client)
     }
 }
 
+QXmppTransferManager::~QXmppTransferManager()
+{
+    // stop the I/O thread before the jobs and their devices are destroyed
+    if (m_ioThread)
+    {
+        m_ioThread->quit();
+        m_ioThread->wait();
+    }
+    foreach (QXmppTransferJob *job, m_jobs)
+    {
+        delete job->m_io;
+        job->m_io = 0;
+    }
+}
+
 void QXmppTransferManager::byteStreamIqReceived(const QXmppByteStreamIq &iq)
 {
     // handle IQ from proxy
-    foreach (QXmppTransferJob *job, m_jobs)
+    QXmppTransferJob *job = getJobByProxyRequestId(iq.from(), iq.id());
+    if (job && iq.type() == QXmppIq::Result && iq.streamHosts().size() > 0)
     {
-        if (job->m_socksProxy.jid() == iq.from() && job->m_requestId == iq.id())
-        {
-            if (iq.type() == QXmppIq::Result && iq.streamHosts().size() > 0)
-            {
-                job->m_socksProxy = iq.streamHosts().first();
-                socksServerSendOffer(job);
-                return;
-            }
-        }
+        job->m_socksProxy = iq.streamHosts().first();
+        m_proxyHosts.insert(iq.from(), job->m_socksProxy);
+        socksServerSendOffer(job);
+        return;
     }
 
     if (iq.type() == QXmppIq::Result)
@@ -385,19 +1164,106 @@ void QXmppTransferManager::byteStreamIqReceived(const QXmppByteStreamIq &iq)
         byteStreamSetReceived(iq);
 }
 
+void QXmppTransferManager::connected()
+{
+    if (!m_journal)
+        return;
+
+    // SOCKS5 transfers may have survived the reconnection
+    QSet<QString> activeKeys;
+    foreach (QXmppTransferJob *job, m_jobs)
+        if (job->state() != QXmppTransferJob::FinishedState)
+            activeKeys.insert(journalKey(job));
+
+    // offer the interrupted outgoing transfers again
+    foreach (const QString &key, m_journal->childGroups())
+    {
+        m_journal->beginGroup(key);
+        const QString direction = m_journal->value("direction").toString();
+        const QString jid = m_journal->value("jid").toString();
+        const QString path = m_journal->value("path").toString();
+        QXmppTransferFileInfo fileInfo;
+        fileInfo.setDate(datetimeFromString(m_journal->value("date").toString()));
+        fileInfo.setHash(QByteArray::fromHex(m_journal->value("hash").toByteArray()));
+        fileInfo.setName(m_journal->value("name").toString());
+        fileInfo.setSize(m_journal->value("size").toLongLong());
+        m_journal->endGroup();
+
+        if (direction != "outgoing" || activeKeys.contains(key))
+            continue;
+        m_journal->remove(key);
+
+        // the file must not have changed in the meantime
+        QFileInfo info(path);
+        if (!info.exists() || info.size() != fileInfo.size() ||
+            datetimeToString(info.lastModified()) != datetimeToString(fileInfo.date()))
+            continue;
+
+        QFile *device = new QFile(path);
+        if (!device->open(QIODevice::ReadOnly))
+        {
+            delete device;
+            continue;
+        }
+
+        m_client->logger()->log(QXmppLogger::InformationMessage,
+            QString("Resuming transfer of %1 to %2").arg(fileInfo.name(), jid));
+        QXmppTransferJob *job = sendFile(jid, device, fileInfo);
+        if (job->state() != QXmppTransferJob::FinishedState)
+            emit fileResumed(job);
+    }
+    m_journal->sync();
+}
+
+void QXmppTransferManager::disconnected()
+{
+    // SOCKS5 transfers in progress do not depend on the XMPP
+    // stream, all the other jobs would stall
+    foreach (QXmppTransferJob *job, m_jobs)
+    {
+        if (job->m_parentJob ||
+            (job->method() == QXmppTransferJob::SocksMethod &&
+             job->state() == QXmppTransferJob::TransferState))
+            continue;
+        job->terminate(QXmppTransferJob::ProtocolError);
+    }
+}
+
 /// Handle a response to a bystream set, i.e. after we informed the remote party
 /// that we connected to a stream host.
 void QXmppTransferManager::byteStreamResponseReceived(const QXmppIq &iq)
 {
     QXmppTransferJob *job = getJobByRequestId(iq.from(), iq.id());
     if (!job ||
-        job->direction() != QXmppTransferJob::IncomingDirection ||
         job->method() != QXmppTransferJob::SocksMethod ||
         job->state() != QXmppTransferJob::StartState)
         return;
 
     if (iq.type() == QXmppIq::Error)
+    {
+        // for outgoing jobs, the remote party could not use our stream
+        // hosts, which may be stale if the network changed
+        if (job->direction() == QXmppTransferJob::OutgoingDirection)
+            m_localAddressesTime = QTime();
+
+        if (job->direction() == QXmppTransferJob::OutgoingDirection && iq.from() == job->m_jid)
+        {
+            // do not try SOCKS5 with this peer again for a while
+            m_peers[job->m_peer.bareJid()].socksFailed.start();
+
+            if (job->m_ibbFallback)
+            {
+                m_client->logger()->log(QXmppLogger::InformationMessage,
+                    QString("Falling back to in-band bytestream for %1").arg(job->m_sid));
+                m_socksHashes.remove(streamHash(job->m_sid, m_client->getConfiguration().jid(), job->m_jid));
+                job->m_ibbFallback = false;
+                job->m_method = QXmppTransferJob::InBandMethod;
+                ibbSendOpen(job);
+                return;
+            }
+        }
         job->terminate(QXmppTransferJob::ProtocolError);
+    }
 }
 
 /// Handle a bytestream result, i.e. after the remote party has connected to
@@ -411,6 +1277,11 @@ void QXmppTransferManager::byteStreamResultReceived(const QXmppByteStreamIq &iq)
         job->state() != QXmppTransferJob::StartState)
         return;
 
+    // remember which stream host worked for this peer
+    PeerInfo &peer = m_peers[job->m_peer.bareJid()];
+    peer.socksFailed = QTime();
+    peer.socksHost = iq.streamHostUsed();
+
     // check the stream host
     if (iq.streamHostUsed() == job->m_socksProxy.jid())
     {
@@ -421,37 +1292,13 @@ void QXmppTransferManager::byteStreamResultReceived(const QXmppByteStreamIq &iq)
                 streamHost.host().toString(),
                 QString::number(streamHost.port())));
 
-        // connect to proxy
-        const QString hostName = streamHash(job->m_sid,
-                                            m_client->getConfiguration().jid(),
-                                            job->m_jid);
-
-        QXmppSocksClient *socksClient = new QXmppSocksClient(streamHost.host(), streamHost.port(), job);
-        socksClient->connectToHost(hostName, 0);
-        // FIXME : this should probably be made asynchronous as it blocks XMPP packet handling
-        if (!socksClient->waitForReady(socksTimeout))
-        {
-            m_client->logger()->log(QXmppLogger::WarningMessage,
-                QString("Failed to connect to proxy: %1 (%2:%3)").arg(
-                    streamHost.jid(),
-                    streamHost.host().toString(),
-                    QString::number(streamHost.port())));
-            delete socksClient;
-            job->terminate(QXmppTransferJob::ProtocolError);
-            return;
-        }
-        job->m_socksSocket = socksClient;
-        connect(job->m_socksSocket, SIGNAL(disconnected()), job, SLOT(disconnected()));
-
-        // activate stream
-        QXmppByteStreamIq streamIq;
-        streamIq.setType(QXmppIq::Set);
-        streamIq.setFrom(m_client->getConfiguration().jid());
-        streamIq.setTo(streamHost.jid());
-        streamIq.setSid(job->m_sid);
-        streamIq.setActivate(job->m_jid);
-        job->m_requestId = streamIq.id();
-        m_client->sendPacket(streamIq);
+        // connect to proxy, the stream is activated once we are connected
+        job->m_socksHostName = streamHash(job->m_sid,
+                                          m_client->getConfiguration().jid(),
+                                          job->m_jid);
+        job->m_socksHosts.clear();
+        job->m_socksHosts << streamHost;
+        socksClientConnect(job);
         return;
     }
 
@@ -463,9 +1310,12 @@ void QXmppTransferManager::byteStreamResultReceived(const QXmppByteStreamIq &iq)
         return;
     }
     job->setState(QXmppTransferJob::TransferState);
+    if (job->state() != QXmppTransferJob::TransferState)
+        return;
     connect(job->m_socksSocket, SIGNAL(disconnected()), job, SLOT(disconnected()));
     connect(job->m_socksSocket, SIGNAL(bytesWritten(qint64)), job, SLOT(sendData()));
-    connect(job->m_iodevice, SIGNAL(readyRead()), job, SLOT(sendData()));
+    if (job->m_iodevice)
+        connect(job->m_iodevice, SIGNAL(readyRead()), job, SLOT(sendData()));
     job->sendData();
 }
 
@@ -492,72 +1342,85 @@ void QXmppTransferManager::byteStreamSetReceived(const QXmppByteStreamIq &iq)
         return;
     }
 
-    // try connecting to the offered stream hosts
-    foreach (const QXmppByteStreamIq::StreamHost &streamHost, iq.streamHosts())
-    {
-        m_client->logger()->log(QXmppLogger::InformationMessage,
-            QString("Connecting to streamhost: %1 (%2:%3)").arg(
-                streamHost.jid(),
-                streamHost.host().toString(),
-                QString::number(streamHost.port())));
-
-        const QString hostName = streamHash(job->m_sid,
-                                            job->m_jid,
-                                            m_client->getConfiguration().jid());
-
-        // try to connect to stream host
-        QXmppSocksClient *socksClient = new QXmppSocksClient(streamHost.host(), streamHost.port(), job);
-        socksClient->connectToHost(hostName, 0);
-        // FIXME : this should probably be made asynchronous as it blocks XMPP packet handling
-        if (socksClient->waitForReady(socksTimeout))
-        {
-            job->setState(QXmppTransferJob::TransferState);
-            job->m_socksSocket = socksClient;
-            connect(job->m_socksSocket, SIGNAL(readyRead()), job, SLOT(receiveData()));
-            connect(job->m_socksSocket, SIGNAL(disconnected()), job, SLOT(disconnected()));
-
-            QXmppByteStreamIq ackIq;
-            ackIq.setId(iq.id());
-            ackIq.setTo(iq.from());
-            ackIq.setType(QXmppIq::Result);
-            ackIq.setSid(job->m_sid);
-            ackIq.setStreamHostUsed(streamHost.jid());
-            m_client->sendPacket(ackIq);
-            return;
-        } else {
-            m_client->logger()->log(QXmppLogger::WarningMessage,
-                QString("Failed to connect to streamhost: %1 (%2:%3)").arg(
-                    streamHost.jid(),
-                    streamHost.host().toString(),
-                    QString::number(streamHost.port())));
-            delete socksClient;
-        }
-    }
-
-    // could not connect to any stream host
-    QXmppStanza::Error error(QXmppStanza::Error::Cancel, QXmppStanza::Error::ItemNotFound);
-    error.setCode(404);
-    response.setType(QXmppIq::Error);
-    response.setError(error);
-    m_client->sendPacket(response);
+    // try connecting to the offered stream hosts, the first one
+    // to complete the SOCKS5 handshake will be used
+    job->m_socksOfferId = iq.id();
+    job->m_socksHostName = streamHash(job->m_sid,
+                                      job->m_jid,
+                                      m_client->getConfiguration().jid());
+    job->m_socksHosts = preferStreamHost(iq.streamHosts(), m_peers.value(job->m_peer.bareJid()).socksHost);
+    socksClientCancel(job);
+    if (job->m_socksHosts.isEmpty())
+        socksClientFailed(job);
+    else
+        socksClientConnect(job);
+}
 
-    job->terminate(QXmppTransferJob::ProtocolError);
+QXmppTransferJob* QXmppTransferManager::getJobByProxyRequestId(const QString &jid, const QString &id)
+{
+    QXmppTransferJob *job = m_requestIds.value(id);
+    if (job && !jid.isEmpty() && job->m_socksProxy.jid() == jid)
+        return job;
+    return 0;
 }
 
 QXmppTransferJob* QXmppTransferManager::getJobByRequestId(const QString &jid, const QString &id)
 {
-    foreach (QXmppTransferJob *job, m_jobs)
-        if (job->m_jid == jid && job->m_requestId == id)
-            return job;
+    // stanza ids are unique, but make sure the response comes from the peer
+    QXmppTransferJob *job = m_requestIds.value(id);
+    if (job && job->m_jid == jid)
+        return job;
     return 0;
 }
 
 QXmppTransferJob* QXmppTransferManager::getJobBySid(const QString &jid, const QString &sid)
 {
-    foreach (QXmppTransferJob *job, m_jobs)
-        if (job->m_jid == jid && job->m_sid == sid)
-            return job;
-    return 0;
+    return m_sids.value(qMakePair(jid, sid));
+}
+
+/// Split a job's file into \a count ranges, each carried by its own
+/// SOCKS5 bytestream. The job keeps the first range.
+
+void QXmppTransferManager::createStreams(QXmppTransferJob *job, int count)
+{
+    const qint64 chunk = job->fileSize() / count;
+    job->m_streamEnd = chunk;
+    job->m_hashEnd = chunk;
+    for (int i = 1; i < count; ++i)
+    {
+        QXmppTransferJob *stream = new QXmppTransferJob(job->m_jid, job->m_direction, job);
+        stream->m_parentJob = job;
+        stream->m_sid = job->m_sid + "-" + QString::number(i);
+        stream->m_method = QXmppTransferJob::SocksMethod;
+        stream->m_priority = job->m_priority;
+        stream->m_blockSize = job->m_blockSize;
+        stream->m_fileInfo.setSize(job->fileSize());
+        stream->m_rangeOffset = i * chunk;
+        stream->m_done = stream->m_rangeOffset;
+        stream->m_streamEnd = (i == count - 1) ? job->fileSize() : (i + 1) * chunk;
+        stream->m_state = QXmppTransferJob::StartState;
+        registerJob(stream);
+        job->m_streams.append(stream);
+    }
+}
+
+void QXmppTransferManager::registerJob(QXmppTransferJob *job)
+{
+    m_jobs.append(job);
+    m_sids.insert(qMakePair(job->m_jid, job->m_sid), job);
+    job->m_ioThread = m_threadedIo ? m_ioThread : 0;
+    connect(job, SIGNAL(destroyed(QObject*)), this, SLOT(jobDestroyed(QObject*)));
+    connect(job, SIGNAL(finished()), this, SLOT(jobFinished()));
+    connect(job, SIGNAL(progress(qint64,qint64)), this, SLOT(jobProgress()));
+    connect(job, SIGNAL(stateChanged(QXmppTransferJob::State)), this, SLOT(jobTransferStarted(QXmppTransferJob::State)));
+}
+
+void QXmppTransferManager::setRequestId(QXmppTransferJob *job, const QString &id)
+{
+    if (m_requestIds.value(job->m_requestId) == job)
+        m_requestIds.remove(job->m_requestId);
+    job->m_requestId = id;
+    m_requestIds.insert(id, job);
 }
 
 void QXmppTransferManager::ibbCloseIqReceived(const QXmppIbbCloseIq &iq)
@@ -626,6 +1489,21 @@ void QXmppTransferManager::ibbDataIqReceived(const QXmppIbbDataIq &iq)
     m_client->sendPacket(response);
 }
 
+/// Resumes an outgoing in-band bytestream which was waiting for its
+/// data to be read ahead.
+
+void QXmppTransferManager::ibbIoReady()
+{
+    foreach (QXmppTransferJob *job, m_jobs)
+    {
+        if (job->m_io != sender() && job->m_iodevice != sender())
+            continue;
+        if (job->m_io && job->m_ibbStalled && job->state() == QXmppTransferJob::TransferState)
+            ibbSendData(job);
+        return;
+    }
+}
+
 void QXmppTransferManager::ibbOpenIqReceived(const QXmppIbbOpenIq &iq)
 {
     QXmppIq response;
@@ -678,31 +1556,8 @@ void QXmppTransferManager::ibbResponseReceived(const QXmppIq &iq)
 
     if (iq.type() == QXmppIq::Result)
     {
-        const QByteArray buffer = job->m_iodevice->read(job->m_blockSize);
         job->setState(QXmppTransferJob::TransferState);
-        if (buffer.size())
-        {
-            // send next data block
-            QXmppIbbDataIq dataIq;
-            dataIq.setTo(job->m_jid);
-            dataIq.setSid(job->m_sid);
-            dataIq.setSequence(job->m_ibbSequence++);
-            dataIq.setPayload(buffer);
-            job->m_requestId = dataIq.id();
-            m_client->sendPacket(dataIq);
-
-            job->m_done += buffer.size();
-            job->progress(job->m_done, job->fileSize());
-        } else {
-            // close the bytestream
-            QXmppIbbCloseIq closeIq;
-            closeIq.setTo(job->m_jid);
-            closeIq.setSid(job->m_sid);
-            job->m_requestId = closeIq.id();
-            m_client->sendPacket(closeIq);
-
-            job->terminate(QXmppTransferJob::NoError);
-        }
+        ibbSendData(job);
     }
     else if (iq.type() == QXmppIq::Error)
     {
@@ -710,45 +1565,112 @@ void QXmppTransferManager::ibbResponseReceived(const QXmppIq &iq)
         QXmppIbbCloseIq closeIq;
         closeIq.setTo(job->m_jid);
         closeIq.setSid(job->m_sid);
-        job->m_requestId = closeIq.id();
+        setRequestId(job, closeIq.id());
         m_client->sendPacket(closeIq);
 
         job->terminate(QXmppTransferJob::ProtocolError);
     }
 }
 
+void QXmppTransferManager::ibbSendData(QXmppTransferJob *job)
+{
+    // respect the bandwidth allowance, the scheduler
+    // will resume the job once it has been refilled
+    qint64 blockSize = job->m_blockSize;
+    if (job->m_allowance >= 0)
+        blockSize = qMin(blockSize, job->m_allowance);
+    job->m_ibbStalled = !blockSize;
+    if (job->m_ibbStalled)
+        return;
+
+    // check for the end before reading, as the I/O buffer may reach
+    // it in the meantime
+    const bool atEnd = !job->m_io || job->m_io->atEnd() ||
+                       (job->streamEnd() && job->m_done >= job->streamEnd());
+    qint64 length = 0;
+    const QByteArray payload = job->readData(blockSize, &length);
+    if (payload.size())
+    {
+        if (job->m_compressionLevel)
+            job->m_wireDone += payload.size();
+
+        // send next data block
+        QXmppIbbDataIq dataIq;
+        dataIq.setTo(job->m_jid);
+        dataIq.setSid(job->m_sid);
+        dataIq.setSequence(job->m_ibbSequence++);
+        dataIq.setPayload(payload);
+        setRequestId(job, dataIq.id());
+        m_client->sendPacket(dataIq);
+
+        job->m_done += length;
+        if (job->m_allowance >= 0)
+            job->m_allowance -= payload.size();
+        job->reportProgress();
+    }
+    else if (!atEnd)
+    {
+        // wait for the data to be read ahead, ibbIoReady() resumes the job
+        job->m_ibbStalled = true;
+    } else {
+        // close the bytestream
+        QXmppIbbCloseIq closeIq;
+        closeIq.setTo(job->m_jid);
+        closeIq.setSid(job->m_sid);
+        setRequestId(job, closeIq.id());
+        m_client->sendPacket(closeIq);
+
+        job->terminate(QXmppTransferJob::NoError);
+    }
+}
+
+void QXmppTransferManager::ibbSendOpen(QXmppTransferJob *job)
+{
+    // lower block size for IBB
+    job->m_blockSize = m_ibbBlockSize;
+
+    QXmppIbbOpenIq openIq;
+    openIq.setTo(job->m_jid);
+    openIq.setSid(job->m_sid);
+    openIq.setBlockSize(job->m_blockSize);
+    setRequestId(job, openIq.id());
+    m_client->sendPacket(openIq);
+}
+
 void QXmppTransferManager::iqReceived(const QXmppIq &iq)
 {
     // handle IQ from proxy
-    foreach (QXmppTransferJob *job, m_jobs)
+    QXmppTransferJob *job = getJobByProxyRequestId(iq.from(), iq.id());
+    if (job)
     {
-        if (job->m_socksProxy.jid() == iq.from() && job->m_requestId == iq.id())
+        if (job->m_socksSocket)
         {
-            if (job->m_socksSocket)
+            // proxy connection activation result
+            if (iq.type() == QXmppIq::Result)
             {
-                // proxy connection activation result
-                if (iq.type() == QXmppIq::Result)
-                {
-                    // proxy stream activated, start sending data
-                    job->setState(QXmppTransferJob::TransferState);
-                    connect(job->m_socksSocket, SIGNAL(bytesWritten(qint64)), job, SLOT(sendData()));
+                // proxy stream activated, start sending data
+                job->setState(QXmppTransferJob::TransferState);
+                if (job->state() != QXmppTransferJob::TransferState)
+                    return;
+                connect(job->m_socksSocket, SIGNAL(bytesWritten(qint64)), job, SLOT(sendData()));
+                if (job->m_iodevice)
                     connect(job->m_iodevice, SIGNAL(readyRead()), job, SLOT(sendData()));
-                    job->sendData();
-                } else if (iq.type() == QXmppIq::Error) {
-                    // proxy stream not activated, terminate
-                    qWarning("Could not activate SOCKS5 proxy bytestream");
-                    job->terminate(QXmppTransferJob::ProtocolError);
-                }
-            } else {
-                // we could not get host/port from proxy, procede without a proxy
-                if (iq.type() == QXmppIq::Error)
-                    socksServerSendOffer(job);
+                job->sendData();
+            } else if (iq.type() == QXmppIq::Error) {
+                // proxy stream not activated, terminate
+                qWarning("Could not activate SOCKS5 proxy bytestream");
+                m_proxyHosts.remove(m_proxy);
+                job->terminate(QXmppTransferJob::ProtocolError);
             }
-            return;
+        } else {
+            // we could not get host/port from proxy, procede without a proxy
+            if (iq.type() == QXmppIq::Error)
+                socksServerSendOffer(job);
         }
+        return;
     }
 
-    QXmppTransferJob *job = getJobByRequestId(iq.from(), iq.id());
+    job = getJobByRequestId(iq.from(), iq.id());
     if (!job)
         return;
 
@@ -764,7 +1686,26 @@ void QXmppTransferManager::iqReceived(const QXmppIq &iq)
 
 void QXmppTransferManager::jobDestroyed(QObject *object)
 {
-    m_jobs.removeAll(static_cast<QXmppTransferJob*>(object));
+    // the job's members are already destroyed, so we cannot
+    // use them to compute the index keys
+    QXmppTransferJob *job = static_cast<QXmppTransferJob*>(object);
+    m_jobs.removeAll(job);
+    m_queuedJobs.removeAll(job);
+
+    QMutableHashIterator<QString, QXmppTransferJob*> requestIt(m_requestIds);
+    while (requestIt.hasNext())
+        if (requestIt.next().value() == job)
+            requestIt.remove();
+
+    QMutableHashIterator<QPair<QString, QString>, QXmppTransferJob*> sidIt(m_sids);
+    while (sidIt.hasNext())
+        if (sidIt.next().value() == job)
+            sidIt.remove();
+
+    QMutableHashIterator<QString, QXmppTransferJob*> hashIt(m_socksHashes);
+    while (hashIt.hasNext())
+        if (hashIt.next().value() == job)
+            hashIt.remove();
 }
 
 void QXmppTransferManager::jobError(QXmppTransferJob::Error error)
@@ -781,7 +1722,7 @@ void QXmppTransferManager::jobError(QXmppTransferJob::Error error)
         QXmppIbbCloseIq closeIq;
         closeIq.setTo(job->m_jid);
         closeIq.setSid(job->m_sid);
-        job->m_requestId = closeIq.id();
+        setRequestId(job, closeIq.id());
         m_client->sendPacket(closeIq);
     }
 }
@@ -792,7 +1733,76 @@ void QXmppTransferManager::jobFinished()
     if (!job || !m_jobs.contains(job))
         return;
 
+    // parallel streams are reported through their parent job
+    if (job->m_parentJob)
+    {
+        socksClientCancel(job);
+        return;
+    }
+
+    // the job was cancelled while waiting for a free slot
+    if (m_queuedJobs.removeAll(job) && job->direction() == QXmppTransferJob::IncomingDirection)
+    {
+        QXmppStanza::Error error(QXmppStanza::Error::Cancel, QXmppStanza::Error::Forbidden);
+        error.setCode(403);
+
+        QXmppStreamInitiationIq response;
+        response.setTo(job->jid());
+        response.setId(job->m_offerId);
+        response.setType(QXmppIq::Error);
+        response.setError(error);
+        m_client->sendPacket(response);
+    }
+
+    // stop any pending SOCKS5 connection attempts
+    socksClientCancel(job);
+
+    // keep interrupted transfers in the journal so they can be resumed
+    if (job->error() == QXmppTransferJob::ProtocolError)
+        journalWrite(job);
+    else
+        journalRemove(job);
+
+    // remember the throughput achieved with this peer, unless
+    // it was capped by our own bandwidth limits
+    if (job->error() == QXmppTransferJob::NoError &&
+        job->doneBytes() - job->m_transferStart >= peerSpeedMinimum &&
+        m_bandwidthLimit <= 0 && m_peerBandwidthLimit <= 0)
+    {
+        PeerInfo &peer = m_peers[job->m_peer.bareJid()];
+        qint64 &speed = (job->method() == QXmppTransferJob::InBandMethod) ? peer.ibbSpeed : peer.socksSpeed;
+        const qint64 rate = job->averageSpeed();
+        speed = speed ? (speed + rate) / 2 : rate;
+    }
+
     emit finished(job);
+
+    // a slot may have been freed
+    startQueuedJobs();
+}
+
+/// Puts a job which starts transferring data under the control of the
+/// scheduler if a bandwidth limit is set, so that it waits for its first
+/// tokens, and lets it run freely otherwise.
+
+void QXmppTransferManager::jobTransferStarted(QXmppTransferJob::State state)
+{
+    QXmppTransferJob *job = qobject_cast<QXmppTransferJob *>(sender());
+    if (!job || state != QXmppTransferJob::TransferState)
+        return;
+
+    job->m_allowance = m_schedulerTimer->isActive() ? 0 : -1;
+    job->m_allowanceRefill = -1;
+    job->m_allowanceFraction = 0;
+
+    // outgoing in-band bytestreams wait for their data to be read ahead
+    if (job->m_io && job->method() == QXmppTransferJob::InBandMethod &&
+        job->direction() == QXmppTransferJob::OutgoingDirection)
+    {
+        connect(job->m_io, SIGNAL(ready()), this, SLOT(ibbIoReady()));
+        if (job->m_iodevice->isSequential())
+            connect(job->m_iodevice, SIGNAL(readyRead()), this, SLOT(ibbIoReady()));
+    }
 }
 
 void QXmppTransferManager::jobStateChanged(QXmppTransferJob::State state)
@@ -827,6 +1837,18 @@ void QXmppTransferManager::jobStateChanged(QXmppTransferJob::State state)
 
     // the job was accepted by the local party
     connect(job, SIGNAL(error(QXmppTransferJob::Error)), this, SLOT(jobError(QXmppTransferJob::Error)));
+    journalWrite(job);
+
+    // wait for a free slot before telling the remote party
+    m_queuedJobs.append(job);
+    startQueuedJobs();
+}
+
+void QXmppTransferManager::streamInitiationSendResult(QXmppTransferJob *job)
+{
+    QXmppStreamInitiationIq response;
+    response.setTo(job->jid());
+    response.setId(job->m_offerId);
 
     QXmppElement value;
     value.setTagName("value");
@@ -851,13 +1873,204 @@ void QXmppTransferManager::jobStateChanged(QXmppTransferJob::State state)
     feature.setAttribute("xmlns", ns_feature_negotiation);
     feature.appendChild(x);
 
+    QXmppElement file;
+    file.setTagName("file");
+    file.setAttribute("xmlns", ns_stream_initiation_file_transfer);
+    if (job->m_rangeOffset > 0)
+    {
+        // request the remainder of the file
+        QXmppElement range;
+        range.setTagName("range");
+        range.setAttribute("offset", QString::number(job->m_rangeOffset));
+        file.appendChild(range);
+    }
+
+    // accept parallel bytestreams if we can write straight to the file
+    QFile *device = qobject_cast<QFile*>(job->m_iodevice);
+    const int count = qMin(job->m_streamCount, m_parallelStreams);
+    if (count > 1 &&
+        job->method() == QXmppTransferJob::SocksMethod &&
+        job->m_rangeOffset == 0 && job->fileSize() > 0 &&
+        device && (device->openMode() & QIODevice::ReadWrite) == QIODevice::ReadWrite)
+    {
+        QXmppElement streams;
+        streams.setTagName("streams");
+        streams.setAttribute("xmlns", ns_parallel_bytestreams);
+        streams.setAttribute("count", QString::number(count));
+        file.appendChild(streams);
+        createStreams(job, count);
+    }
+
+    // accept compression, unless the file is split across parallel
+    // streams which write straight to the mapped file
+    if (!job->m_streams.isEmpty())
+        job->m_compressionLevel = 0;
+    if (job->m_compressionLevel)
+    {
+        QXmppElement compress;
+        compress.setTagName("compress");
+        compress.setAttribute("xmlns", ns_compressed_bytestreams);
+        compress.setAttribute("method", "zlib");
+        file.appendChild(compress);
+    }
+
+    // accept falling back to IBB, parallel streams cannot fall back
+    if (job->m_ibbFallback && job->m_streams.isEmpty())
+    {
+        QXmppElement fallback;
+        fallback.setTagName("fallback");
+        fallback.setAttribute("xmlns", ns_bytestream_fallback);
+        file.appendChild(fallback);
+    } else {
+        job->m_ibbFallback = false;
+    }
+
+    QXmppElementList items;
+    if (!file.firstChildElement().isNull())
+        items.append(file);
+    items.append(feature);
+
     response.setType(QXmppIq::Result);
     response.setProfile(QXmppStreamInitiationIq::FileTransfer);
-    response.setSiItems(feature);
+    response.setSiItems(items);
 
     m_client->sendPacket(response);
 }
 
+bool QXmppTransferManager::canStartJob() const
+{
+    if (m_maximumActiveJobs <= 0)
+        return true;
+
+    int activeJobs = 0;
+    foreach (QXmppTransferJob *job, m_jobs)
+    {
+        if (job->state() == QXmppTransferJob::FinishedState || job->m_parentJob ||
+            m_queuedJobs.contains(job))
+            continue;
+
+        // incoming offers awaiting a decision do not use any resources
+        if (job->direction() == QXmppTransferJob::IncomingDirection &&
+            job->state() == QXmppTransferJob::OfferState)
+            continue;
+
+        activeJobs++;
+    }
+    return activeJobs < m_maximumActiveJobs;
+}
+
+void QXmppTransferManager::startQueuedJobs()
+{
+    while (!m_queuedJobs.isEmpty() && canStartJob())
+    {
+        // pick the oldest job with the highest priority
+        QXmppTransferJob *next = m_queuedJobs.first();
+        foreach (QXmppTransferJob *job, m_queuedJobs)
+            if (job->priority() > next->priority())
+                next = job;
+        m_queuedJobs.removeAll(next);
+
+        if (next->state() == QXmppTransferJob::FinishedState)
+            continue;
+        if (next->direction() == QXmppTransferJob::OutgoingDirection)
+            streamInitiationSendOffer(next);
+        else
+            streamInitiationSendResult(next);
+    }
+}
+
+void QXmppTransferManager::schedulerTick()
+{
+    const bool limited = m_schedulerTimer->isActive();
+    const qint64 interval = m_schedulerTimer->interval();
+
+    // collect the jobs which are transferring data, only those which can
+    // be throttled and used their tokens last tick, or could not because
+    // the socket or the disk is full, get a weighted share
+    QList<QXmppTransferJob*> jobs;
+    QSet<QXmppTransferJob*> idleJobs;
+    QHash<QString, int> peerWeights;
+    int totalWeight = 0;
+    foreach (QXmppTransferJob *job, m_jobs)
+    {
+        if (job->state() != QXmppTransferJob::TransferState)
+            continue;
+        jobs.append(job);
+        if (!isThrottled(job) ||
+            (job->m_allowance > 0 && job->m_allowance == job->m_allowanceRefill &&
+             !job->isBlocked()))
+        {
+            idleJobs.insert(job);
+            continue;
+        }
+        totalWeight += job->priority();
+        peerWeights[job->m_peer.bareJid()] += job->priority();
+    }
+
+    foreach (QXmppTransferJob *job, jobs)
+    {
+        if (!limited || !isThrottled(job))
+        {
+            job->m_allowance = -1;
+        }
+        else if (!idleJobs.contains(job))
+        {
+            // share the tokens for this tick according to the jobs' weights
+            double share = -1;
+            if (m_bandwidthLimit > 0)
+                share = double(m_bandwidthLimit) * interval / 1000 * job->priority() / totalWeight;
+            if (m_peerBandwidthLimit > 0)
+            {
+                const double peerShare = double(m_peerBandwidthLimit) * interval / 1000 * job->priority() /
+                                         peerWeights.value(job->m_peer.bareJid());
+                share = (share < 0) ? peerShare : qMin(share, peerShare);
+            }
+
+            // carry the fraction of a byte over to the next tick, so that
+            // low limits shared by many jobs are still met on average
+            const double exact = share + job->m_allowanceFraction;
+            const qint64 tokens = qint64(exact);
+            job->m_allowanceFraction = exact - tokens;
+
+            // refill the job's bucket, allowing bursts of up to two ticks
+            job->m_allowance = qMin(qMax(job->m_allowance, qint64(0)) + tokens,
+                                    qMax(tokens, qint64(2 * share)));
+            job->m_allowanceRefill = job->m_allowance;
+        }
+        // idle jobs keep their unused tokens to wake up with
+
+        // resume the transfer
+        if (job->method() == QXmppTransferJob::SocksMethod)
+        {
+            if (job->direction() == QXmppTransferJob::OutgoingDirection)
+                job->sendData();
+            else
+                job->receiveData();
+        }
+        else if (job->method() == QXmppTransferJob::InBandMethod &&
+                 job->direction() == QXmppTransferJob::OutgoingDirection &&
+                 job->m_ibbStalled)
+        {
+            ibbSendData(job);
+        }
+    }
+}
+
+void QXmppTransferManager::updateScheduler()
+{
+    if (m_bandwidthLimit > 0 || m_peerBandwidthLimit > 0)
+    {
+        m_schedulerTimer->start();
+    } else {
+        // release every job, including those which are not transferring
+        // data yet and would otherwise never receive any tokens
+        m_schedulerTimer->stop();
+        foreach (QXmppTransferJob *job, m_jobs)
+            job->m_allowance = -1;
+    }
+    schedulerTick();
+}
+
 /// Send file to a remote party.
 ///
 /// The remote party will be given the choice to accept or refuse the transfer.
@@ -920,98 +2133,510 @@ QXmppTransferJob *QXmppTransferManager::sendFile(const QString &jid, QIODevice *
         return job;
     }
 
-    // check we support some methods
-    if (m_supportedMethods == QXmppTransferJob::NoMethod)
+    // check we support some methods
+    if (m_supportedMethods == QXmppTransferJob::NoMethod)
+    {
+        job->terminate(QXmppTransferJob::ProtocolError);
+        return job;
+    }
+
+    // register job
+    registerJob(job);
+    connect(job, SIGNAL(error(QXmppTransferJob::Error)), this, SLOT(jobError(QXmppTransferJob::Error)));
+    journalWrite(job);
+
+    // send the offer once a slot is available
+    m_queuedJobs.append(job);
+    startQueuedJobs();
+
+    return job;
+}
+
+void QXmppTransferManager::streamInitiationSendOffer(QXmppTransferJob *job)
+{
+    // prepare negotiation
+    QXmppElementList items;
+
+    QXmppElement file;
+    file.setTagName("file");
+    file.setAttribute("xmlns", ns_stream_initiation_file_transfer);
+    file.setAttribute("date", datetimeToString(job->fileDate()));
+    file.setAttribute("hash", job->fileHash().toHex());
+    file.setAttribute("name", job->fileName());
+    file.setAttribute("size", QString::number(job->fileSize()));
+    if (!job->m_iodevice->isSequential())
+    {
+        // advertise support for ranged transfers
+        QXmppElement range;
+        range.setTagName("range");
+        file.appendChild(range);
+        job->m_rangeSupported = true;
+    }
+
+    // offer to split large files across parallel bytestreams
+    const int methods = peerMethods(job->m_jid);
+    QFile *device = qobject_cast<QFile*>(job->m_iodevice);
+    if (m_parallelStreams > 1 &&
+        (methods & QXmppTransferJob::SocksMethod) &&
+        device && !device->isSequential() &&
+        job->fileSize() >= 2 * parallelStreamSize)
+    {
+        job->m_streamCount = qMin(qint64(m_parallelStreams), job->fileSize() / parallelStreamSize);
+
+        QXmppElement streams;
+        streams.setTagName("streams");
+        streams.setAttribute("xmlns", ns_parallel_bytestreams);
+        streams.setAttribute("count", QString::number(job->m_streamCount));
+        file.appendChild(streams);
+    }
+
+    // offer to compress the file data
+    job->m_compressionLevel = m_compressionLevel;
+    if (job->m_compressionLevel)
+    {
+        QXmppElement compress;
+        compress.setTagName("compress");
+        compress.setAttribute("xmlns", ns_compressed_bytestreams);
+        compress.setAttribute("method", "zlib");
+        file.appendChild(compress);
+    }
+
+    // offer to fall back to IBB if SOCKS5 fails
+    if ((methods & QXmppTransferJob::SocksMethod) && (methods & QXmppTransferJob::InBandMethod))
+    {
+        QXmppElement fallback;
+        fallback.setTagName("fallback");
+        fallback.setAttribute("xmlns", ns_bytestream_fallback);
+        file.appendChild(fallback);
+    }
+    items.append(file);
+ 
+    QXmppElement feature;
+    feature.setTagName("feature");
+    feature.setAttribute("xmlns", ns_feature_negotiation);
+
+    QXmppElement x;
+    x.setTagName("x");
+    x.setAttribute("xmlns", "jabber:x:data");
+    x.setAttribute("type", "form");
+    feature.appendChild(x);
+
+    QXmppElement field;
+    field.setTagName("field");
+    field.setAttribute("var", "stream-method");
+    field.setAttribute("type", "list-single");
+    x.appendChild(field);
+
+    // add supported stream methods
+    if (methods & QXmppTransferJob::InBandMethod)
+    {
+        QXmppElement option;
+        option.setTagName("option");
+        field.appendChild(option);
+
+        QXmppElement value;
+        value.setTagName("value");
+        value.setValue(ns_ibb);
+        option.appendChild(value);
+    }
+    if (methods & QXmppTransferJob::SocksMethod)
+    {
+        QXmppElement option;
+        option.setTagName("option");
+        field.appendChild(option);
+
+        QXmppElement value;
+        value.setTagName("value");
+        value.setValue(ns_bytestreams);
+        option.appendChild(value);
+    }
+
+    items.append(feature);
+
+    QXmppStreamInitiationIq request;
+    request.setType(QXmppIq::Set);
+    request.setTo(job->m_jid);
+    request.setProfile(QXmppStreamInitiationIq::FileTransfer);
+    request.setSiItems(items);
+    request.setSiId(job->m_sid);
+    setRequestId(job, request.id());
+    m_client->sendPacket(request);
+}
+
+/// Start connecting to the next candidate SOCKS5 stream host for a job.
+///
+/// Candidates are tried in parallel: the next one is started as soon as a
+/// connection attempt fails or after a short delay, whichever comes first.
+
+void QXmppTransferManager::socksClientConnect(QXmppTransferJob *job)
+{
+    if (job->m_socksHosts.isEmpty())
+        return;
+
+    const QXmppByteStreamIq::StreamHost streamHost = job->m_socksHosts.takeFirst();
+    m_client->logger()->log(QXmppLogger::InformationMessage,
+        QString("Connecting to streamhost: %1 (%2:%3)").arg(
+            streamHost.jid(),
+            streamHost.host().toString(),
+            QString::number(streamHost.port())));
+
+    // arm the timer before connecting, as a failure
+    // may be reported before connectToHost() returns
+    if (!job->m_socksTimer)
+    {
+        job->m_socksTimer = new QTimer(job);
+        job->m_socksTimer->setSingleShot(true);
+        connect(job->m_socksTimer, SIGNAL(timeout()), this, SLOT(socksClientTimeout()));
+    }
+    job->m_socksTimer->start(job->m_socksHosts.isEmpty() ? socksTimeout : socksStagger);
+
+    QXmppSocksClient *socksClient = new QXmppSocksClient(streamHost.host(), streamHost.port(), job);
+    job->m_socksClients.insert(socksClient, streamHost);
+    connect(socksClient, SIGNAL(ready()), this, SLOT(socksClientReady()));
+    connect(socksClient, SIGNAL(disconnected()), this, SLOT(socksClientError()));
+    connect(socksClient, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socksClientError()));
+    socksClient->connectToHost(job->m_socksHostName, 0);
+}
+
+/// Abort all pending SOCKS5 connection attempts for a job.
+
+void QXmppTransferManager::socksClientCancel(QXmppTransferJob *job)
+{
+    if (job->m_socksTimer)
+        job->m_socksTimer->stop();
+
+    foreach (QXmppSocksClient *socksClient, job->m_socksClients.keys())
+    {
+        disconnect(socksClient, 0, this, 0);
+        socksClient->deleteLater();
+    }
+    job->m_socksClients.clear();
+}
+
+void QXmppTransferManager::socksClientError()
+{
+    QXmppSocksClient *socksClient = qobject_cast<QXmppSocksClient*>(sender());
+    if (!socksClient)
+        return;
+    QXmppTransferJob *job = qobject_cast<QXmppTransferJob*>(socksClient->parent());
+    if (!job || !job->m_socksClients.contains(socksClient))
+        return;
+
+    const QXmppByteStreamIq::StreamHost streamHost = job->m_socksClients.take(socksClient);
+    disconnect(socksClient, 0, this, 0);
+    socksClient->deleteLater();
+    m_client->logger()->log(QXmppLogger::WarningMessage,
+        QString("Failed to connect to streamhost: %1 (%2:%3)").arg(
+            streamHost.jid(),
+            streamHost.host().toString(),
+            QString::number(streamHost.port())));
+
+    // move on to the next candidate
+    if (!job->m_socksHosts.isEmpty())
+        socksClientConnect(job);
+    else if (job->m_socksClients.isEmpty())
+        socksClientFailed(job);
+}
+
+/// Handle the failure to connect to any of a job's SOCKS5 stream hosts.
+
+void QXmppTransferManager::socksClientFailed(QXmppTransferJob *job)
+{
+    socksClientCancel(job);
+    if (job->state() != QXmppTransferJob::StartState)
+        return;
+
+    if (job->direction() == QXmppTransferJob::IncomingDirection)
+    {
+        // could not connect to any stream host
+        QXmppStanza::Error error(QXmppStanza::Error::Cancel, QXmppStanza::Error::ItemNotFound);
+        error.setCode(404);
+
+        QXmppIq response;
+        response.setId(job->m_socksOfferId);
+        response.setTo(job->m_jid);
+        response.setType(QXmppIq::Error);
+        response.setError(error);
+        m_client->sendPacket(response);
+
+        // do not try SOCKS5 with this peer again for a while
+        m_peers[job->m_peer.bareJid()].socksFailed.start();
+
+        // give the remote party some time to open an in-band bytestream
+        if (job->m_ibbFallback)
+        {
+            m_client->logger()->log(QXmppLogger::InformationMessage,
+                QString("Waiting for in-band bytestream fallback for %1").arg(job->m_sid));
+            job->m_ibbFallback = false;
+            job->m_method = QXmppTransferJob::InBandMethod;
+            if (!job->m_socksTimer)
+            {
+                job->m_socksTimer = new QTimer(job);
+                job->m_socksTimer->setSingleShot(true);
+                connect(job->m_socksTimer, SIGNAL(timeout()), this, SLOT(socksClientTimeout()));
+            }
+            job->m_socksTimer->start(socksTimeout);
+            return;
+        }
+    } else {
+        // we could not reach the proxy, ask it again next time
+        m_proxyHosts.remove(m_proxy);
+    }
+    job->terminate(QXmppTransferJob::ProtocolError);
+}
+
+void QXmppTransferManager::socksClientReady()
+{
+    QXmppSocksClient *socksClient = qobject_cast<QXmppSocksClient*>(sender());
+    if (!socksClient)
+        return;
+    QXmppTransferJob *job = qobject_cast<QXmppTransferJob*>(socksClient->parent());
+    if (!job || !job->m_socksClients.contains(socksClient))
+        return;
+
+    // we have a winner, abort the other attempts
+    const QXmppByteStreamIq::StreamHost streamHost = job->m_socksClients.take(socksClient);
+    disconnect(socksClient, 0, this, 0);
+    socksClientCancel(job);
+    job->m_socksHosts.clear();
+    if (job->state() != QXmppTransferJob::StartState)
+    {
+        socksClient->deleteLater();
+        return;
+    }
+
+    job->m_socksSocket = socksClient;
+    connect(job->m_socksSocket, SIGNAL(disconnected()), job, SLOT(disconnected()));
+
+    if (job->direction() == QXmppTransferJob::IncomingDirection)
+    {
+        // remember which stream host worked for this peer
+        PeerInfo &peer = m_peers[job->m_peer.bareJid()];
+        peer.socksFailed = QTime();
+        peer.socksHost = streamHost.jid();
+
+        job->setState(QXmppTransferJob::TransferState);
+        if (job->state() != QXmppTransferJob::TransferState)
+            return;
+        // bound buffering so that rate limiting pushes back on the sender
+        job->m_socksSocket->setReadBufferSize(4 * job->m_blockSize);
+        connect(job->m_socksSocket, SIGNAL(readyRead()), job, SLOT(receiveData()));
+
+        QXmppByteStreamIq ackIq;
+        ackIq.setId(job->m_socksOfferId);
+        ackIq.setTo(job->m_jid);
+        ackIq.setType(QXmppIq::Result);
+        ackIq.setSid(job->m_sid);
+        ackIq.setStreamHostUsed(streamHost.jid());
+        m_client->sendPacket(ackIq);
+
+        // the sender may already have started writing
+        if (job->m_socksSocket->bytesAvailable())
+            job->receiveData();
+    } else {
+        // activate stream
+        QXmppByteStreamIq streamIq;
+        streamIq.setType(QXmppIq::Set);
+        streamIq.setFrom(m_client->getConfiguration().jid());
+        streamIq.setTo(streamHost.jid());
+        streamIq.setSid(job->m_sid);
+        streamIq.setActivate(job->m_jid);
+        setRequestId(job, streamIq.id());
+        m_client->sendPacket(streamIq);
+    }
+}
+
+void QXmppTransferManager::socksClientTimeout()
+{
+    QTimer *timer = qobject_cast<QTimer*>(sender());
+    if (!timer)
+        return;
+    QXmppTransferJob *job = qobject_cast<QXmppTransferJob*>(timer->parent());
+    if (!job || job->state() != QXmppTransferJob::StartState)
+        return;
+
+    // the remote party did not fall back to an in-band bytestream
+    if (job->method() == QXmppTransferJob::InBandMethod)
+    {
+        qWarning("The remote party did not open an in-band bytestream");
+        job->terminate(QXmppTransferJob::ProtocolError);
+        return;
+    }
+
+    // start the next candidate alongside the pending ones
+    if (!job->m_socksHosts.isEmpty())
     {
-        job->terminate(QXmppTransferJob::ProtocolError);
-        return job;
+        socksClientConnect(job);
+        return;
     }
 
-    // prepare negotiation
-    QXmppElementList items;
+    // the remaining attempts took too long
+    QMap<QXmppSocksClient*, QXmppByteStreamIq::StreamHost>::const_iterator it;
+    for (it = job->m_socksClients.constBegin(); it != job->m_socksClients.constEnd(); ++it)
+        m_client->logger()->log(QXmppLogger::WarningMessage,
+            QString("Timed out connecting to streamhost: %1 (%2:%3)").arg(
+                it.value().jid(),
+                it.value().host().toString(),
+                QString::number(it.value().port())));
+    socksClientFailed(job);
+}
 
-    QXmppElement file;
-    file.setTagName("file");
-    file.setAttribute("xmlns", ns_stream_initiation_file_transfer);
-    file.setAttribute("date", datetimeToString(job->fileDate()));
-    file.setAttribute("hash", job->fileHash().toHex());
-    file.setAttribute("name", job->fileName());
-    file.setAttribute("size", QString::number(job->fileSize()));
-    items.append(file);
- 
-    QXmppElement feature;
-    feature.setTagName("feature");
-    feature.setAttribute("xmlns", ns_feature_negotiation);
+void QXmppTransferManager::socksServerConnected(QTcpSocket *socket, const QString &hostName, quint16 port)
+{
+    QXmppTransferJob *job = m_socksHashes.value(hostName);
+    if (job && port == 0)
+    {
+        job->m_socksSocket = socket;
+        return;
+    }
+    qWarning("QXmppSocksServer got a connection for a unknown stream");
+    socket->close();
+    socket->deleteLater();
+}
 
-    QXmppElement x;
-    x.setTagName("x");
-    x.setAttribute("xmlns", "jabber:x:data");
-    x.setAttribute("type", "form");
-    feature.appendChild(x);
+/// Returns the local addresses to offer as stream hosts.
+///
+/// Enumerating the network interfaces is costly, so the addresses are
+/// cached for a short while, or until a remote party fails to use them.
 
-    QXmppElement field;
-    field.setTagName("field");
-    field.setAttribute("var", "stream-method");
-    field.setAttribute("type", "list-single");
-    x.appendChild(field);
+QList<QHostAddress> QXmppTransferManager::localAddresses()
+{
+    if (!m_localAddressesTime.isNull() && m_localAddressesTime.elapsed() < streamHostsTtl)
+        return m_localAddresses;
 
-    // add supported stream methods
-    if (m_supportedMethods & QXmppTransferJob::InBandMethod)
+    m_localAddresses.clear();
+    foreach (const QNetworkInterface &interface, QNetworkInterface::allInterfaces())
     {
-        QXmppElement option;
-        option.setTagName("option");
-        field.appendChild(option);
+        if (!(interface.flags() & QNetworkInterface::IsRunning) ||
+            interface.flags() & QNetworkInterface::IsLoopBack)
+            continue;
 
-        QXmppElement value;
-        value.setTagName("value");
-        value.setValue(ns_ibb);
-        option.appendChild(value);
+        foreach (const QNetworkAddressEntry &entry, interface.addressEntries())
+        {
+            if (entry.ip().protocol() != QAbstractSocket::IPv4Protocol ||
+                entry.netmask().isNull() ||
+                entry.netmask() == QHostAddress::Broadcast)
+                continue;
+
+            m_localAddresses.append(entry.ip());
+        }
     }
-    if (m_supportedMethods & QXmppTransferJob::SocksMethod)
+
+    // try again next time if no network is available yet
+    if (m_localAddresses.isEmpty())
+        m_localAddressesTime = QTime();
+    else
+        m_localAddressesTime.start();
+    return m_localAddresses;
+}
+
+/// Returns the stream methods worth using with the given peer, whatever
+/// its resource. SOCKS5 is left out for a while after it failed, as long
+/// as IBB is available.
+
+int QXmppTransferManager::peerMethods(const QString &jid) const
+{
+    const PeerInfo peer = m_peers.value(QXmppJid(jid).bareJid());
+    if ((m_supportedMethods & QXmppTransferJob::InBandMethod) &&
+        !peer.socksFailed.isNull() && peer.socksFailed.elapsed() < peerFailureTtl)
+        return m_supportedMethods & ~QXmppTransferJob::SocksMethod;
+    return m_supportedMethods;
+}
+
+/// Accept an incoming offer automatically if it matches an interrupted
+/// transfer recorded in the journal, resuming from the data already held.
+
+bool QXmppTransferManager::journalResume(QXmppTransferJob *job)
+{
+    if (!m_journal || !job->m_rangeSupported || job->fileSize() <= 0)
+        return false;
+
+    foreach (const QString &key, m_journal->childGroups())
     {
-        QXmppElement option;
-        option.setTagName("option");
-        field.appendChild(option);
+        m_journal->beginGroup(key);
+        const bool match = m_journal->value("direction").toString() == "incoming" &&
+            QXmppJid(m_journal->value("jid").toString()).bareJid() == job->m_peer.bareJid() &&
+            m_journal->value("name").toString() == job->fileName() &&
+            m_journal->value("size").toLongLong() == job->fileSize() &&
+            m_journal->value("hash").toByteArray() == job->fileHash().toHex();
+        const QString path = m_journal->value("path").toString();
+        const qint64 done = m_journal->value("done").toLongLong();
+        m_journal->endGroup();
+        if (!match)
+            continue;
+
+        m_journal->remove(key);
+        m_journal->sync();
+
+        QFile *device = new QFile(path, job);
+        if (!device->open(QIODevice::ReadWrite))
+        {
+            delete device;
+            return false;
+        }
 
-        QXmppElement value;
-        value.setTagName("value");
-        value.setValue(ns_bytestreams);
-        option.appendChild(value);
+        // the prefix is hashed again from disk as the hash
+        // state of the interrupted job was not kept
+        m_client->logger()->log(QXmppLogger::InformationMessage,
+            QString("Resuming transfer of %1 from %2").arg(job->fileName(), job->m_jid));
+        job->accept(device, qMin(done, device->size()));
+        return true;
     }
+    return false;
+}
 
-    items.append(feature);
+/// Remove a job from the journal.
 
-    // start job
-    m_jobs.append(job);
-    connect(job, SIGNAL(destroyed(QObject*)), this, SLOT(jobDestroyed(QObject*)));
-    connect(job, SIGNAL(error(QXmppTransferJob::Error)), this, SLOT(jobError(QXmppTransferJob::Error)));
-    connect(job, SIGNAL(finished()), this, SLOT(jobFinished()));
+/// Record the resume point of a job every journalInterval milliseconds,
+/// so that a transfer interrupted by a crash does not start over.
 
-    QXmppStreamInitiationIq request;
-    request.setType(QXmppIq::Set);
-    request.setTo(jid);
-    request.setProfile(QXmppStreamInitiationIq::FileTransfer);
-    request.setSiItems(items);
-    request.setSiId(job->m_sid);
-    job->m_requestId = request.id();
-    m_client->sendPacket(request);
+void QXmppTransferManager::jobProgress()
+{
+    QXmppTransferJob *job = qobject_cast<QXmppTransferJob*>(sender());
+    if (!job || job->state() != QXmppTransferJob::TransferState ||
+        job->direction() != QXmppTransferJob::IncomingDirection)
+        return;
 
-    return job;
+    if (job->m_journalTime.isNull() || job->m_journalTime.elapsed() >= journalInterval)
+        journalWrite(job);
 }
 
-void QXmppTransferManager::socksServerConnected(QTcpSocket *socket, const QString &hostName, quint16 port)
+void QXmppTransferManager::journalRemove(QXmppTransferJob *job)
 {
-    const QString ownJid = m_client->getConfiguration().jid();
-    foreach (QXmppTransferJob *job, m_jobs)
+    if (!m_journal)
+        return;
+
+    const QString key = journalKey(job);
+    if (m_journal->childGroups().contains(key))
     {
-        if (hostName == streamHash(job->m_sid, ownJid, job->jid()) && port == 0)
-        {
-            job->m_socksSocket = socket;
-            return;
-        }
+        m_journal->remove(key);
+        m_journal->sync();
     }
-    qWarning("QXmppSocksServer got a connection for a unknown stream");
-    socket->close();
+}
+
+/// Record a job and the amount of data transferred in the journal, if it
+/// transfers a file. Data which the I/O thread has not written yet is not
+/// counted, as it would be lost if the application crashed.
+
+void QXmppTransferManager::journalWrite(QXmppTransferJob *job)
+{
+    QFile *file = qobject_cast<QFile*>(job->m_iodevice);
+    if (!m_journal || !file || file->fileName().isEmpty() || job->m_parentJob)
+        return;
+
+    m_journal->beginGroup(journalKey(job));
+    m_journal->setValue("direction", job->direction() == QXmppTransferJob::IncomingDirection ? "incoming" : "outgoing");
+    m_journal->setValue("jid", job->m_jid);
+    m_journal->setValue("sid", job->m_sid);
+    m_journal->setValue("path", QFileInfo(*file).absoluteFilePath());
+    m_journal->setValue("date", datetimeToString(job->fileDate()));
+    m_journal->setValue("hash", job->fileHash().toHex());
+    m_journal->setValue("name", job->fileName());
+    m_journal->setValue("size", job->fileSize());
+    m_journal->setValue("done", job->m_done - (job->m_io ? job->m_io->bytesToWrite() : 0));
+    m_journal->endGroup();
+    m_journal->sync();
+    job->m_journalTime.start();
 }
 
 void QXmppTransferManager::socksServerSendOffer(QXmppTransferJob *job)
@@ -1019,28 +2644,16 @@ void QXmppTransferManager::socksServerSendOffer(QXmppTransferJob *job)
     const QString ownJid = m_client->getConfiguration().jid();
     QList<QXmppByteStreamIq::StreamHost> streamHosts;
 
-    // discover local IPs
+    // add local IPs
     if (!m_proxyOnly)
     {
-        foreach (const QNetworkInterface &interface, QNetworkInterface::allInterfaces())
+        foreach (const QHostAddress &address, localAddresses())
         {
-            if (!(interface.flags() & QNetworkInterface::IsRunning) ||
-                interface.flags() & QNetworkInterface::IsLoopBack)
-                continue;
-
-            foreach (const QNetworkAddressEntry &entry, interface.addressEntries())
-            {
-                if (entry.ip().protocol() != QAbstractSocket::IPv4Protocol ||
-                    entry.netmask().isNull() ||
-                    entry.netmask() == QHostAddress::Broadcast)
-                    continue;
-
-                QXmppByteStreamIq::StreamHost streamHost;
-                streamHost.setHost(entry.ip());
-                streamHost.setPort(m_socksServer->serverPort());
-                streamHost.setJid(ownJid);
-                streamHosts.append(streamHost);
-            }
+            QXmppByteStreamIq::StreamHost streamHost;
+            streamHost.setHost(address);
+            streamHost.setPort(m_socksServer->serverPort());
+            streamHost.setJid(ownJid);
+            streamHosts.append(streamHost);
         }
     }
 
@@ -1048,6 +2661,9 @@ void QXmppTransferManager::socksServerSendOffer(QXmppTransferJob *job)
     if (!job->m_socksProxy.jid().isEmpty())
         streamHosts.append(job->m_socksProxy);
 
+    // offer the stream host which worked last time first
+    streamHosts = preferStreamHost(streamHosts, m_peers.value(job->m_peer.bareJid()).socksHost);
+
     // check we have some stream hosts
     if (!streamHosts.size())
     {
@@ -1056,14 +2672,24 @@ void QXmppTransferManager::socksServerSendOffer(QXmppTransferJob *job)
         return;
     }
 
+    // remember the destination address the remote party will request
+    m_socksHashes.insert(streamHash(job->m_sid, ownJid, job->m_jid), job);
+
     // send offer
     QXmppByteStreamIq streamIq;
     streamIq.setType(QXmppIq::Set);
     streamIq.setTo(job->m_jid);
     streamIq.setSid(job->m_sid);
     streamIq.setStreamHosts(streamHosts);
-    job->m_requestId = streamIq.id();
+    setRequestId(job, streamIq.id());
     m_client->sendPacket(streamIq);
+
+    // offer the same stream hosts for the parallel streams
+    foreach (QXmppTransferJob *stream, job->m_streams)
+    {
+        stream->m_socksProxy = job->m_socksProxy;
+        socksServerSendOffer(stream);
+    }
 }
 
 void QXmppTransferManager::streamInitiationIqReceived(const QXmppStreamInitiationIq &iq)
@@ -1083,6 +2709,9 @@ void QXmppTransferManager::streamInitiationResultReceived(const QXmppStreamIniti
         job->state() != QXmppTransferJob::OfferState)
         return;
 
+    int streamCount = 1;
+    bool compressed = false;
+    bool fallback = false;
     foreach (const QXmppElement &item, iq.siItems())
     {
         if (item.tagName() == "feature" && item.attribute("xmlns") == ns_feature_negotiation)
@@ -1102,21 +2731,85 @@ void QXmppTransferManager::streamInitiationResultReceived(const QXmppStreamIniti
                 field = field.nextSiblingElement("field");
             }
         }
+        else if (item.tagName() == "file" && item.attribute("xmlns") == ns_stream_initiation_file_transfer)
+        {
+            // the remote party requested a ranged transfer
+            const QXmppElement range = item.firstChildElement("range");
+            const qint64 offset = range.attribute("offset").toLongLong();
+            if (offset > 0)
+            {
+                if (!job->m_rangeSupported || (job->fileSize() && offset >= job->fileSize()))
+                {
+                    qWarning("We received an invalid range request");
+                    job->terminate(QXmppTransferJob::ProtocolError);
+                    return;
+                }
+                if (!job->seekOffset(offset))
+                {
+                    job->terminate(QXmppTransferJob::FileAccessError);
+                    return;
+                }
+            }
+
+            // the remote party accepted parallel bytestreams
+            const QXmppElement streams = item.firstChildElement("streams");
+            if (!streams.isNull() && streams.attribute("xmlns") == ns_parallel_bytestreams)
+            {
+                const int count = streams.attribute("count").toInt();
+                if (count > job->m_streamCount || offset > 0)
+                {
+                    qWarning("We received an invalid parallel streams request");
+                    job->terminate(QXmppTransferJob::ProtocolError);
+                    return;
+                }
+                streamCount = qMax(count, 1);
+            }
+
+            // the remote party accepted compression
+            const QXmppElement compress = item.firstChildElement("compress");
+            if (!compress.isNull() && compress.attribute("xmlns") == ns_compressed_bytestreams)
+            {
+                if (!job->m_compressionLevel || compress.attribute("method") != "zlib")
+                {
+                    qWarning("We received an invalid compression request");
+                    job->terminate(QXmppTransferJob::ProtocolError);
+                    return;
+                }
+                compressed = true;
+            }
+
+            // the remote party accepted falling back to IBB
+            const QXmppElement fallbackElement = item.firstChildElement("fallback");
+            fallback = !fallbackElement.isNull() && fallbackElement.attribute("xmlns") == ns_bytestream_fallback;
+        }
+    }
+    job->m_streamCount = streamCount;
+    if (!compressed)
+        job->m_compressionLevel = 0;
+    job->m_ibbFallback = fallback && streamCount == 1 &&
+        job->method() == QXmppTransferJob::SocksMethod &&
+        (m_supportedMethods & QXmppTransferJob::InBandMethod);
+
+    // parallel streams are only available for SOCKS5 bytestreams,
+    // and they cannot be compressed
+    if (streamCount > 1 && job->method() != QXmppTransferJob::SocksMethod)
+    {
+        qWarning("We received parallel streams for an unsupported method");
+        job->terminate(QXmppTransferJob::ProtocolError);
+        return;
+    }
+    if (streamCount > 1 && compressed)
+    {
+        qWarning("We received compression for parallel streams");
+        job->terminate(QXmppTransferJob::ProtocolError);
+        return;
     }
 
     // remote party accepted stream initiation
     job->setState(QXmppTransferJob::StartState);
     if (job->method() == QXmppTransferJob::InBandMethod)
     {
-        // lower block size for IBB
-        job->m_blockSize = m_ibbBlockSize;
-
-        QXmppIbbOpenIq openIq;
-        openIq.setTo(job->m_jid);
-        openIq.setSid(job->m_sid);
-        openIq.setBlockSize(job->m_blockSize);
-        job->m_requestId = openIq.id();
-        m_client->sendPacket(openIq);
+        ibbSendOpen(job);
     } else if (job->method() == QXmppTransferJob::SocksMethod) {
         if (!m_socksServer->isListening())
         {
@@ -1124,7 +2817,15 @@ void QXmppTransferManager::streamInitiationResultReceived(const QXmppStreamIniti
             job->terminate(QXmppTransferJob::ProtocolError);
             return;
         }
-        if (!m_proxy.isEmpty())
+        if (job->m_streamCount > 1)
+            createStreams(job, job->m_streamCount);
+        if (m_proxyHosts.contains(m_proxy))
+        {
+            // we already know the proxy's address
+            job->m_socksProxy = m_proxyHosts.value(m_proxy);
+            socksServerSendOffer(job);
+        }
+        else if (!m_proxy.isEmpty())
         {
             job->m_socksProxy.setJid(m_proxy);
 
@@ -1133,7 +2834,7 @@ void QXmppTransferManager::streamInitiationResultReceived(const QXmppStreamIniti
             streamIq.setType(QXmppIq::Get);
             streamIq.setTo(job->m_socksProxy.jid());
             streamIq.setSid(job->m_sid);
-            job->m_requestId = streamIq.id();
+            setRequestId(job, streamIq.id());
             m_client->sendPacket(streamIq);
         } else {
             socksServerSendOffer(job);
@@ -1209,13 +2910,36 @@ void QXmppTransferManager::streamInitiationSetReceived(const QXmppStreamInitiati
             job->m_fileInfo.setDate(datetimeFromString(item.attribute("date")));
             job->m_fileInfo.setHash(QByteArray::fromHex(item.attribute("hash").toAscii()));
             job->m_fileInfo.setName(item.attribute("name"));
-            job->m_fileInfo.setSize(item.attribute("size").toInt());
+            job->m_fileInfo.setSize(item.attribute("size").toLongLong());
+            job->m_rangeSupported = !item.firstChildElement("range").isNull();
+
+            // the remote party offered parallel bytestreams
+            const QXmppElement streams = item.firstChildElement("streams");
+            if (!streams.isNull() && streams.attribute("xmlns") == ns_parallel_bytestreams)
+                job->m_streamCount = qMax(streams.attribute("count").toInt(), 1);
+
+            // the remote party offered compression
+            const QXmppElement compress = item.firstChildElement("compress");
+            if (!compress.isNull() && compress.attribute("xmlns") == ns_compressed_bytestreams &&
+                compress.attribute("method") == "zlib")
+                job->m_compressionLevel = m_compressionLevel;
+
+            // the remote party offered to fall back to IBB
+            const QXmppElement fallback = item.firstChildElement("fallback");
+            job->m_ibbFallback = !fallback.isNull() && fallback.attribute("xmlns") == ns_bytestream_fallback;
         }
     }
 
-    // select a method supported by both parties
-    int sharedMethods = (offeredMethods & m_supportedMethods);
-    if (sharedMethods & QXmppTransferJob::SocksMethod)
+    // select a method supported by both parties, avoiding SOCKS5 if
+    // it recently failed with this peer, and otherwise preferring
+    // whichever method was faster last time
+    int sharedMethods = (offeredMethods & peerMethods(iq.from()));
+    if (!sharedMethods)
+        sharedMethods = (offeredMethods & m_supportedMethods);
+    const PeerInfo peer = m_peers.value(QXmppJid(iq.from()).bareJid());
+    const bool ibbFaster = peer.ibbSpeed > 0 && peer.socksSpeed > 0 && peer.ibbSpeed > peer.socksSpeed;
+    if ((sharedMethods & QXmppTransferJob::SocksMethod) &&
+        !((sharedMethods & QXmppTransferJob::InBandMethod) && ibbFaster))
         job->m_method = QXmppTransferJob::SocksMethod;
     else if (sharedMethods & QXmppTransferJob::InBandMethod)
         job->m_method = QXmppTransferJob::InBandMethod;
@@ -1234,12 +2958,20 @@ void QXmppTransferManager::streamInitiationSetReceived(const QXmppStreamInitiati
         return;
     }
 
+    if (job->m_method != QXmppTransferJob::SocksMethod || !(sharedMethods & QXmppTransferJob::InBandMethod))
+        job->m_ibbFallback = false;
+
     // register job
-    m_jobs.append(job);
-    connect(job, SIGNAL(destroyed(QObject*)), this, SLOT(jobDestroyed(QObject*)));
-    connect(job, SIGNAL(finished()), this, SLOT(jobFinished()));
+    registerJob(job);
     connect(job, SIGNAL(stateChanged(QXmppTransferJob::State)), this, SLOT(jobStateChanged(QXmppTransferJob::State)));
 
+    // pick up where an interrupted transfer of the same file left off
+    if (journalResume(job))
+    {
+        emit fileResumed(job);
+        return;
+    }
+
     // allow user to accept or decline the job
     emit fileReceived(job);
 }
@@ -1260,6 +2992,9 @@ QString QXmppTransferManager::proxy() const
 /// be offered to the recipient in addition to your own IP
 /// addresses.
 ///
+/// The proxy's network address is queried once and remembered
+/// until a transfer through the proxy fails.
+///
 
 void QXmppTransferManager::setProxy(const QString &proxyJid)
 {
@@ -1287,6 +3022,25 @@ void QXmppTransferManager::setProxyOnly(bool proxyOnly)
     m_proxyOnly = proxyOnly;
 }
 
+/// Return the block size used for In-Band Bytestreams.
+///
+
+int QXmppTransferManager::ibbBlockSize() const
+{
+    return m_ibbBlockSize;
+}
+
+/// Set the block size used for outgoing In-Band Bytestreams.
+///
+/// This is also the largest block size which will be accepted
+/// for incoming In-Band Bytestreams.
+///
+
+void QXmppTransferManager::setIbbBlockSize(int bytes)
+{
+    m_ibbBlockSize = bytes;
+}
+
 /// Return the supported stream methods.
 ///
 /// The methods are a combination of zero or more QXmppTransferJob::Method.
@@ -1308,3 +3062,189 @@ void QXmppTransferManager::setSupportedMethods(int methods)
 {
     m_supportedMethods = (methods & QXmppTransferJob::AnyMethod);
 }
+
+/// Returns the zlib compression level used for file transfers,
+/// or 0 if compression is disabled.
+///
+
+int QXmppTransferManager::compressionLevel() const
+{
+    return m_compressionLevel;
+}
+
+/// Sets the zlib compression level used for file transfers, from 1
+/// (fastest) to 9 (smallest).
+///
+/// When both parties enable compression, the file data is sent over
+/// the bytestream as a single zlib stream, which is flushed after each
+/// block. This greatly reduces the bandwidth used for text files, in
+/// particular over In-Band Bytestreams which add a base64 overhead. Use
+/// QXmppTransferJob::wireBytes() to find out how many bytes were
+/// actually transferred.
+///
+/// Files which are split across parallel bytestreams are not
+/// compressed.
+///
+/// Set to 0 to disable compression, which is the default.
+///
+
+void QXmppTransferManager::setCompressionLevel(int level)
+{
+    m_compressionLevel = qBound(0, level, 9);
+}
+
+/// Returns the maximum number of parallel SOCKS5 bytestreams used
+/// for a single file transfer.
+///
+
+int QXmppTransferManager::parallelStreams() const
+{
+    return m_parallelStreams;
+}
+
+/// Sets the maximum number of parallel SOCKS5 bytestreams used for a
+/// single file transfer.
+///
+/// When both parties support it, large files are split into ranges
+/// which are transferred over separate connections, which can help
+/// on links with a high latency or per-connection throttling. This
+/// requires the file to be read from or written to a QFile, which
+/// for incoming transfers must be opened with QIODevice::ReadWrite.
+///
+/// Set to 1 to use a single bytestream, which is the default.
+///
+
+void QXmppTransferManager::setParallelStreams(int count)
+{
+    m_parallelStreams = qMax(count, 1);
+}
+
+/// Returns true if disk I/O for SOCKS5 bytestreams is performed on a
+/// worker thread.
+///
+
+bool QXmppTransferManager::threadedIo() const
+{
+    return m_threadedIo;
+}
+
+/// Sets whether disk I/O for SOCKS5 bytestreams should be performed on a
+/// worker thread, so that a slow disk does not stall the XMPP stream.
+///
+/// Outgoing files are then read ahead and incoming data is queued for
+/// writing, up to a bounded amount per job. When the write queue is
+/// full, the job stops reading from the bytestream until the disk has
+/// caught up. This applies to jobs which read from or write to a QFile
+/// and which start transferring after this setting is changed.
+///
+
+void QXmppTransferManager::setThreadedIo(bool threaded)
+{
+    m_threadedIo = threaded;
+
+    // the thread is kept until we are destroyed, as running
+    // jobs keep using it even if the setting is turned off
+    if (m_threadedIo && !m_ioThread)
+    {
+        m_ioThread = new QThread(this);
+        m_ioThread->start();
+    }
+    foreach (QXmppTransferJob *job, m_jobs)
+        job->m_ioThread = m_threadedIo ? m_ioThread : 0;
+}
+
+/// Returns the path of the journal in which interrupted transfers are
+/// recorded, or an empty string if no journal is kept.
+///
+
+QString QXmppTransferManager::journalPath() const
+{
+    return m_journal ? m_journal->fileName() : QString();
+}
+
+/// Sets the path of the journal in which file transfers are recorded.
+///
+/// Transfers which are interrupted, for instance because the connection to
+/// the server was lost, are kept in the journal. Each time the client
+/// connects, outgoing files are offered again, and the remote party is
+/// asked to resume from the data it already holds. Incoming offers which
+/// match an interrupted transfer are accepted automatically and resumed.
+/// Only transfers which read from or write to a QFile are recorded.
+///
+/// Set an empty path to stop keeping a journal.
+///
+/// \param path as a QString
+///
+
+void QXmppTransferManager::setJournalPath(const QString &path)
+{
+    delete m_journal;
+    m_journal = 0;
+    if (!path.isEmpty())
+        m_journal = new QSettings(path, QSettings::IniFormat, this);
+}
+
+/// Returns the maximum number of jobs which can be active at once,
+/// or 0 if there is no limit.
+///
+
+int QXmppTransferManager::maximumActiveJobs() const
+{
+    return m_maximumActiveJobs;
+}
+
+/// Sets the maximum number of jobs which can be active at once.
+///
+/// Outgoing offers and accepted incoming jobs beyond this limit are
+/// queued and started by order of priority as other jobs finish.
+/// Set to 0 to disable the limit, which is the default.
+///
+
+void QXmppTransferManager::setMaximumActiveJobs(int count)
+{
+    m_maximumActiveJobs = count;
+    startQueuedJobs();
+}
+
+/// Returns the maximum bandwidth in bytes per second shared by all
+/// transfer jobs, or 0 if there is no limit.
+///
+
+qint64 QXmppTransferManager::bandwidthLimit() const
+{
+    return m_bandwidthLimit;
+}
+
+/// Sets the maximum bandwidth in bytes per second shared by all
+/// transfer jobs. The bandwidth is divided between running jobs
+/// in proportion to their QXmppTransferJob::Priority.
+///
+/// Set to 0 to disable the limit, which is the default.
+///
+
+void QXmppTransferManager::setBandwidthLimit(qint64 bytesPerSecond)
+{
+    m_bandwidthLimit = qMax(bytesPerSecond, qint64(0));
+    updateScheduler();
+}
+
+/// Returns the maximum bandwidth in bytes per second for the transfer
+/// jobs with any single remote party, or 0 if there is no limit.
+///
+
+qint64 QXmppTransferManager::peerBandwidthLimit() const
+{
+    return m_peerBandwidthLimit;
+}
+
+/// Sets the maximum bandwidth in bytes per second for the transfer
+/// jobs with any single remote party (identified by its bare JID).
+///
+/// Set to 0 to disable the limit, which is the default.
+///
+
+void QXmppTransferManager::setPeerBandwidthLimit(qint64 bytesPerSecond)
+{
+    m_peerBandwidthLimit = qMax(bytesPerSecond, qint64(0));
+    updateScheduler();
+}
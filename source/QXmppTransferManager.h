@@ -28,12 +28,18 @@
 #include <QDateTime>
 #include <QHash>
 #include <QHostAddress>
+#include <QMap>
+#include <QTime>
 #include <QVariant>
 
 #include "QXmppIq.h"
 #include "QXmppByteStreamIq.h"
+#include "QXmppJid.h"
 
+class QSettings;
 class QTcpSocket;
+class QThread;
+class QTimer;
 class QXmppByteStreamIq;
 class QXmppClient;
 class QXmppIbbCloseIq;
@@ -42,6 +48,7 @@ class QXmppIbbOpenIq;
 class QXmppSocksClient;
 class QXmppSocksServer;
 class QXmppStreamInitiationIq;
+class QXmppTransferIo;
 
 class QXmppTransferFileInfo
 {
@@ -110,8 +117,19 @@ public:
         FinishedState = 3,
     };
 
+    /// The priority of a job determines the order in which queued jobs
+    /// are started and the share of the bandwidth it receives when the
+    /// transfer manager's bandwidth is limited.
+    enum Priority
+    {
+        LowPriority = 1,    ///< Receives one share of bandwidth.
+        NormalPriority = 2, ///< Receives two shares of bandwidth.
+        HighPriority = 4,   ///< Receives four shares of bandwidth.
+    };
+
     void abort();
     void accept(QIODevice *output);
+    void accept(QIODevice *output, qint64 offset);
 
     QVariant data(int role) const;
     void setData(int role, const QVariant &value);
@@ -120,9 +138,26 @@ public:
     QXmppTransferJob::Error error() const;
     QString jid() const;
     QXmppTransferJob::Method method() const;
+    QXmppTransferJob::Priority priority() const;
+    void setPriority(QXmppTransferJob::Priority priority);
     QString sid() const;
     QXmppTransferJob::State state() const;
 
+    bool isRangeSupported() const;
+    qint64 rangeOffset() const;
+
+    bool isCompressed() const;
+    qint64 wireBytes() const;
+
+    int progressInterval() const;
+    void setProgressInterval(int msecs);
+    qint64 progressStep() const;
+    void setProgressStep(qint64 bytes);
+
+    qint64 averageSpeed() const;
+    int remainingTime() const;
+    qint64 speed() const;
+
     // XEP-0096 : File transfer
     QXmppTransferFileInfo fileInfo() const;
     QDateTime fileDate() const;
@@ -145,6 +180,13 @@ signals:
     void finished();
 
     /// This signal is emitted to indicate the progress of this transfer job.
+    ///
+    /// The \a done and \a total values count file bytes, use wireBytes()
+    /// to find out how many bytes went over the bytestream.
+    ///
+    /// The signal is throttled according to progressInterval() and
+    /// progressStep(), but it is always emitted once the last byte
+    /// has been transferred.
     void progress(qint64 done, qint64 total);
 
     /// This signal is emitted when the transfer job changes state.
@@ -152,6 +194,8 @@ signals:
 
 private slots:
     void disconnected();
+    void hashStreams();
+    void ioReady();
     void receiveData();
     void sendData();
     void slotTerminated();
@@ -159,7 +203,17 @@ private slots:
 private:
     QXmppTransferJob(const QString &jid, QXmppTransferJob::Direction direction, QObject *parent);
     void checkData();
+    qint64 doneBytes() const;
+    bool isBlocked() const;
+    bool mapFile();
+    qint64 mappedEnd() const;
+    QByteArray readData(qint64 maxSize, qint64 *dataSize);
+    void reportProgress();
+    bool seekOffset(qint64 offset);
     void setState(QXmppTransferJob::State state);
+    bool startIo();
+    qint64 streamEnd() const;
+    void streamFinished(QXmppTransferJob *stream);
     void terminate(QXmppTransferJob::Error error);
     bool writeData(const QByteArray &data);
 
@@ -171,24 +225,89 @@ private:
     QIODevice *m_iodevice;
     QString m_offerId;
     QString m_jid;
+    QXmppJid m_peer;
     QString m_sid;
     Method m_method;
     QString m_mimeType;
+    Priority m_priority;
     QString m_requestId;
     State m_state;
 
+    // bytes the job may transfer before the next scheduler tick,
+    // negative if the job is not rate limited
+    qint64 m_allowance;
+    // allowance right after the last refill, to spot idle jobs
+    qint64 m_allowanceRefill;
+    // fraction of a byte of the last share, carried over to the next tick
+    double m_allowanceFraction;
+
     // arbitrary data
     QHash<int, QVariant> m_data;
 
     // file meta-data
     QXmppTransferFileInfo m_fileInfo;
 
+    // XEP-0096 ranged transfers
+    bool m_rangeSupported;
+    qint64 m_rangeOffset;
+
     // for in-band bytestreams
     int m_ibbSequence;
+    bool m_ibbStalled;
+
+    // whether the job falls back to an in-band bytestream
+    // if no SOCKS5 connection can be established
+    bool m_ibbFallback;
 
     // for socks5 bytestreams
     QTcpSocket *m_socksSocket;
     QXmppByteStreamIq::StreamHost m_socksProxy;
+    QMap<QXmppSocksClient*, QXmppByteStreamIq::StreamHost> m_socksClients;
+    QList<QXmppByteStreamIq::StreamHost> m_socksHosts;
+    QString m_socksHostName;
+    QString m_socksOfferId;
+    QTimer *m_socksTimer;
+
+    // for memory-mapped files
+    uchar *m_fileMap;
+    qint64 m_fileMapSize;
+    // size of an incoming file before it was preallocated
+    qint64 m_fileOriginalSize;
+
+    // for parallel bytestreams
+    QXmppTransferJob *m_parentJob;
+    QList<QXmppTransferJob*> m_streams;
+    int m_streamCount;
+    qint64 m_streamEnd;
+    // end of the data hashed so far, and whether hashing is scheduled
+    qint64 m_hashEnd;
+    bool m_hashScheduled;
+
+    // for disk I/O on a worker thread
+    QXmppTransferIo *m_io;
+    bool m_ioFlushing;
+    QThread *m_ioThread;
+
+    // for compressed bytestreams, the zlib stream is held by m_io
+    int m_compressionLevel;
+    qint64 m_wireDone;
+
+    // for progress reporting
+    int m_progressInterval;
+    qint64 m_progressStep;
+    qint64 m_progressReported;
+    QTime m_progressTime;
+
+    // for throughput estimation
+    QTime m_transferTime;
+    int m_transferDuration;
+    qint64 m_transferStart;
+    QTime m_sampleTime;
+    qint64 m_sampleDone;
+    qint64 m_speed;
+
+    // when the resume point was last recorded in the journal
+    QTime m_journalTime;
 
     friend class QXmppTransferManager;
 };
@@ -206,6 +325,7 @@ class QXmppTransferManager : public QObject
 
 public:
     QXmppTransferManager(QXmppClient* client);
+    ~QXmppTransferManager();
     QXmppTransferJob *sendFile(const QString &jid, const QString &fileName, const QString &sid = QString());
     QXmppTransferJob *sendFile(const QString &jid, QIODevice *device, const QXmppTransferFileInfo &fileInfo, const QString &sid = QString());
 
@@ -215,40 +335,102 @@ public:
     bool proxyOnly() const;
     void setProxyOnly(bool proxyOnly);
 
+    int ibbBlockSize() const;
+    void setIbbBlockSize(int bytes);
+
     int supportedMethods() const;
     void setSupportedMethods(int methods);
 
+    int compressionLevel() const;
+    void setCompressionLevel(int level);
+
+    int parallelStreams() const;
+    void setParallelStreams(int count);
+
+    bool threadedIo() const;
+    void setThreadedIo(bool threaded);
+
+    QString journalPath() const;
+    void setJournalPath(const QString &path);
+
+    int maximumActiveJobs() const;
+    void setMaximumActiveJobs(int count);
+
+    qint64 bandwidthLimit() const;
+    void setBandwidthLimit(qint64 bytesPerSecond);
+
+    qint64 peerBandwidthLimit() const;
+    void setPeerBandwidthLimit(qint64 bytesPerSecond);
+
 signals:
     /// This signal is emitted when a new file transfer offer is received.
     ///
     /// To accept the transfer job, call the job's QXmppTransferJob::accept() method.
     /// To refuse the transfer job, call the job's QXmppTransferJob::abort() method.
     void fileReceived(QXmppTransferJob *offer);
+
+    /// This signal is emitted when an interrupted transfer recorded in the
+    /// journal is resumed, either because we offered the file again or
+    /// because the remote party offered a file we had partially received.
+    ///
+    /// Resumed incoming jobs are accepted automatically and write to the
+    /// same file as before, which is owned by the job.
+    void fileResumed(QXmppTransferJob *job);
+
     void finished(QXmppTransferJob *job);
 
 private slots:
     void byteStreamIqReceived(const QXmppByteStreamIq&);
+    void connected();
+    void disconnected();
     void ibbCloseIqReceived(const QXmppIbbCloseIq&);
     void ibbDataIqReceived(const QXmppIbbDataIq&);
+    void ibbIoReady();
     void ibbOpenIqReceived(const QXmppIbbOpenIq&);
     void iqReceived(const QXmppIq&);
     void jobDestroyed(QObject *object);
     void jobError(QXmppTransferJob::Error error);
     void jobFinished();
+    void jobProgress();
     void jobStateChanged(QXmppTransferJob::State state);
+    void jobTransferStarted(QXmppTransferJob::State state);
+    void schedulerTick();
+    void socksClientError();
+    void socksClientReady();
+    void socksClientTimeout();
     void socksServerConnected(QTcpSocket *socket, const QString &hostName, quint16 port);
     void streamInitiationIqReceived(const QXmppStreamInitiationIq&);
 
 private:
+    QXmppTransferJob *getJobByProxyRequestId(const QString &jid, const QString &id);
     QXmppTransferJob *getJobByRequestId(const QString &jid, const QString &id);
     QXmppTransferJob *getJobBySid(const QString &jid, const QString &sid);
     void byteStreamResponseReceived(const QXmppIq&);
     void byteStreamResultReceived(const QXmppByteStreamIq&);
     void byteStreamSetReceived(const QXmppByteStreamIq&);
     void ibbResponseReceived(const QXmppIq&);
+    void ibbSendData(QXmppTransferJob *job);
+    void ibbSendOpen(QXmppTransferJob *job);
+    int peerMethods(const QString &jid) const;
     void streamInitiationResultReceived(const QXmppStreamInitiationIq&);
     void streamInitiationSetReceived(const QXmppStreamInitiationIq&);
+    void streamInitiationSendOffer(QXmppTransferJob *job);
+    void streamInitiationSendResult(QXmppTransferJob *job);
+    void socksClientCancel(QXmppTransferJob *job);
+    void socksClientConnect(QXmppTransferJob *job);
+    void socksClientFailed(QXmppTransferJob *job);
     void socksServerSendOffer(QXmppTransferJob *job);
+    QList<QHostAddress> localAddresses();
+    bool journalResume(QXmppTransferJob *job);
+    void journalRemove(QXmppTransferJob *job);
+    void journalWrite(QXmppTransferJob *job);
+    void createStreams(QXmppTransferJob *job, int count);
+    void registerJob(QXmppTransferJob *job);
+    void setRequestId(QXmppTransferJob *job, const QString &id);
+
+    bool canStartJob() const;
+    void startQueuedJobs();
+    void updateScheduler();
 
     // reference to client object (no ownership)
     QXmppClient* m_client;
@@ -257,7 +439,40 @@ private:
     QString m_proxy;
     bool m_proxyOnly;
     QXmppSocksServer *m_socksServer;
+    QList<QHostAddress> m_localAddresses;
+    QTime m_localAddressesTime;
+    QHash<QString, QXmppByteStreamIq::StreamHost> m_proxyHosts;
     int m_supportedMethods;
+    int m_compressionLevel;
+    int m_parallelStreams;
+    bool m_threadedIo;
+    QThread *m_ioThread;
+    QSettings *m_journal;
+
+    // what we learnt about remote parties from previous transfers,
+    // by bare jid since a peer's network does not depend on its resource
+    struct PeerInfo
+    {
+        PeerInfo() : ibbSpeed(0), socksSpeed(0) {}
+
+        QTime socksFailed;
+        QString socksHost;
+        qint64 ibbSpeed;
+        qint64 socksSpeed;
+    };
+    QHash<QString, PeerInfo> m_peers;
+
+    // job indexes
+    QHash<QString, QXmppTransferJob*> m_requestIds;
+    QHash<QPair<QString, QString>, QXmppTransferJob*> m_sids;
+    QHash<QString, QXmppTransferJob*> m_socksHashes;
+
+    // scheduling
+    qint64 m_bandwidthLimit;
+    int m_maximumActiveJobs;
+    qint64 m_peerBandwidthLimit;
+    QList<QXmppTransferJob*> m_queuedJobs;
+    QTimer *m_schedulerTimer;
 };
 
 #endif
@@ -32,6 +32,7 @@
 
 #include "QXmppVCard.h"
 #include "QXmppUtils.h"
+#include "QXmppCodec.h"
 #include "QXmppConstants.h"
 
 static QString getImageType(const QByteArray& image)
@@ -163,10 +164,9 @@ void QXmppVCard::parse(const QDomElement& nodeRecv)
     m_lastName = nameElement.firstChildElement("FAMILY").text();
     m_middleName = nameElement.firstChildElement("MIDDLE").text();
     m_url = cardElement.firstChildElement("URL").text();
-    QByteArray base64data = cardElement.
-                            firstChildElement("PHOTO").
-                            firstChildElement("BINVAL").text().toAscii();
-    setPhoto(QByteArray::fromBase64(base64data));
+    setPhoto(base64Decode(cardElement.
+                          firstChildElement("PHOTO").
+                          firstChildElement("BINVAL").text()));
 }
 
 void QXmppVCard::toXmlElementFromChild(QXmlStreamWriter *writer) const
@@ -197,7 +197,9 @@ void QXmppVCard::toXmlElementFromChild(QXmlStreamWriter *writer) const
     {
         writer->writeStartElement("PHOTO");
         helperToXmlAddTextElement(writer, "TYPE", getImageType(photo()));
-        helperToXmlAddTextElement(writer, "BINVAL", photo().toBase64());
+        writer->writeStartElement("BINVAL");
+        base64Write(writer, photo());
+        writer->writeEndElement();
         writer->writeEndElement();
     }
 
@@ -1,6 +1,9 @@
 TEMPLATE = lib
 QT += network \
     xml
+
+# zlib for compressed bytestreams
+LIBS += -lz
 CONFIG += staticlib \
     debug_and_release
 
@@ -22,15 +25,19 @@ HEADERS += QXmppUtils.h \
     QXmppArchiveManager.h \
     QXmppBind.h \
     QXmppByteStreamIq.h \
+    QXmppCapabilitiesManager.h \
     QXmppClient.h \
+    QXmppCodec.h \
     QXmppConfiguration.h \
     QXmppConstants.h \
     QXmppDataForm.h \
     QXmppDiscoveryIq.h \
+    QXmppDiscoveryManager.h \
     QXmppElement.h \
     QXmppIbbIq.h \
     QXmppInformationRequestResult.h \
     QXmppInvokable.h \
+    QXmppJid.h \
     QXmppIq.h \
     QXmppLogger.h \
     QXmppMessage.h \
@@ -40,11 +47,13 @@ HEADERS += QXmppUtils.h \
     QXmppPresence.h \
     QXmppRoster.h \
     QXmppRosterIq.h \
+    QXmppRosterStore.h \
     QXmppSession.h \
     QXmppSocks.h \
     QXmppStanza.h \
     QXmppStream.h \
     QXmppStreamInitiationIq.h \
+    QXmppTransferIo.h \
     QXmppTransferManager.h \
     QXmppReconnectionManager.h \
     QXmppRemoteMethod.h \
@@ -60,15 +69,19 @@ SOURCES += QXmppUtils.cpp \
     QXmppArchiveManager.cpp \
     QXmppBind.cpp \
     QXmppByteStreamIq.cpp \
+    QXmppCapabilitiesManager.cpp \
     QXmppClient.cpp \
+    QXmppCodec.cpp \
     QXmppConfiguration.cpp \
     QXmppConstants.cpp \
     QXmppDataForm.cpp \
     QXmppDiscoveryIq.cpp \
+    QXmppDiscoveryManager.cpp \
     QXmppElement.cpp \
     QXmppIbbIq.cpp \
     QXmppInformationRequestResult.cpp \
     QXmppInvokable.cpp \
+    QXmppJid.cpp \
     QXmppIq.cpp \
     QXmppLogger.cpp \
     QXmppMessage.cpp \
@@ -78,11 +91,13 @@ SOURCES += QXmppUtils.cpp \
     QXmppPresence.cpp \
     QXmppRoster.cpp \
     QXmppRosterIq.cpp \
+    QXmppRosterStore.cpp \
     QXmppSession.cpp \
     QXmppSocks.cpp \
     QXmppStanza.cpp \
     QXmppStream.cpp \
     QXmppStreamInitiationIq.cpp \
+    QXmppTransferIo.cpp \
     QXmppTransferManager.cpp \
     QXmppReconnectionManager.cpp \
     QXmppRemoteMethod.cpp \
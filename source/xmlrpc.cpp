@@ -1,4 +1,5 @@
 #include "xmlrpc.h"
+#include "QXmppCodec.h"
 #include <QMap>
 #include <QVariant>
 #include <QDateTime>
@@ -106,7 +107,9 @@ void XMLRPC::MessageBase::marshall( QXmlStreamWriter *writer, const QVariant &va
 		}
 		case QVariant::ByteArray:
 		{
-                        writer->writeTextElement("base64", value.toByteArray().toBase64() );
+                        writer->writeStartElement("base64");
+                        base64Write(writer, value.toByteArray());
+                        writer->writeEndElement();
 			break;
 		}
 		default:
@@ -277,9 +280,7 @@ QVariant XMLRPC::MessageBase::demarshall( const QDomElement &elem ) const
 	else if( typeName == "base64" )
 	{
 		QVariant returnVariant;
-		QByteArray dest;
-		QByteArray src = typeData.text().toLatin1();
-		dest = QByteArray::fromBase64( src );
+		QByteArray dest = base64Decode( typeData.text() );
 		QDataStream ds(&dest, QIODevice::ReadOnly);
 		ds.setVersion(QDataStream::Qt_4_0);
 		ds >> returnVariant;